@@ -1,28 +1,617 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "fontfilter.h"
 
+#include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <sys/eventfd.h>
+#include <unistd.h>
+
 #include <fontconfig/fontconfig.h>
 
 #include <tyrant.h>
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+// Fonts tested by a worker before moving on to the next queued query
+#define FILTER_SLICE_LEN 1024
+#define MAX_WORKERS 64
+
+// One bit per block of 1024 code points, 64 blocks per plane, 17 planes
+#define PAGE_SUMMARY_BLOCK_BITS 10
+#define PAGE_SUMMARY_NWORDS 17
+
+// Languages beyond the first 512 known to fontconfig are tested directly
+#define LANG_MASK_NWORDS 8
+
+#define NO_NAME SIZE_MAX
+
+// Numeric properties with a histogram in `FfIndex`, see `histogram_objects`
+#define NHISTOGRAMS 8
+#define HISTOGRAM_MAX_BUCKETS 256
+
+// Properties with an interval index in `FfIndex`, see `range_objects`
+#define NRANGE_INDEXES 3
+
+// Longest (case folded) string of a fuzzy match, which bounds the row of
+// distances kept while testing it
+#define MAX_FUZZY_LEN 256
+
+// Code points which `FcStrDowncase()` may fold, and the most code points they
+// fold to
+#define MAX_FOLDED_CHAR 0x1ffff
+#define MAX_FOLD_LEN 3
+
+// Fonts sampled for estimates, which bounds their precision
+#define ESTIMATE_SAMPLE_LEN 4096
+// For 95% confidence intervals
+#define ESTIMATE_Z 1.96
+
+struct FfPageSummary {
+	uint64_t words[PAGE_SUMMARY_NWORDS];
+};
+
+struct FfLangMask {
+	uint64_t words[LANG_MASK_NWORDS];
+};
+
+typedef struct LangTable {
+	FcStrSet *set;
+	const FcChar8 **langs;
+	size_t len;
+} LangTable;
+
+// Shared by every condition and index, and created on first use
+static pthread_once_t lang_table_once = PTHREAD_ONCE_INIT;
+static LangTable lang_table;
+static bool has_lang_table;
+
+typedef struct Fold {
+	FcChar32 c;
+	FcChar32 folded[MAX_FOLD_LEN];
+	size_t len;
+} Fold;
+
+// Non-ASCII code points which `FcStrDowncase()` changes, sorted, so that
+// strings can be folded while they're decoded, without allocating
+typedef struct FoldTable {
+	Fold *folds;
+	size_t len;
+} FoldTable;
+
+// Shared by every fuzzy match, and created on first use
+static pthread_once_t fold_table_once = PTHREAD_ONCE_INIT;
+static FoldTable fold_table;
+static bool has_fold_table;
+
+typedef struct FontInfo {
+	FfPageSummary charset;
+	FfLangMask langs;
+	bool has_charset;
+	bool has_langs;
+
+	// Range of `FfIndex.value_lists` holding the font's properties with
+	// several values
+	size_t first_value_list;
+	size_t nvalue_lists;
+} FontInfo;
+
+// Values of a font's property, copied (but not duplicated) from the pattern
+// into `FfIndex.values`, since fontconfig has no public cursor over them
+typedef struct ValueList {
+	const char *object;
+	size_t first;
+	size_t len;
+} ValueList;
+
+typedef struct FuzzyName {
+	FcChar8 *folded;
+	FcChar32 *chars;
+	size_t len;
+
+	// Positions of the fonts with the name
+	size_t *fonts;
+	size_t nfonts;
+	size_t cap;
+
+	// BK-tree links (positions in `FfIndex.names`, or `NO_NAME`), children
+	// being labelled with their distance to the parent
+	size_t first_child;
+	size_t next_sibling;
+	size_t distance;
+	size_t max_child_distance;
+} FuzzyName;
+
+typedef struct FuzzyHit {
+	size_t name;
+	size_t distance;
+} FuzzyHit;
+
+// Fonts whose first value of a property is real, by value. Buckets have
+// `lo == hi` unless there are too many distinct values to have one each.
+typedef struct Bucket {
+	double lo;
+	double hi;
+	size_t count;
+	size_t ndistinct;
+} Bucket;
+
+typedef struct Histogram {
+	Bucket *buckets;
+	size_t nbuckets;
+
+	size_t nreal;
+	// Fonts whose first value isn't real (fonts without any aren't counted)
+	size_t nother;
+} Histogram;
+
+// A font's first value of a property, as an interval, reals being degenerate
+typedef struct RangeEntry {
+	double from;
+	double to;
+	size_t pos;
+	bool is_range;
+
+	// Largest `from` in the left subtree
+	double split;
+} RangeEntry;
+
+// Priority search tree, in which each subtree is stored in a range of
+// `entries`: first the entry with the largest `to`, then the left and right
+// subtrees, holding the rest of the entries split in halves by `from`
+typedef struct RangeIndex {
+	RangeEntry *entries;
+	size_t len;
+
+	// Fonts with any value, even one which isn't an interval
+	uint64_t *present;
+} RangeIndex;
+
+// Results of a containment query, as positions in the set
+typedef struct RangeQuery {
+	double from;
+	double to;
+	bool is_range;
+
+	size_t *positions;
+	size_t npositions;
+} RangeQuery;
+
+// Estimated fraction of fonts, with `objects` being a bit per histogram the
+// estimate was made from
+typedef struct Model {
+	double p;
+	double low;
+	double high;
+	uint32_t objects;
+} Model;
+
+struct FfIndex {
+	FcFontSet *set;
+	FontInfo *fonts;
+
+	Histogram histograms[NHISTOGRAMS];
+	RangeIndex ranges[NRANGE_INDEXES];
+	// Prefix of a random permutation of the fonts' positions
+	size_t *sample;
+	size_t nsample;
+
+	ValueList *value_lists;
+	FcValue *values;
+
+	// Distinct (case folded) family names, the first is the BK-tree's root
+	FuzzyName *names;
+	size_t nnames;
+	size_t max_name_len;
+};
+
+static const char *const histogram_objects[NHISTOGRAMS] = {
+	FC_SLANT,
+	FC_WEIGHT,
+	FC_WIDTH,
+	FC_SPACING,
+	FC_SIZE,
+	FC_PIXEL_SIZE,
+	FC_INDEX,
+	FC_FONTVERSION
+};
+
+// Properties which variable fonts may have ranges of
+static const char *const range_objects[NRANGE_INDEXES] = {
+	FC_WEIGHT,
+	FC_WIDTH,
+	FC_SIZE
+};
+
+// Per-query results computed from the index before a scan
+typedef struct Prepared {
+	const FfCondition *condition;
+	uint64_t *fonts;
+} Prepared;
+
+typedef struct Eval {
+	const FfIndex *index;
+	size_t pos;
+
+	// Hash table keyed by condition, empty slots having a NULL condition,
+	// since it's looked up for every condition tested on every font
+	Prepared *prepared;
+	size_t nslots;
+	size_t nprepared;
+} Eval;
+
+struct FfFilterTicket {
+	FfFilterKind kind;
+	FfCondition *condition;
+	FfList list;
+	FcFontSet *set;
+	FfFilterCallback *callback;
+	void *data;
+	FfCompletionQueue *queue;
+
+	// Progress, only touched by the worker evaluating the ticket
+	FcFontSet *filtered;
+	FcFontSet *candidates;
+	size_t ncondition;
+	int pos;
+
+	// Guarded by `pool.mutex`
+	FfFilterStatus status;
+	bool cancelled;
+	// Whether the callback has returned and the ticket has been pushed to
+	// the completion queue, i.e. the worker is done with the query
+	bool delivered;
+	bool in_run_queue;
+	bool in_completion_queue;
+	size_t nrefs;
+	FcFontSet *result;
+	FfFilterTicket *next_run;
+	FfFilterTicket *next_completed;
+};
+
+struct FfCompletionQueue {
+	int fd;
+
+	// Guarded by `pool.mutex`
+	FfFilterTicket *head;
+	FfFilterTicket *tail;
+	// Tickets submitted with the queue which haven't been delivered
+	size_t nundelivered;
+};
+
+typedef struct Pool {
+	pthread_once_t once;
+	pthread_mutex_t mutex;
+	pthread_cond_t work;
+	pthread_cond_t finished;
+
+	size_t nworkers;
+	FfFilterTicket *head;
+	FfFilterTicket *tail;
+} Pool;
+
+static Pool pool = {
+	.once = PTHREAD_ONCE_INIT,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.finished = PTHREAD_COND_INITIALIZER,
+	.nworkers = 0,
+	.head = NULL,
+	.tail = NULL
+};
+
+typedef struct Ranked {
+	double score;
+	size_t pos;
+} Ranked;
+
+typedef struct Interner {
+	const FcChar8 **strings;
+	size_t len;
+	size_t cap;
+
+	// Ids (positions in `strings` plus one), zero for empty slots
+	uint32_t *slots;
+	size_t nslots;
+} Interner;
+
+// Set of the (`FC_FILE`, `FC_INDEX`) pairs of the fonts seen so far
+typedef struct FontKey {
+	// NULL for empty slots
+	const FcChar8 *file;
+	int index;
+} FontKey;
+
+typedef struct FontKeys {
+	FontKey *slots;
+	size_t nslots;
+	size_t len;
+} FontKeys;
+
+typedef struct Grouper {
+	const char *const *objects;
+	size_t nobjects;
+	const FfList *best;
+
+	Interner interner;
+
+	// `nobjects` string ids per group, zero where the object is missing
+	uint32_t *keys;
+	// `best->len` results per group, for the group's best font
+	bool *passed;
+	size_t cap;
+
+	// Group positions plus one, zero for empty slots
+	size_t *slots;
+	size_t nslots;
+
+	uint32_t *font_key;
+	FfGroupSet *groups;
+} Grouper;
+
+// State of `ff_cover_text()`, with candidates (fonts covering at least one code
+// point) referred to by their positions in the arrays below
+typedef struct Cover {
+	// Distinct code points of the text, sorted
+	FcChar32 *chars;
+	size_t nchars;
+	// Words per bitset over `chars`
+	size_t nwords;
+	uint64_t *uncovered;
+
+	size_t nconditions;
+
+	// Per candidate: its position in the set, the code points it covers,
+	// the conditions of the list it satisfies, and an upper bound of its
+	// gain
+	size_t *positions;
+	uint64_t *covered;
+	bool *passed;
+	size_t *gains;
+	size_t ncandidates;
+	size_t cap;
+
+	// Max-heap of the remaining (deduplicated) candidates
+	size_t *heap;
+	size_t nheap;
+} Cover;
+
+static bool is_valid_lang_tag(const char *lang);
+static FfCondition *require_langs(const char *const *langs, size_t nlangs,
+		bool all);
+static FcFontSet *filter_set(FfCondition *condition, const FfList *list,
+		FcFontSet *set, Eval *eval);
+static FcFontSet *filter_sets(FfCondition *condition, const FfList *list,
+		FcFontSet **sets, size_t nsets);
+static bool add_font_key(FontKeys *keys, FcPattern *font, bool *ret_added);
+static bool rehash_font_keys(FontKeys *keys);
+static uint64_t hash_font_key(FontKey key);
+static FfGroupSet *filter_grouped(FfCondition *condition, const FfList *list,
+		FcFontSet *set, const char *const *objects, size_t nobjects,
+		const FfList *best);
+
+typedef struct Literal {
+	FfCondition *condition;
+	bool positive;
+} Literal;
+
+typedef struct LiteralList {
+	Literal *literals;
+	size_t len;
+	size_t cap;
+} LiteralList;
+
+// Hash-consing table of the conditions produced while optimizing
+typedef struct Optimizer {
+	FfCondition **nodes;
+	size_t len;
+	size_t cap;
+	// Index + 1 into `nodes`, 0 for empty slots
+	size_t *slots;
+	size_t nslots;
+} Optimizer;
+
 static void destroy_condition(FfCondition *condition);
 static bool inc_ref_count(size_t *ref_count);
 static bool dec_ref_count(size_t *ref_count);
-static bool test_comparison(FfComparison comparison, FcPattern *pattern);
+static bool test_condition(FfCondition *condition, FcPattern *pattern,
+		const Eval *eval);
+static bool test_list(FfList list, FcPattern *pattern, const Eval *eval);
+static bool test_comparison(FfComparison comparison, FcPattern *pattern,
+		const Eval *eval);
 static bool test_composition(FfLogicalComposition composition,
-		FcPattern *pattern);
+		FcPattern *pattern, const Eval *eval);
 static bool test_char_requirement(FfCharRequirement char_requirement,
 		FcPattern *pattern);
+static bool test_interval(FfInterval interval, FcPattern *pattern);
+static bool test_lang_requirement(FfLangRequirement lang_requirement,
+		FcPattern *pattern, const Eval *eval);
+static bool test_fuzzy_match(FfFuzzyMatch fuzzy_match, FcPattern *pattern);
 static bool test_comparison_for_value(FfComparison comparison, FcValue value);
 static bool contains(FcValue a, FcValue b);
+static bool reject_by_page_summary(FfComparison comparison,
+		const Eval *eval, bool *ret_result);
+static bool page_summary_is_subset(const FfPageSummary *a,
+		const FfPageSummary *b);
+static void summarize_charset(const FcCharSet *charset,
+		FfPageSummary *summary);
+static const LangTable *get_lang_table(void);
+static void init_lang_table(void);
+static bool create_lang_table(LangTable *table);
+static int compare_langs(const void *a, const void *b);
+static size_t find_lang(const LangTable *table, const FcChar8 *lang);
+static void summarize_langset(const LangTable *table, const FcLangSet *langset,
+		FfLangMask *mask);
+static void init_font_info(FcPattern *font, const LangTable *table,
+		FontInfo *info);
+static bool index_values(FfIndex *index);
+static const ValueList *find_value_list(const Eval *eval, const char *object);
+static const FoldTable *get_fold_table(void);
+static void init_fold_table(void);
+static bool create_fold_table(FoldTable *table);
+static bool is_surrogate(FcChar32 c);
+static size_t fold_char(const FoldTable *table, FcChar32 c,
+		FcChar32 *folded);
+static FcChar32 *fold_string(const FcChar8 *string, size_t *ret_len);
+static FcChar32 *decode_utf8(const FcChar8 *string, size_t *ret_len);
+static size_t edit_distance(const FcChar32 *a, size_t a_len,
+		const FcChar32 *b, size_t b_len, size_t bound, size_t *row);
+static size_t edit_distance_folded(const FcChar32 *a, size_t a_len,
+		const FcChar8 *b, const FoldTable *table, size_t bound,
+		size_t *row);
+static size_t update_distances(const FcChar32 *a, size_t a_len, FcChar32 c,
+		size_t j, size_t *row);
+static bool index_names(FfIndex *index);
+static bool add_name(FfIndex *index, Interner *interner, size_t *cap,
+		FcChar8 *folded, size_t pos);
+static void build_name_tree(FfIndex *index, size_t *row);
+static void destroy_names(FfIndex *index);
+static bool search_names(const FfIndex *index, const FcChar32 *query,
+		size_t len, size_t max_distance, FuzzyHit **ret_hits,
+		size_t *ret_nhits);
+static int compare_hits(const void *a, const void *b);
+static void init_eval(Eval *eval, const FfIndex *index);
+static void destroy_eval(Eval *eval);
+static bool prepare_list(Eval *eval, FfList list);
+static bool prepare_condition(Eval *eval, const FfCondition *condition);
+static bool prepare_fuzzy_match(Eval *eval, const FfCondition *condition);
+static bool prepare_comparison(Eval *eval, const FfCondition *condition);
+static bool add_prepared(Eval *eval, const FfCondition *condition,
+		uint64_t *fonts);
+static bool rehash_prepared(Eval *eval);
+static const uint64_t *find_prepared(const Eval *eval,
+		const FfCondition *condition);
+static uint64_t hash_pointer(const void *pointer);
+static bool init_estimator(FfIndex *index);
+static void destroy_estimator(FfIndex *index);
+static bool build_histogram(FcFontSet *set, const char *object,
+		Histogram *histogram);
+static int compare_doubles(const void *a, const void *b);
+static bool init_range_indexes(FfIndex *index);
+static void destroy_range_indexes(FfIndex *index);
+static bool build_range_index(FcFontSet *set, const char *object,
+		RangeIndex *range_index);
+static void build_priority_tree(RangeEntry *entries, size_t len);
+static int compare_range_entries(const void *a, const void *b);
+static int find_range_index(const char *object);
+static bool init_range_query(RangeQuery *query, FcValue value);
+static void query_range_index(const RangeIndex *range_index, size_t start,
+		size_t end, RangeQuery *query);
+static void report_range_entries(const RangeIndex *range_index, size_t start,
+		size_t end, RangeQuery *query);
+static FcFontSet *find_containing(FfIndex *index, const char *object,
+		FcValue value);
+static int compare_positions(const void *a, const void *b);
+static uint64_t next_random(uint64_t *state);
+static FfEstimate estimate(FfCondition *condition, const FfList *list,
+		FfIndex *index, double error_bound, int *ret_status);
+static bool model_condition(const FfIndex *index, FfCondition *condition,
+		Model *ret_model);
+static bool model_comparison(const FfIndex *index, FfComparison comparison,
+		Model *ret_model);
+static bool model_interval(const FfIndex *index, FfInterval interval,
+		Model *ret_model);
+static bool model_composition(const FfIndex *index,
+		FfLogicalComposition composition, Model *ret_model);
+static bool model_list(const FfIndex *index, const FfList *list,
+		Model *ret_model);
+static Model and_models(Model p, Model q);
+static double eval_truth_table(FfLogicalOperator oper, double p, double q);
+static void bound_truth_table(FfLogicalOperator oper, Model p, Model q,
+		double *ret_low, double *ret_high);
+static double eval_joint(FfLogicalOperator oper, double p, double q,
+		double both);
+static int find_histogram(const char *object);
+static Model count_in_interval(const Histogram *histogram,
+		FfInterval interval);
 static bool eval_logical_operation(FfLogicalOperator oper, bool p, bool q);
 static FcFontSet *copy_font_set(FcFontSet *set);
+static bool init_grouper(Grouper *grouper, const char *const *objects,
+		size_t nobjects, const FfList *best);
+static void destroy_grouper(Grouper *grouper);
+static bool add_to_group(Grouper *grouper, FcPattern *font);
+static bool create_group(Grouper *grouper, size_t *ret_group);
+static bool rehash_groups(Grouper *grouper);
+static void update_best(Grouper *grouper, size_t group, FcPattern *font,
+		bool is_new);
+static bool intern_string(Interner *interner, const FcChar8 *string,
+		uint32_t *ret_id);
+static void destroy_interner(Interner interner);
+static uint64_t hash_string(const FcChar8 *string);
+static void start_workers(void);
+static void *run_worker(void *arg);
+static bool step_ticket(FfFilterTicket *ticket, size_t budget,
+		bool *ret_done);
+static bool step_soft_ticket(FfFilterTicket *ticket, size_t budget,
+		bool *ret_done);
+static FcFontSet *finish_ticket(FfFilterTicket *ticket);
+static void discard_progress(FfFilterTicket *ticket);
+static void deliver_ticket(FfFilterTicket *ticket);
+static void push_run_queue(FfFilterTicket *ticket);
+static void unlink_completed(FfFilterTicket *ticket);
+static void unref_ticket(FfFilterTicket *ticket);
+static bool ranked_is_worse(Ranked a, Ranked b);
+static void sift_down(Ranked *heap, size_t len, size_t i);
+static void sift_up(Ranked *heap, size_t i);
+static int compare_ranked(const void *a, const void *b);
+static uint64_t hash_ids(const uint32_t *ids, size_t nids);
+static bool init_cover(Cover *cover, const FcChar32 *text, size_t len,
+		size_t nconditions);
+static void destroy_cover(Cover *cover);
+static bool add_cover_candidate(Cover *cover, FfList list, FcPattern *font,
+		size_t pos);
+static bool build_cover_heap(Cover *cover);
+static bool cover_is_better(const Cover *cover, size_t a, size_t b);
+static bool cover_is_preferred(const Cover *cover, size_t a, size_t b);
+static void cover_sift_down(Cover *cover, size_t i);
+static size_t count_gain(const Cover *cover, size_t candidate);
+static uint64_t hash_words(const uint64_t *words, size_t nwords);
+static int compare_chars(const void *a, const void *b);
+static FfCondition *optimize(Optimizer *opt, FfCondition *condition);
+static FfCondition *optimize_junction(Optimizer *opt, FfCondition *condition,
+		bool conj);
+static bool collect_literals(Optimizer *opt, LiteralList *list, Literal lit,
+		bool conj);
+static FfCondition *simplify(Optimizer *opt, FfCondition *p,
+		FfLogicalOperator oper, FfCondition *q);
+static FfCondition *simplify_junction(Optimizer *opt, FfCondition *p,
+		FfLogicalOperator oper, FfCondition *q, bool conj);
+static FfCondition *reduce_junction(Optimizer *opt, LiteralList list,
+		bool conj);
+static FfCondition *simplify_unary(Optimizer *opt, FfCondition *x,
+		bool on_true, bool on_false);
+static FfCondition *negate(Optimizer *opt, FfCondition *x);
+static FfCondition *intern(Optimizer *opt, FfCondition *condition);
+static bool rehash_nodes(Optimizer *opt);
+static bool add_literal(LiteralList *list, Literal lit, bool conj);
+static void remove_literal(LiteralList *list, size_t i);
+static void destroy_literal_list(LiteralList list);
+static bool merge_intervals(Optimizer *opt, LiteralList *list,
+		bool *ret_empty);
+static bool literal_interval(Literal lit, FfInterval *interval);
+static FfInterval intersect_intervals(FfInterval a, FfInterval b);
+static bool interval_is_empty(FfInterval interval);
+static bool is_negation(FfCondition *condition);
+static bool junction_literals(FfCondition *condition, bool conj,
+		Literal ret_lits[2]);
+static FfLogicalOperator junction_operator(bool p_positive, bool q_positive,
+		bool conj);
+static FfLogicalOperator swap_p(FfLogicalOperator oper);
+static FfLogicalOperator swap_q(FfLogicalOperator oper);
+static int count_true(FfLogicalOperator oper);
+static unsigned condition_cost(FfCondition *condition);
+static bool conditions_equal(FfCondition *a, FfCondition *b);
+static bool values_identical(FcValue a, FcValue b);
+static uint64_t hash_condition(FfCondition *condition);
+static uint64_t hash_value(FcValue value);
+static uint64_t hash_double(double d);
 
 FfCondition *ff_compare(const char *object, FfRelationalOperator oper,
 		FcType type, ...)
@@ -37,12 +626,55 @@ FfCondition *ff_compare(const char *object, FfRelationalOperator oper,
 	return ff_compare_value(object, oper, value);
 }
 
+FfCondition *ff_compare_any(const char *object, FfRelationalOperator oper,
+		FcType type, ...)
+{
+	va_list va;
+	va_start(va, type);
+
+	FcValue value = ff_create_fc_value_va(type, va);
+
+	va_end(va);
+
+	return ff_compare_quantified_value(object, FF_ANY, oper, value);
+}
+
+FfCondition *ff_compare_all(const char *object, FfRelationalOperator oper,
+		FcType type, ...)
+{
+	va_list va;
+	va_start(va, type);
+
+	FcValue value = ff_create_fc_value_va(type, va);
+
+	va_end(va);
+
+	return ff_compare_quantified_value(object, FF_ALL, oper, value);
+}
+
 FfCondition *ff_compare_value(const char *object, FfRelationalOperator oper,
 		FcValue value)
+{
+	return ff_compare_quantified_value(object, FF_FIRST, oper, value);
+}
+
+FfCondition *ff_compare_quantified_value(const char *object,
+		FfQuantifier quantifier, FfRelationalOperator oper,
+		FcValue value)
 {
 	FfCondition *condition = tyrant_alloc(sizeof(*condition));
 	if (condition == NULL) {
-		return NULL;
+		goto err_exit;
+	}
+
+	FfPageSummary *page_summary = NULL;
+	if (value.type == FcTypeCharSet) {
+		page_summary = tyrant_alloc(sizeof(*page_summary));
+		if (page_summary == NULL) {
+			goto err_free_condition;
+		}
+
+		summarize_charset(value.u.c, page_summary);
 	}
 
 	*condition = (FfCondition){
@@ -50,12 +682,19 @@ FfCondition *ff_compare_value(const char *object, FfRelationalOperator oper,
 		.value.comparison = (FfComparison){
 			.object = object,
 			.value = value,
-			.oper = oper
+			.oper = oper,
+			.quantifier = quantifier,
+			.page_summary = page_summary
 		},
 
 		.ref_count = 1
 	};
 	return condition;
+
+err_free_condition:
+	tyrant_free(condition);
+err_exit:
+	return NULL;
 }
 
 FfCondition *ff_compose(FfCondition *p, FfLogicalOperator oper, FfCondition *q)
@@ -107,6 +746,216 @@ FfCondition *ff_require_char(FcChar32 c)
 	return condition;
 }
 
+FfCondition *ff_require_lang(const char *lang)
+{
+	return require_langs(&lang, 1, true);
+}
+
+FfCondition *ff_require_any_lang(const char *const *langs, size_t nlangs)
+{
+	return require_langs(langs, nlangs, false);
+}
+
+FfCondition *ff_require_all_langs(const char *const *langs, size_t nlangs)
+{
+	return require_langs(langs, nlangs, true);
+}
+
+// Whether `FcLangNormalize()` accepts `lang`, which it checks the same way,
+// except that it warns on stderr about the tags it rejects
+bool is_valid_lang_tag(const char *lang)
+{
+	if (FcStrCmpIgnoreCase((const FcChar8 *)lang, (const FcChar8 *)"C") == 0
+			|| FcStrCmpIgnoreCase((const FcChar8 *)lang,
+				(const FcChar8 *)"C.UTF-8") == 0
+			|| FcStrCmpIgnoreCase((const FcChar8 *)lang,
+				(const FcChar8 *)"C.utf8") == 0
+			|| FcStrCmpIgnoreCase((const FcChar8 *)lang,
+				(const FcChar8 *)"POSIX") == 0) {
+		return true;
+	}
+
+	// language[_territory][.codeset][@modifier], where '-' may separate
+	// the territory too
+	size_t len = strcspn(lang, ".@");
+	size_t lang_len = strcspn(lang, "_");
+	if (lang_len >= len) {
+		lang_len = strcspn(lang, "-");
+	}
+	if (lang_len > len) {
+		lang_len = len;
+	}
+
+	if (lang_len < 2 || lang_len > 3) {
+		return false;
+	}
+	if (lang_len == len) {
+		return true;
+	}
+
+	const char *territory = lang + lang_len + 1;
+	size_t territory_len = len - lang_len - 1;
+
+	return (territory_len >= 2 && territory_len <= 3)
+			|| (territory[0] == 'z' && territory_len < 5);
+}
+
+FfCondition *require_langs(const char *const *langs, size_t nlangs, bool all)
+{
+	FfCondition *condition = tyrant_alloc(sizeof(*condition));
+	if (condition == NULL) {
+		goto err_exit;
+	}
+
+	FcChar8 **normalized = TYRANT_ALLOC_ARR(normalized,
+			nlangs == 0 ? 1 : nlangs);
+	if (normalized == NULL) {
+		goto err_free_condition;
+	}
+
+	FfLangMask *mask = tyrant_alloc(sizeof(*mask));
+	if (mask == NULL) {
+		goto err_free_normalized;
+	}
+	*mask = (FfLangMask){ .words = { 0 } };
+
+	const LangTable *table = get_lang_table();
+	if (table == NULL) {
+		goto err_free_mask;
+	}
+
+	size_t nknown = 0;
+	size_t nunknown = 0;
+	for (size_t i = 0; i < nlangs; ++i) {
+		FcChar8 *lang = is_valid_lang_tag(langs[i])
+				? FcLangNormalize((const FcChar8 *)langs[i])
+				: NULL;
+		if (lang == NULL) {
+			// Not a valid tag, but may still be in a langset as is
+			lang = FcStrDowncase((const FcChar8 *)langs[i]);
+		}
+		if (lang == NULL) {
+			goto err_free_langs;
+		}
+
+		size_t bit = find_lang(table, lang);
+		if (bit < LANG_MASK_NWORDS * 64) {
+			mask->words[bit / 64] |= (uint64_t)1 << bit % 64;
+			normalized[nknown++] = lang;
+		} else {
+			normalized[nlangs - ++nunknown] = lang;
+		}
+	}
+
+	*condition = (FfCondition){
+		.type = FF_LANG_REQUIREMENT,
+		.value.lang_requirement = (FfLangRequirement){
+			.langs = normalized,
+			.nlangs = nlangs,
+			.nknown = nknown,
+			.all = all,
+			.mask = mask
+		},
+		.ref_count = 1
+	};
+	return condition;
+
+err_free_langs:
+	for (size_t i = 0; i < nknown; ++i) {
+		FcStrFree(normalized[i]);
+	}
+	for (size_t i = 0; i < nunknown; ++i) {
+		FcStrFree(normalized[nlangs - 1 - i]);
+	}
+err_free_mask:
+	tyrant_free(mask);
+err_free_normalized:
+	tyrant_free(normalized);
+err_free_condition:
+	tyrant_free(condition);
+err_exit:
+	return NULL;
+}
+
+FfCondition *ff_constant(bool value)
+{
+	FfCondition *condition = tyrant_alloc(sizeof(*condition));
+	if (condition == NULL) {
+		return NULL;
+	}
+
+	*condition = (FfCondition){
+		.type = FF_CONSTANT,
+		.value.constant = (FfConstant){ .value = value },
+		.ref_count = 1
+	};
+	return condition;
+}
+
+FfCondition *ff_compare_interval(const char *object, double from,
+		bool from_inclusive, double to, bool to_inclusive)
+{
+	FfCondition *condition = tyrant_alloc(sizeof(*condition));
+	if (condition == NULL) {
+		return NULL;
+	}
+
+	*condition = (FfCondition){
+		.type = FF_INTERVAL,
+		.value.interval = (FfInterval){
+			.object = object,
+			.from = from,
+			.to = to,
+			.from_inclusive = from_inclusive,
+			.to_inclusive = to_inclusive
+		},
+		.ref_count = 1
+	};
+	return condition;
+}
+
+FfCondition *ff_compare_fuzzy(const char *object, const char *string,
+		unsigned max_distance)
+{
+	FfCondition *condition = tyrant_alloc(sizeof(*condition));
+	if (condition == NULL) {
+		goto err_exit;
+	}
+
+	// Created now, so that testing the condition can't fail
+	if (get_fold_table() == NULL) {
+		goto err_free_condition;
+	}
+
+	size_t len;
+	FcChar32 *chars = fold_string((const FcChar8 *)string, &len);
+	if (chars == NULL) {
+		goto err_free_condition;
+	}
+	if (len > MAX_FUZZY_LEN) {
+		goto err_free_chars;
+	}
+
+	*condition = (FfCondition){
+		.type = FF_FUZZY_MATCH,
+		.value.fuzzy_match = (FfFuzzyMatch){
+			.object = object,
+			.chars = chars,
+			.len = len,
+			.max_distance = max_distance
+		},
+		.ref_count = 1
+	};
+	return condition;
+
+err_free_chars:
+	tyrant_free(chars);
+err_free_condition:
+	tyrant_free(condition);
+err_exit:
+	return NULL;
+}
+
 FfCondition *ff_compose_unref(FfCondition *p, FfLogicalOperator oper,
 		FfCondition *q)
 {
@@ -143,6 +992,24 @@ void destroy_condition(FfCondition *condition)
 		ff_condition_unref(condition->value.composition.q);
 	}
 
+	if (condition->type == FF_COMPARISON) {
+		tyrant_free(condition->value.comparison.page_summary);
+	}
+
+	if (condition->type == FF_LANG_REQUIREMENT) {
+		FfLangRequirement lang_requirement =
+				condition->value.lang_requirement;
+		for (size_t i = 0; i < lang_requirement.nlangs; ++i) {
+			FcStrFree(lang_requirement.langs[i]);
+		}
+		tyrant_free(lang_requirement.langs);
+		tyrant_free(lang_requirement.mask);
+	}
+
+	if (condition->type == FF_FUZZY_MATCH) {
+		tyrant_free(condition->value.fuzzy_match.chars);
+	}
+
 	tyrant_free(condition);
 }
 
@@ -167,6 +1034,27 @@ bool dec_ref_count(size_t *ref_count)
 	return true;
 }
 
+FfCondition *ff_condition_optimize(FfCondition *condition)
+{
+	Optimizer opt = {
+		.nodes = NULL,
+		.len = 0,
+		.cap = 0,
+		.slots = NULL,
+		.nslots = 0
+	};
+
+	FfCondition *optimized = optimize(&opt, condition);
+
+	for (size_t i = 0; i < opt.len; ++i) {
+		ff_condition_unref(opt.nodes[i]);
+	}
+	tyrant_free(opt.nodes);
+	tyrant_free(opt.slots);
+
+	return optimized;
+}
+
 FfList ff_list_create(int *ret_status)
 {
 	return ff_list_create_with_cap(8, ret_status);
@@ -294,48 +1182,45 @@ FcValue ff_create_fc_value_va(FcType type, va_list va)
 
 bool ff_condition_test_fc_pattern(FfCondition *condition, FcPattern *pattern)
 {
-	switch (condition->type) {
-	case FF_COMPARISON:
-		return test_comparison(condition->value.comparison, pattern);
-	case FF_COMPOSITION:
-		return test_composition(condition->value.composition, pattern);
-	case FF_CHAR_REQUIREMENT:
-		return test_char_requirement(condition->value.char_requirement,
-				pattern);
-	default:
-		return false;
-	}
+	return test_condition(condition, pattern, NULL);
 }
 
 bool ff_list_test_fc_pattern(FfList list, FcPattern *pattern)
 {
-	for (size_t i = 0; i < list.len; ++i) {
-		FfCondition *condition = list.conditions[i];
-		if (!ff_condition_test_fc_pattern(condition, pattern)) {
-			return false;
-		}
-	}
-
-	return true;
+	return test_list(list, pattern, NULL);
 }
 
 FcFontSet *ff_condition_filter(FfCondition *condition, FcFontSet *set)
 {
-	FcFontSet *filtered = FcFontSetCreate();
-	if (filtered == NULL) {
-		goto err_exit;
-	}
-
-	for (int i = 0; i < set->nfont; ++i) {
-		FcPattern *font = set->fonts[i];
+	return filter_set(condition, NULL, set, NULL);
+}
 
-		if (ff_condition_test_fc_pattern(condition, font)) {
-			FcPatternReference(font);
-			bool success = FcFontSetAdd(filtered, font);
-			if (!success) {
-				goto err_destroy_filtered;
-			}
+FcFontSet *ff_list_filter(FfList list, FcFontSet *set)
+{
+	return filter_set(NULL, &list, set, NULL);
+}
+
+FcFontSet *ff_list_filter_soft(FfList list, FcFontSet *set)
+{
+	FcFontSet *filtered = copy_font_set(set);
+	if (filtered == NULL) {
+		goto err_exit;
+	}
+
+	for (size_t i = 0; i < list.len && filtered->nfont > 1; ++i) {
+		FfCondition *condition = list.conditions[i];
+		FcFontSet *test_set = ff_condition_filter(condition, filtered);
+		if (test_set == NULL) {
+			goto err_destroy_filtered;
+		}
+
+		if (test_set->nfont > 0) {
+			FcFontSet *swp = filtered;
+			filtered = test_set;
+			test_set = swp;
 		}
+
+		FcFontSetDestroy(test_set);
 	}
 
 	return filtered;
@@ -346,16 +1231,82 @@ err_exit:
 	return NULL;
 }
 
-FcFontSet *ff_list_filter(FfList list, FcFontSet *set)
+FcFontSet *ff_condition_filter_sets(FfCondition *condition, FcFontSet **sets,
+		size_t nsets)
+{
+	return filter_sets(condition, NULL, sets, nsets);
+}
+
+FcFontSet *ff_list_filter_sets(FfList list, FcFontSet **sets, size_t nsets)
+{
+	return filter_sets(NULL, &list, sets, nsets);
+}
+
+FcFontSet *ff_list_filter_soft_sets(FfList list, FcFontSet **sets,
+		size_t nsets)
 {
+	FontKeys keys = { .slots = NULL, .nslots = 0, .len = 0 };
+
+	// Results for the fonts in `filtered`, which are the lexicographically
+	// greatest so far (i.e. what soft filtering keeps)
+	bool *best = TYRANT_ALLOC_ARR(best, list.len == 0 ? 1 : list.len);
+	if (best == NULL) {
+		goto err_exit;
+	}
+
 	FcFontSet *filtered = FcFontSetCreate();
 	if (filtered == NULL) {
-		goto err_exit;
+		goto err_free_best;
 	}
 
-	for (int i = 0; i < set->nfont; ++i) {
-		FcPattern *font = set->fonts[i];
-		if (ff_list_test_fc_pattern(list, font)) {
+	for (size_t s = 0; s < nsets; ++s) {
+		if (sets[s] == NULL) {
+			continue;
+		}
+
+		for (int i = 0; i < sets[s]->nfont; ++i) {
+			FcPattern *font = sets[s]->fonts[i];
+
+			bool added;
+			if (!add_font_key(&keys, font, &added)) {
+				goto err_destroy_filtered;
+			}
+			if (!added) {
+				continue;
+			}
+
+			// Conditions are tested until the font's results differ
+			// from the best ones, the first font being better
+			size_t j = 0;
+			bool better = filtered->nfont == 0;
+			for (; !better && j < list.len; ++j) {
+				bool passed = test_condition(list.conditions[j],
+						font, NULL);
+				if (passed != best[j]) {
+					better = passed;
+					break;
+				}
+			}
+
+			if (j < list.len && !better) {
+				continue;
+			}
+
+			if (better) {
+				for (; j < list.len; ++j) {
+					best[j] = test_condition(
+							list.conditions[j],
+							font, NULL);
+				}
+
+				FcFontSet *swp = FcFontSetCreate();
+				if (swp == NULL) {
+					goto err_destroy_filtered;
+				}
+				FcFontSetDestroy(filtered);
+				filtered = swp;
+			}
+
 			FcPatternReference(font);
 			bool success = FcFontSetAdd(filtered, font);
 			if (!success) {
@@ -364,205 +1315,5488 @@ FcFontSet *ff_list_filter(FfList list, FcFontSet *set)
 		}
 	}
 
+	tyrant_free(keys.slots);
+	tyrant_free(best);
+
 	return filtered;
 
 err_destroy_filtered:
 	FcFontSetDestroy(filtered);
+err_free_best:
+	tyrant_free(best);
 err_exit:
+	tyrant_free(keys.slots);
 	return NULL;
 }
 
-FcFontSet *ff_list_filter_soft(FfList list, FcFontSet *set)
+FfIndex *ff_index_create(FcFontSet *set)
 {
-	FcFontSet *filtered = copy_font_set(set);
-	if (filtered == NULL) {
+	FfIndex *index = tyrant_alloc(sizeof(*index));
+	if (index == NULL) {
 		goto err_exit;
 	}
 
-	for (size_t i = 0; i < list.len && filtered->nfont > 1; ++i) {
-		FfCondition *condition = list.conditions[i];
-		FcFontSet *test_set = ff_condition_filter(condition, filtered);
-		if (test_set == NULL) {
-			goto err_destroy_filtered;
-		}
+	size_t nfont = set->nfont;
+	FontInfo *fonts = TYRANT_ALLOC_ARR(fonts, nfont == 0 ? 1 : nfont);
+	if (fonts == NULL) {
+		goto err_free_index;
+	}
 
-		if (test_set->nfont > 0) {
-			FcFontSet *swp = filtered;
-			filtered = test_set;
-			test_set = swp;
-		}
+	const LangTable *table = get_lang_table();
+	if (table == NULL) {
+		goto err_free_fonts;
+	}
 
-		FcFontSetDestroy(test_set);
+	for (size_t i = 0; i < nfont; ++i) {
+		init_font_info(set->fonts[i], table, &fonts[i]);
 	}
 
-	return filtered;
+	*index = (FfIndex){
+		.set = set,
+		.fonts = fonts,
+		.names = NULL,
+		.nnames = 0,
+		.max_name_len = 0
+	};
 
-err_destroy_filtered:
-	FcFontSetDestroy(filtered);
+	if (!index_values(index)) {
+		goto err_free_fonts;
+	}
+
+	if (!index_names(index)) {
+		goto err_free_values;
+	}
+
+	if (!init_estimator(index)) {
+		goto err_destroy_names;
+	}
+
+	if (!init_range_indexes(index)) {
+		goto err_destroy_estimator;
+	}
+
+	return index;
+
+err_destroy_estimator:
+	destroy_estimator(index);
+err_destroy_names:
+	destroy_names(index);
+err_free_values:
+	tyrant_free(index->values);
+	tyrant_free(index->value_lists);
+err_free_fonts:
+	tyrant_free(fonts);
+err_free_index:
+	tyrant_free(index);
 err_exit:
 	return NULL;
 }
 
-bool test_comparison(FfComparison comparison, FcPattern *pattern)
+void ff_index_destroy(FfIndex *index)
 {
-	FcValue value;
-	FcResult result = FcPatternGet(pattern, comparison.object, 0, &value);
-	if (result != FcResultMatch) {
-		return false;
+	if (index == NULL) {
+		return;
 	}
 
-	return test_comparison_for_value(comparison, value);
+	destroy_range_indexes(index);
+	destroy_estimator(index);
+	destroy_names(index);
+	tyrant_free(index->values);
+	tyrant_free(index->value_lists);
+	tyrant_free(index->fonts);
+	tyrant_free(index);
 }
 
-bool test_composition(FfLogicalComposition composition, FcPattern *pattern)
+FcFontSet *ff_condition_filter_index(FfCondition *condition, FfIndex *index)
 {
-	bool p_passed = ff_condition_test_fc_pattern(composition.p, pattern);
-	bool q_passed = ff_condition_test_fc_pattern(composition.q, pattern);
+	Eval eval;
+	init_eval(&eval, index);
+	if (!prepare_condition(&eval, condition)) {
+		destroy_eval(&eval);
+		return NULL;
+	}
+
+	FcFontSet *filtered = filter_set(condition, NULL, index->set, &eval);
 
-	return eval_logical_operation(composition.oper, p_passed, q_passed);
+	destroy_eval(&eval);
+	return filtered;
 }
 
-bool test_char_requirement(FfCharRequirement char_requirement,
-		FcPattern *pattern)
+FcFontSet *ff_list_filter_index(FfList list, FfIndex *index)
 {
-	FcCharSet *cs;
-	FcResult result = FcPatternGetCharSet(pattern, FC_CHARSET, 0, &cs);
-	if (result != FcResultMatch) {
-		return false;
+	Eval eval;
+	init_eval(&eval, index);
+	if (!prepare_list(&eval, list)) {
+		destroy_eval(&eval);
+		return NULL;
 	}
 
-	return FcCharSetHasChar(cs, char_requirement.c);
+	FcFontSet *filtered = filter_set(NULL, &list, index->set, &eval);
+
+	destroy_eval(&eval);
+	return filtered;
 }
 
-bool test_comparison_for_value(FfComparison comparison, FcValue value)
+FcFontSet *ff_list_filter_soft_index(FfList list, FfIndex *index)
 {
-	FcValue a = value;
-	FcValue b = comparison.value;
-	FfRelationalOperator oper = comparison.oper;
+	FcFontSet *set = index->set;
 
-	bool a_is_real = a.type == FcTypeInteger || a.type == FcTypeDouble;
-	bool b_is_real = b.type == FcTypeInteger || b.type == FcTypeDouble;
-	if (a_is_real && b_is_real) {
-		double a_d = a.type == FcTypeDouble ? a.u.d : a.u.i;
-		double b_d = b.type == FcTypeDouble ? b.u.d : b.u.i;
+	Eval eval;
+	init_eval(&eval, index);
 
-		switch (oper) {
-		case FF_NOT_EQUAL:
-		case FF_DOES_NOT_CONTAIN:
-		case FF_NOT_CONTAINED_IN:
-			return a_d != b_d;
-		case FF_EQUAL:
-		case FF_CONTAINS:
-		case FF_CONTAINED_IN:
-			return a_d == b_d;
-		case FF_LESS_THAN:
-			return a_d < b_d;
-		case FF_GREATER_THAN:
-			return a_d > b_d;
-		case FF_LESS_THAN_EQUAL:
-			return a_d <= b_d;
-		case FF_GREATER_THAN_EQUAL:
-			return a_d >= b_d;
-		}
+	// Positions (in `set`) of the fonts which are still candidates
+	size_t *candidates = TYRANT_ALLOC_ARR(candidates,
+			set->nfont == 0 ? 1 : set->nfont);
+	if (candidates == NULL) {
+		goto err_destroy_eval;
 	}
 
-	switch (oper) {
-	case FF_NOT_EQUAL:
-		return !FcValueEqual(a, b);
-	case FF_EQUAL:
-		return FcValueEqual(a, b);
-	case FF_DOES_NOT_CONTAIN:
-		return !contains(a, b);
-	case FF_CONTAINS:
-		return contains(a, b);
-	case FF_NOT_CONTAINED_IN:
-		return !contains(b, a);
-	case FF_CONTAINED_IN:
-		return contains(b, a);
-	default:
-		return false;
+	size_t *passed = TYRANT_ALLOC_ARR(passed,
+			set->nfont == 0 ? 1 : set->nfont);
+	if (passed == NULL) {
+		goto err_free_candidates;
 	}
-}
-
-bool contains(FcValue a, FcValue b)
-{
-	if (a.type == FcTypeString && b.type == FcTypeString) {
-		const char *a_s = (char *)a.u.s;
-		const char *b_s = (char *)b.u.s;
 
-		return strstr(a_s, b_s) != NULL;
+	size_t ncandidates = set->nfont;
+	for (size_t i = 0; i < ncandidates; ++i) {
+		candidates[i] = i;
 	}
 
-	bool b_is_real = b.type == FcTypeInteger || b.type == FcTypeDouble;
-	if (b_is_real && a.type == FcTypeRange) {
-		double from;
-		double to;
-		bool success = FcRangeGetDouble(a.u.r, &from, &to);
-		if (!success) {
-			return false;
+	for (size_t i = 0; i < list.len && ncandidates > 1; ++i) {
+		FfCondition *condition = list.conditions[i];
+
+		// Conditions are only prepared once they're reached
+		if (!prepare_condition(&eval, condition)) {
+			goto err_free_passed;
 		}
 
-		double b_d = b.type == FcTypeInteger ? (double)b.u.i : b.u.d;
+		size_t npassed = 0;
+		for (size_t j = 0; j < ncandidates; ++j) {
+			eval.pos = candidates[j];
+			if (test_condition(condition, set->fonts[eval.pos],
+						&eval)) {
+				passed[npassed++] = eval.pos;
+			}
+		}
 
-		return b_d >= from && b_d <= to;
+		if (npassed > 0) {
+			size_t *swp = candidates;
+			candidates = passed;
+			passed = swp;
+			ncandidates = npassed;
+		}
 	}
 
-	if (a.type == FcTypeRange && b.type == FcTypeRange) {
-		double a_from;
-		double a_to;
-		double b_from;
-		double b_to;
-		bool success = FcRangeGetDouble(a.u.r, &a_from, &a_to)
-				& FcRangeGetDouble(b.u.r, &b_from, &b_to);
+	FcFontSet *filtered = FcFontSetCreate();
+	if (filtered == NULL) {
+		goto err_free_passed;
+	}
+
+	for (size_t i = 0; i < ncandidates; ++i) {
+		FcPattern *font = set->fonts[candidates[i]];
+
+		FcPatternReference(font);
+		bool success = FcFontSetAdd(filtered, font);
 		if (!success) {
-			return false;
+			goto err_destroy_filtered;
 		}
-
-		return b_from >= a_from && b_to <= a_to;
 	}
 
-	if (a.type == FcTypeCharSet && b.type == FcTypeCharSet) {
-		return FcCharSetIsSubset(b.u.c, a.u.c);
-	}
+	tyrant_free(passed);
+	tyrant_free(candidates);
+	destroy_eval(&eval);
 
-	return false;
+	return filtered;
+
+err_destroy_filtered:
+	FcFontSetDestroy(filtered);
+err_free_passed:
+	tyrant_free(passed);
+err_free_candidates:
+	tyrant_free(candidates);
+err_destroy_eval:
+	destroy_eval(&eval);
+	return NULL;
 }
 
-bool eval_logical_operation(FfLogicalOperator oper, bool p, bool q)
+FcFontSet *ff_index_fuzzy_search(FfIndex *index, const char *family,
+		unsigned max_distance)
 {
-	if (p && q) {
-		return oper.pt_qt;
+	size_t len;
+	FcChar32 *query = fold_string((const FcChar8 *)family, &len);
+	if (query == NULL) {
+		goto err_exit;
 	}
-	if (p && !q) {
-		return oper.pt_qf;
+
+	FuzzyHit *hits;
+	size_t nhits;
+	if (!search_names(index, query, len, max_distance, &hits, &nhits)) {
+		goto err_free_query;
 	}
-	if (!p && q) {
-		return oper.pf_qt;
+
+	// Every (font, distance) pair, reusing `FuzzyHit.name` for the font
+	size_t nfonts = 0;
+	for (size_t i = 0; i < nhits; ++i) {
+		nfonts += index->names[hits[i].name].nfonts;
 	}
-	return oper.pf_qf;
-}
 
-FcFontSet *copy_font_set(FcFontSet *set)
-{
-	FcFontSet *copy = FcFontSetCreate();
-	if (copy == NULL) {
-		goto err_exit;
+	FuzzyHit *fonts = TYRANT_ALLOC_ARR(fonts, nfonts == 0 ? 1 : nfonts);
+	if (fonts == NULL) {
+		goto err_free_hits;
 	}
 
-	for (int i = 0; i < set->nfont; ++i) {
-		FcPattern *font = set->fonts[i];
+	size_t k = 0;
+	for (size_t i = 0; i < nhits; ++i) {
+		const FuzzyName *name = &index->names[hits[i].name];
+		for (size_t j = 0; j < name->nfonts; ++j) {
+			fonts[k++] = (FuzzyHit){
+				.name = name->fonts[j],
+				.distance = hits[i].distance
+			};
+		}
+	}
+
+	// Closest first, so only the first pair of each font is kept
+	qsort(fonts, nfonts, sizeof(*fonts), compare_hits);
+
+	FcFontSet *found = FcFontSetCreate();
+	if (found == NULL) {
+		goto err_free_fonts;
+	}
+
+	uint64_t *seen = NULL;
+	if (nfonts > 0) {
+		size_t nwords = (index->set->nfont + 63) / 64;
+		seen = TYRANT_ALLOC_ARR(seen, nwords);
+		if (seen == NULL) {
+			goto err_destroy_found;
+		}
+		memset(seen, 0, nwords * sizeof(*seen));
+	}
+
+	for (size_t i = 0; i < nfonts; ++i) {
+		size_t pos = fonts[i].name;
+		if (seen[pos / 64] >> pos % 64 & 1) {
+			continue;
+		}
+		seen[pos / 64] |= (uint64_t)1 << pos % 64;
 
+		FcPattern *font = index->set->fonts[pos];
 		FcPatternReference(font);
-		bool success = FcFontSetAdd(copy, font);
+		bool success = FcFontSetAdd(found, font);
 		if (!success) {
-			goto err_destroy_copy;
+			goto err_free_seen;
 		}
 	}
 
-	return copy;
-	
-err_destroy_copy:
-	FcFontSetDestroy(copy);
+	tyrant_free(seen);
+	tyrant_free(fonts);
+	tyrant_free(hits);
+	tyrant_free(query);
+
+	return found;
+
+err_free_seen:
+	tyrant_free(seen);
+err_destroy_found:
+	FcFontSetDestroy(found);
+err_free_fonts:
+	tyrant_free(fonts);
+err_free_hits:
+	tyrant_free(hits);
+err_free_query:
+	tyrant_free(query);
 err_exit:
 	return NULL;
 }
+
+FcFontSet *ff_index_find_containing(FfIndex *index, const char *object,
+		double value)
+{
+	FcValue query = { .type = FcTypeDouble, .u.d = value };
+	return find_containing(index, object, query);
+}
+
+FcFontSet *ff_index_find_covering(FfIndex *index, const char *object,
+		double from, double to)
+{
+	FcRange *range = FcRangeCreateDouble(from, to);
+	if (range == NULL) {
+		return NULL;
+	}
+
+	FcValue query = { .type = FcTypeRange, .u.r = range };
+	FcFontSet *found = find_containing(index, object, query);
+
+	FcRangeDestroy(range);
+	return found;
+}
+
+FfEstimate ff_condition_estimate(FfCondition *condition, FfIndex *index,
+		double error_bound, int *ret_status)
+{
+	return estimate(condition, NULL, index, error_bound, ret_status);
+}
+
+FfEstimate ff_list_estimate(FfList list, FfIndex *index, double error_bound,
+		int *ret_status)
+{
+	return estimate(NULL, &list, index, error_bound, ret_status);
+}
+
+// Estimates the number of fonts satisfying `condition` if it isn't NULL, else
+// those satisfying `list`
+FfEstimate estimate(FfCondition *condition, const FfList *list,
+		FfIndex *index, double error_bound, int *ret_status)
+{
+	FcFontSet *set = index->set;
+	size_t nfont = set->nfont;
+
+	*ret_status = FF_SUCCESS;
+
+	Model model;
+	bool modelled = condition != NULL
+			? model_condition(index, condition, &model)
+			: model_list(index, list, &model);
+
+	if (modelled) {
+		// Bounds are rounded to whole fonts, outwards unless they're
+		// only off by rounding errors, which may also leave the count
+		// just outside them
+		double low = floor(model.low * nfont + 1e-6);
+		double high = ceil(model.high * nfont - 1e-6);
+		double count = fmin(fmax(model.p * nfont, low), high);
+		double achieved = nfont == 0 ? 0
+				: fmax(count - low, high - count) / nfont;
+
+		// Otherwise fonts are tested, as they are when nothing can be
+		// modelled
+		if (achieved <= fmax(error_bound, 0)) {
+			return (FfEstimate){
+				.count = count,
+				.low = low,
+				.high = high,
+				.error_bound = achieved
+			};
+		}
+	}
+
+	// Enough fonts for the worst case (half of the fonts passing) of the
+	// normal approximation, but no more than the sample has
+	size_t n = nfont;
+	if (error_bound > 0) {
+		double needed = ceil(ESTIMATE_Z * ESTIMATE_Z
+				/ (4 * error_bound * error_bound));
+		n = needed < index->nsample ? (size_t)needed : index->nsample;
+	}
+
+	bool sampled = n < nfont;
+
+	Eval eval;
+	init_eval(&eval, index);
+
+	// Preparing finds the matching fonts of the whole set, which is only
+	// worth it when every font is tested
+	if (!sampled) {
+		bool prepared = condition != NULL
+				? prepare_condition(&eval, condition)
+				: prepare_list(&eval, *list);
+		if (!prepared) {
+			destroy_eval(&eval);
+			*ret_status = FF_FAILURE;
+			return (FfEstimate){
+				.count = 0,
+				.low = 0,
+				.high = 0,
+				.error_bound = 0
+			};
+		}
+	}
+
+	size_t npassed = 0;
+	for (size_t i = 0; i < n; ++i) {
+		eval.pos = sampled ? index->sample[i] : i;
+		FcPattern *font = set->fonts[eval.pos];
+
+		bool passed = condition != NULL
+				? test_condition(condition, font, &eval)
+				: test_list(*list, font, &eval);
+		if (passed) {
+			++npassed;
+		}
+	}
+
+	destroy_eval(&eval);
+
+	if (!sampled) {
+		return (FfEstimate){
+			.count = npassed,
+			.low = npassed,
+			.high = npassed,
+			.error_bound = 0
+		};
+	}
+
+	// Wilson score interval, which unlike the normal approximation holds up
+	// when almost no or almost all fonts pass
+	double p = (double)npassed / n;
+	double z2 = ESTIMATE_Z * ESTIMATE_Z;
+	double scale = 1 + z2 / n;
+	double center = (p + z2 / (2 * n)) / scale;
+	double half_width = ESTIMATE_Z / scale
+			* sqrt(p * (1 - p) / n + z2 / (4.0 * n * n));
+
+	return (FfEstimate){
+		.count = p * nfont,
+		.low = fmax(center - half_width, 0) * nfont,
+		.high = fmin(center + half_width, 1) * nfont,
+		.error_bound = ESTIMATE_Z / (2 * sqrt(n))
+	};
+}
+
+FfGroupSet *ff_condition_filter_grouped(FfCondition *condition,
+		FcFontSet *set, const char *const *objects, size_t nobjects,
+		const FfList *best)
+{
+	return filter_grouped(condition, NULL, set, objects, nobjects, best);
+}
+
+FfGroupSet *ff_list_filter_grouped(FfList list, FcFontSet *set,
+		const char *const *objects, size_t nobjects,
+		const FfList *best)
+{
+	return filter_grouped(NULL, &list, set, objects, nobjects, best);
+}
+
+void ff_group_set_destroy(FfGroupSet *groups)
+{
+	if (groups == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < groups->ngroups; ++i) {
+		FfGroup group = groups->groups[i];
+
+		for (size_t j = 0; j < groups->nobjects; ++j) {
+			FcStrFree(group.key[j]);
+		}
+		tyrant_free(group.key);
+
+		FcFontSetDestroy(group.fonts);
+	}
+
+	tyrant_free(groups->groups);
+	tyrant_free(groups);
+}
+
+// Tests `condition`, or `list` if `condition` is NULL
+FfGroupSet *filter_grouped(FfCondition *condition, const FfList *list,
+		FcFontSet *set, const char *const *objects, size_t nobjects,
+		const FfList *best)
+{
+	Grouper grouper;
+	if (!init_grouper(&grouper, objects, nobjects, best)) {
+		goto err_exit;
+	}
+
+	for (int i = 0; i < set->nfont; ++i) {
+		FcPattern *font = set->fonts[i];
+
+		bool passed;
+		if (condition != NULL) {
+			passed = test_condition(condition, font, NULL);
+		} else {
+			passed = test_list(*list, font, NULL);
+		}
+
+		if (passed && !add_to_group(&grouper, font)) {
+			goto err_destroy_grouper;
+		}
+	}
+
+	FfGroupSet *groups = grouper.groups;
+	grouper.groups = NULL;
+
+	destroy_grouper(&grouper);
+
+	return groups;
+
+err_destroy_grouper:
+	destroy_grouper(&grouper);
+err_exit:
+	return NULL;
+}
+
+// Tests `condition`, or `list` if `condition` is NULL. `eval` is NULL unless
+// `set` is the set of an index.
+FcFontSet *filter_set(FfCondition *condition, const FfList *list,
+		FcFontSet *set, Eval *eval)
+{
+	FcFontSet *filtered = FcFontSetCreate();
+	if (filtered == NULL) {
+		goto err_exit;
+	}
+
+	for (int i = 0; i < set->nfont; ++i) {
+		FcPattern *font = set->fonts[i];
+
+		if (eval != NULL) {
+			eval->pos = i;
+		}
+
+		bool passed;
+		if (condition != NULL) {
+			passed = test_condition(condition, font, eval);
+		} else {
+			passed = test_list(*list, font, eval);
+		}
+
+		if (passed) {
+			FcPatternReference(font);
+			bool success = FcFontSetAdd(filtered, font);
+			if (!success) {
+				goto err_destroy_filtered;
+			}
+		}
+	}
+
+	return filtered;
+
+err_destroy_filtered:
+	FcFontSetDestroy(filtered);
+err_exit:
+	return NULL;
+}
+
+// Tests `condition`, or `list` if `condition` is NULL
+FcFontSet *filter_sets(FfCondition *condition, const FfList *list,
+		FcFontSet **sets, size_t nsets)
+{
+	FontKeys keys = { .slots = NULL, .nslots = 0, .len = 0 };
+
+	FcFontSet *filtered = FcFontSetCreate();
+	if (filtered == NULL) {
+		goto err_exit;
+	}
+
+	for (size_t s = 0; s < nsets; ++s) {
+		if (sets[s] == NULL) {
+			continue;
+		}
+
+		for (int i = 0; i < sets[s]->nfont; ++i) {
+			FcPattern *font = sets[s]->fonts[i];
+
+			bool added;
+			if (!add_font_key(&keys, font, &added)) {
+				goto err_destroy_filtered;
+			}
+			if (!added) {
+				continue;
+			}
+
+			bool passed;
+			if (condition != NULL) {
+				passed = test_condition(condition, font, NULL);
+			} else {
+				passed = test_list(*list, font, NULL);
+			}
+
+			if (passed) {
+				FcPatternReference(font);
+				bool success = FcFontSetAdd(filtered, font);
+				if (!success) {
+					goto err_destroy_filtered;
+				}
+			}
+		}
+	}
+
+	tyrant_free(keys.slots);
+
+	return filtered;
+
+err_destroy_filtered:
+	FcFontSetDestroy(filtered);
+err_exit:
+	tyrant_free(keys.slots);
+	return NULL;
+}
+
+FcFontSet *ff_list_rank(FfList list, const double *weights, FcFontSet *set,
+		size_t k)
+{
+	if (k > (size_t)set->nfont) {
+		k = set->nfont;
+	}
+
+	// Most that the conditions from `i` onwards could add to a score
+	double *remaining = TYRANT_ALLOC_ARR(remaining, list.len + 1);
+	if (remaining == NULL) {
+		goto err_exit;
+	}
+
+	remaining[list.len] = 0;
+	for (size_t i = list.len; i > 0; --i) {
+		double weight = weights != NULL ? weights[i - 1] : 1;
+		remaining[i - 1] = remaining[i] + (weight > 0 ? weight : 0);
+	}
+
+	// Min-heap, with the worst of the best `k` fonts so far on top
+	Ranked *heap = TYRANT_ALLOC_ARR(heap, k == 0 ? 1 : k);
+	if (heap == NULL) {
+		goto err_free_remaining;
+	}
+
+	size_t len = 0;
+	for (size_t pos = 0; pos < (size_t)set->nfont && k > 0; ++pos) {
+		FcPattern *font = set->fonts[pos];
+		bool full = len == k;
+
+		double score = 0;
+		bool pruned = false;
+		for (size_t i = 0; i < list.len; ++i) {
+			// Ties lose to fonts already in the heap
+			if (full && score + remaining[i] <= heap[0].score) {
+				pruned = true;
+				break;
+			}
+
+			if (test_condition(list.conditions[i], font, NULL)) {
+				score += weights != NULL ? weights[i] : 1;
+			}
+		}
+
+		Ranked ranked = { .score = score, .pos = pos };
+		if (pruned || (full && !ranked_is_worse(heap[0], ranked))) {
+			continue;
+		}
+
+		if (full) {
+			heap[0] = ranked;
+			sift_down(heap, len, 0);
+		} else {
+			heap[len] = ranked;
+			sift_up(heap, len++);
+		}
+	}
+
+	qsort(heap, len, sizeof(*heap), compare_ranked);
+
+	FcFontSet *ranked = FcFontSetCreate();
+	if (ranked == NULL) {
+		goto err_free_heap;
+	}
+
+	for (size_t i = 0; i < len; ++i) {
+		FcPattern *font = set->fonts[heap[i].pos];
+
+		FcPatternReference(font);
+		bool success = FcFontSetAdd(ranked, font);
+		if (!success) {
+			goto err_destroy_ranked;
+		}
+	}
+
+	tyrant_free(heap);
+	tyrant_free(remaining);
+
+	return ranked;
+
+err_destroy_ranked:
+	FcFontSetDestroy(ranked);
+err_free_heap:
+	tyrant_free(heap);
+err_free_remaining:
+	tyrant_free(remaining);
+err_exit:
+	return NULL;
+}
+
+FfCoverage *ff_cover_text(FfList list, FcFontSet *set, const FcChar32 *text,
+		size_t len)
+{
+	FfCoverage *coverage = tyrant_alloc(sizeof(*coverage));
+	if (coverage == NULL) {
+		goto err_exit;
+	}
+
+	int *assignment = TYRANT_ALLOC_ARR(assignment, len == 0 ? 1 : len);
+	if (assignment == NULL) {
+		goto err_free_coverage;
+	}
+
+	FcFontSet *fonts = FcFontSetCreate();
+	if (fonts == NULL) {
+		goto err_free_assignment;
+	}
+
+	Cover cover;
+	if (!init_cover(&cover, text, len, list.len)) {
+		goto err_destroy_fonts;
+	}
+
+	for (int i = 0; i < set->nfont; ++i) {
+		if (!add_cover_candidate(&cover, list, set->fonts[i], i)) {
+			goto err_destroy_cover;
+		}
+	}
+
+	if (!build_cover_heap(&cover)) {
+		goto err_destroy_cover;
+	}
+
+	// Per distinct code point, the position in `fonts` of its font
+	int *chosen = TYRANT_ALLOC_ARR(chosen,
+			cover.nchars == 0 ? 1 : cover.nchars);
+	if (chosen == NULL) {
+		goto err_destroy_cover;
+	}
+
+	for (size_t i = 0; i < cover.nchars; ++i) {
+		chosen[i] = -1;
+	}
+
+	// Gains only ever decrease, so a candidate whose gain is still up to
+	// date at the top of the heap is the best one (i.e. lazy greedy)
+	while (cover.nheap > 0) {
+		size_t top = cover.heap[0];
+
+		size_t gain = count_gain(&cover, top);
+		if (gain != cover.gains[top]) {
+			cover.gains[top] = gain;
+			cover_sift_down(&cover, 0);
+			continue;
+		}
+
+		// Nothing else can cover any remaining code point either
+		if (gain == 0) {
+			break;
+		}
+
+		cover.heap[0] = cover.heap[--cover.nheap];
+		cover_sift_down(&cover, 0);
+
+		const uint64_t *covered = &cover.covered[top * cover.nwords];
+		for (size_t i = 0; i < cover.nchars; ++i) {
+			uint64_t bit = (uint64_t)1 << i % 64;
+			if (covered[i / 64] & cover.uncovered[i / 64] & bit) {
+				chosen[i] = fonts->nfont;
+			}
+		}
+
+		for (size_t i = 0; i < cover.nwords; ++i) {
+			cover.uncovered[i] &= ~covered[i];
+		}
+
+		FcPattern *font = set->fonts[cover.positions[top]];
+		FcPatternReference(font);
+		bool success = FcFontSetAdd(fonts, font);
+		if (!success) {
+			goto err_free_chosen;
+		}
+	}
+
+	for (size_t i = 0; i < len; ++i) {
+		FcChar32 *c = bsearch(&text[i], cover.chars, cover.nchars,
+				sizeof(*cover.chars), compare_chars);
+		assignment[i] = chosen[c - cover.chars];
+	}
+
+	tyrant_free(chosen);
+	destroy_cover(&cover);
+
+	*coverage = (FfCoverage){
+		.fonts = fonts,
+		.assignment = assignment,
+		.len = len
+	};
+	return coverage;
+
+err_free_chosen:
+	tyrant_free(chosen);
+err_destroy_cover:
+	destroy_cover(&cover);
+err_destroy_fonts:
+	FcFontSetDestroy(fonts);
+err_free_assignment:
+	tyrant_free(assignment);
+err_free_coverage:
+	tyrant_free(coverage);
+err_exit:
+	return NULL;
+}
+
+void ff_coverage_destroy(FfCoverage *coverage)
+{
+	if (coverage == NULL) {
+		return;
+	}
+
+	FcFontSetDestroy(coverage->fonts);
+	tyrant_free(coverage->assignment);
+	tyrant_free(coverage);
+}
+
+FfFilterTicket *ff_filter_submit(const FfFilterQuery *query)
+{
+	pthread_once(&pool.once, start_workers);
+	if (pool.nworkers == 0) {
+		goto err_exit;
+	}
+
+	FfFilterTicket *ticket = tyrant_alloc(sizeof(*ticket));
+	if (ticket == NULL) {
+		goto err_exit;
+	}
+
+	FcFontSet *filtered = FcFontSetCreate();
+	if (filtered == NULL) {
+		goto err_free_ticket;
+	}
+
+	FfList list = { .conditions = NULL, .len = 0, .cap = 0 };
+	FfCondition *condition = NULL;
+	if (query->kind == FF_FILTER_CONDITION) {
+		condition = ff_condition_ref(query->condition);
+		if (condition == NULL) {
+			goto err_destroy_filtered;
+		}
+	} else {
+		int status;
+		list = ff_list_create_with_cap(
+				query->list.len == 0 ? 1 : query->list.len,
+				&status);
+		if (status != FF_SUCCESS || list.conditions == NULL) {
+			goto err_destroy_filtered;
+		}
+
+		for (size_t i = 0; i < query->list.len; ++i) {
+			if (!ff_list_add(&list, query->list.conditions[i])) {
+				goto err_destroy_list;
+			}
+		}
+	}
+
+	*ticket = (FfFilterTicket){
+		.kind = query->kind,
+		.condition = condition,
+		.list = list,
+		.set = query->set,
+		.callback = query->callback,
+		.data = query->data,
+		.queue = query->queue,
+
+		.filtered = filtered,
+		.candidates = NULL,
+		.ncondition = 0,
+		.pos = 0,
+
+		.status = FF_FILTER_PENDING,
+		.cancelled = false,
+		.delivered = false,
+		.in_run_queue = false,
+		.in_completion_queue = false,
+		// One for the caller, one for the pool
+		.nrefs = 2,
+		.result = NULL,
+		.next_run = NULL,
+		.next_completed = NULL
+	};
+
+	pthread_mutex_lock(&pool.mutex);
+	if (ticket->queue != NULL) {
+		++ticket->queue->nundelivered;
+	}
+	push_run_queue(ticket);
+	pthread_mutex_unlock(&pool.mutex);
+
+	return ticket;
+
+err_destroy_list:
+	ff_list_destroy(list);
+err_destroy_filtered:
+	FcFontSetDestroy(filtered);
+err_free_ticket:
+	tyrant_free(ticket);
+err_exit:
+	return NULL;
+}
+
+FfFilterStatus ff_filter_status(FfFilterTicket *ticket)
+{
+	pthread_mutex_lock(&pool.mutex);
+	FfFilterStatus status = ticket->status;
+	pthread_mutex_unlock(&pool.mutex);
+
+	return status;
+}
+
+FfFilterStatus ff_filter_wait(FfFilterTicket *ticket)
+{
+	pthread_mutex_lock(&pool.mutex);
+	while (!ticket->delivered) {
+		pthread_cond_wait(&pool.finished, &pool.mutex);
+	}
+	FfFilterStatus status = ticket->status;
+	pthread_mutex_unlock(&pool.mutex);
+
+	return status;
+}
+
+void ff_filter_cancel(FfFilterTicket *ticket)
+{
+	pthread_mutex_lock(&pool.mutex);
+
+	ticket->cancelled = true;
+
+	// Move it to the front, so that a worker completes it promptly
+	if (ticket->in_run_queue && pool.head != ticket) {
+		FfFilterTicket *prev = pool.head;
+		while (prev->next_run != ticket) {
+			prev = prev->next_run;
+		}
+
+		prev->next_run = ticket->next_run;
+		if (pool.tail == ticket) {
+			pool.tail = prev;
+		}
+
+		ticket->next_run = pool.head;
+		pool.head = ticket;
+	}
+
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+FcFontSet *ff_filter_take_result(FfFilterTicket *ticket)
+{
+	pthread_mutex_lock(&pool.mutex);
+	FcFontSet *result = ticket->result;
+	ticket->result = NULL;
+	pthread_mutex_unlock(&pool.mutex);
+
+	return result;
+}
+
+void ff_filter_release(FfFilterTicket *ticket)
+{
+	if (ticket == NULL) {
+		return;
+	}
+
+	ff_filter_cancel(ticket);
+
+	pthread_mutex_lock(&pool.mutex);
+
+	while (!ticket->delivered) {
+		pthread_cond_wait(&pool.finished, &pool.mutex);
+	}
+
+	unlink_completed(ticket);
+
+	FcFontSet *result = ticket->result;
+	ticket->result = NULL;
+
+	pthread_mutex_unlock(&pool.mutex);
+
+	// Workers are done with the conditions once the ticket has completed
+	if (result != NULL) {
+		FcFontSetDestroy(result);
+	}
+	ff_condition_unref(ticket->condition);
+	ff_list_destroy(ticket->list);
+
+	pthread_mutex_lock(&pool.mutex);
+	unref_ticket(ticket);
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+FfCompletionQueue *ff_completion_queue_create(void)
+{
+	FfCompletionQueue *queue = tyrant_alloc(sizeof(*queue));
+	if (queue == NULL) {
+		goto err_exit;
+	}
+
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd == -1) {
+		goto err_free_queue;
+	}
+
+	*queue = (FfCompletionQueue){
+		.fd = fd,
+		.head = NULL,
+		.tail = NULL,
+		.nundelivered = 0
+	};
+	return queue;
+
+err_free_queue:
+	tyrant_free(queue);
+err_exit:
+	return NULL;
+}
+
+void ff_completion_queue_destroy(FfCompletionQueue *queue)
+{
+	if (queue == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool.mutex);
+	while (queue->nundelivered > 0) {
+		pthread_cond_wait(&pool.finished, &pool.mutex);
+	}
+	while (queue->head != NULL) {
+		unlink_completed(queue->head);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+
+	close(queue->fd);
+	tyrant_free(queue);
+}
+
+int ff_completion_queue_fd(FfCompletionQueue *queue)
+{
+	return queue->fd;
+}
+
+FfFilterTicket *ff_completion_queue_pop(FfCompletionQueue *queue)
+{
+	pthread_mutex_lock(&pool.mutex);
+
+	FfFilterTicket *ticket = queue->head;
+	if (ticket != NULL) {
+		unlink_completed(ticket);
+	}
+
+	pthread_mutex_unlock(&pool.mutex);
+
+	return ticket;
+}
+
+bool test_list(FfList list, FcPattern *pattern, const Eval *eval)
+{
+	for (size_t i = 0; i < list.len; ++i) {
+		FfCondition *condition = list.conditions[i];
+		if (!test_condition(condition, pattern, eval)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool test_condition(FfCondition *condition, FcPattern *pattern,
+		const Eval *eval)
+{
+	if (eval != NULL && eval->nprepared > 0) {
+		const uint64_t *fonts = find_prepared(eval, condition);
+		if (fonts != NULL) {
+			return fonts[eval->pos / 64] >> eval->pos % 64 & 1;
+		}
+	}
+
+	switch (condition->type) {
+	case FF_COMPARISON:
+		return test_comparison(condition->value.comparison, pattern,
+				eval);
+	case FF_COMPOSITION:
+		return test_composition(condition->value.composition, pattern,
+				eval);
+	case FF_CHAR_REQUIREMENT:
+		return test_char_requirement(condition->value.char_requirement,
+				pattern);
+	case FF_CONSTANT:
+		return condition->value.constant.value;
+	case FF_INTERVAL:
+		return test_interval(condition->value.interval, pattern);
+	case FF_LANG_REQUIREMENT:
+		return test_lang_requirement(condition->value.lang_requirement,
+				pattern, eval);
+	case FF_FUZZY_MATCH:
+		return test_fuzzy_match(condition->value.fuzzy_match, pattern);
+	default:
+		return false;
+	}
+}
+
+bool test_comparison(FfComparison comparison, FcPattern *pattern,
+		const Eval *eval)
+{
+	bool decided;
+	if (reject_by_page_summary(comparison, eval, &decided)) {
+		return decided;
+	}
+
+	if (comparison.quantifier == FF_FIRST) {
+		FcValue value;
+		FcResult result = FcPatternGet(pattern, comparison.object, 0,
+				&value);
+		if (result != FcResultMatch) {
+			return false;
+		}
+
+		return test_comparison_for_value(comparison, value);
+	}
+
+	const ValueList *value_list = find_value_list(eval, comparison.object);
+	if (value_list != NULL) {
+		const FcValue *values = &eval->index->values[value_list->first];
+
+		bool any = comparison.quantifier == FF_ANY;
+		for (size_t i = 0; i < value_list->len; ++i) {
+			bool passed = test_comparison_for_value(comparison,
+					values[i]);
+			if (passed == any) {
+				return passed;
+			}
+		}
+
+		return !any;
+	}
+
+	// Without an index, or with a single value: look the property up once,
+	// rather than once per value
+	FcPatternIter iter;
+	if (!FcPatternFindIter(pattern, &iter, comparison.object)) {
+		return false;
+	}
+
+	int nvalues = FcPatternIterValueCount(pattern, &iter);
+	if (nvalues <= 0) {
+		return false;
+	}
+
+	bool any = comparison.quantifier == FF_ANY;
+	for (int i = 0; i < nvalues; ++i) {
+		FcValue value;
+		FcValueBinding binding;
+		FcResult result = FcPatternIterGetValue(pattern, &iter, i,
+				&value, &binding);
+		if (result != FcResultMatch) {
+			return false;
+		}
+
+		bool passed = test_comparison_for_value(comparison, value);
+		if (passed == any) {
+			return passed;
+		}
+	}
+
+	return !any;
+}
+
+bool test_composition(FfLogicalComposition composition, FcPattern *pattern,
+		const Eval *eval)
+{
+	FfLogicalOperator oper = composition.oper;
+
+	bool p_passed = test_condition(composition.p, pattern, eval);
+
+	// Skip `q` when the operator's table does not depend on it
+	if (p_passed && oper.pt_qt == oper.pt_qf) {
+		return oper.pt_qt;
+	}
+	if (!p_passed && oper.pf_qt == oper.pf_qf) {
+		return oper.pf_qt;
+	}
+
+	bool q_passed;
+	if (composition.q == composition.p) {
+		q_passed = p_passed;
+	} else {
+		q_passed = test_condition(composition.q, pattern, eval);
+	}
+
+	return eval_logical_operation(oper, p_passed, q_passed);
+}
+
+bool test_char_requirement(FfCharRequirement char_requirement,
+		FcPattern *pattern)
+{
+	FcCharSet *cs;
+	FcResult result = FcPatternGetCharSet(pattern, FC_CHARSET, 0, &cs);
+	if (result != FcResultMatch) {
+		return false;
+	}
+
+	return FcCharSetHasChar(cs, char_requirement.c);
+}
+
+bool test_interval(FfInterval interval, FcPattern *pattern)
+{
+	FcValue value;
+	FcResult result = FcPatternGet(pattern, interval.object, 0, &value);
+	if (result != FcResultMatch) {
+		return false;
+	}
+
+	double d;
+	if (value.type == FcTypeInteger) {
+		d = value.u.i;
+	} else if (value.type == FcTypeDouble) {
+		d = value.u.d;
+	} else {
+		return false;
+	}
+
+	bool above = interval.from_inclusive ? d >= interval.from
+			: d > interval.from;
+	bool below = interval.to_inclusive ? d <= interval.to : d < interval.to;
+
+	return above && below;
+}
+
+bool test_lang_requirement(FfLangRequirement lang_requirement,
+		FcPattern *pattern, const Eval *eval)
+{
+	bool all = lang_requirement.all;
+
+	size_t start = 0;
+	if (eval != NULL) {
+		const FontInfo *info = &eval->index->fonts[eval->pos];
+
+		if (!info->has_langs) {
+			return false;
+		}
+
+		const FfLangMask *mask = lang_requirement.mask;
+		uint64_t missing = 0;
+		uint64_t found = 0;
+		for (size_t i = 0; i < LANG_MASK_NWORDS; ++i) {
+			missing |= mask->words[i] & ~info->langs.words[i];
+			found |= mask->words[i] & info->langs.words[i];
+		}
+
+		if (all && missing != 0) {
+			return false;
+		}
+		if (!all && found != 0) {
+			return true;
+		}
+
+		// Only languages unknown to fontconfig are left to test
+		start = lang_requirement.nknown;
+		if (start == lang_requirement.nlangs) {
+			return all;
+		}
+	}
+
+	FcLangSet *langset;
+	FcResult result = FcPatternGetLangSet(pattern, FC_LANG, 0, &langset);
+	if (result != FcResultMatch) {
+		return false;
+	}
+
+	for (size_t i = start; i < lang_requirement.nlangs; ++i) {
+		FcChar8 *lang = lang_requirement.langs[i];
+		bool has_lang = FcLangSetHasLang(langset, lang) == FcLangEqual;
+		if (has_lang != all) {
+			return has_lang;
+		}
+	}
+
+	return all;
+}
+
+bool test_fuzzy_match(FfFuzzyMatch match, FcPattern *pattern)
+{
+	FcPatternIter iter;
+	if (!FcPatternFindIter(pattern, &iter, match.object)) {
+		return false;
+	}
+
+	int nvalues = FcPatternIterValueCount(pattern, &iter);
+
+	// Created along with the condition
+	const FoldTable *table = get_fold_table();
+
+	size_t row[MAX_FUZZY_LEN + 1];
+	for (int i = 0; i < nvalues; ++i) {
+		FcValue value;
+		FcValueBinding binding;
+		FcResult result = FcPatternIterGetValue(pattern, &iter, i,
+				&value, &binding);
+		if (result != FcResultMatch || value.type != FcTypeString) {
+			continue;
+		}
+
+		size_t distance = edit_distance_folded(match.chars, match.len,
+				value.u.s, table, match.max_distance, row);
+		if (distance <= match.max_distance) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool test_comparison_for_value(FfComparison comparison, FcValue value)
+{
+	FcValue a = value;
+	FcValue b = comparison.value;
+	FfRelationalOperator oper = comparison.oper;
+
+	bool a_is_real = a.type == FcTypeInteger || a.type == FcTypeDouble;
+	bool b_is_real = b.type == FcTypeInteger || b.type == FcTypeDouble;
+	if (a_is_real && b_is_real) {
+		double a_d = a.type == FcTypeDouble ? a.u.d : a.u.i;
+		double b_d = b.type == FcTypeDouble ? b.u.d : b.u.i;
+
+		switch (oper) {
+		case FF_NOT_EQUAL:
+		case FF_DOES_NOT_CONTAIN:
+		case FF_NOT_CONTAINED_IN:
+			return a_d != b_d;
+		case FF_EQUAL:
+		case FF_CONTAINS:
+		case FF_CONTAINED_IN:
+			return a_d == b_d;
+		case FF_LESS_THAN:
+			return a_d < b_d;
+		case FF_GREATER_THAN:
+			return a_d > b_d;
+		case FF_LESS_THAN_EQUAL:
+			return a_d <= b_d;
+		case FF_GREATER_THAN_EQUAL:
+			return a_d >= b_d;
+		}
+	}
+
+	switch (oper) {
+	case FF_NOT_EQUAL:
+		return !FcValueEqual(a, b);
+	case FF_EQUAL:
+		return FcValueEqual(a, b);
+	case FF_DOES_NOT_CONTAIN:
+		return !contains(a, b);
+	case FF_CONTAINS:
+		return contains(a, b);
+	case FF_NOT_CONTAINED_IN:
+		return !contains(b, a);
+	case FF_CONTAINED_IN:
+		return contains(b, a);
+	default:
+		return false;
+	}
+}
+
+bool contains(FcValue a, FcValue b)
+{
+	if (a.type == FcTypeString && b.type == FcTypeString) {
+		const char *a_s = (char *)a.u.s;
+		const char *b_s = (char *)b.u.s;
+
+		return strstr(a_s, b_s) != NULL;
+	}
+
+	bool b_is_real = b.type == FcTypeInteger || b.type == FcTypeDouble;
+	if (b_is_real && a.type == FcTypeRange) {
+		double from;
+		double to;
+		bool success = FcRangeGetDouble(a.u.r, &from, &to);
+		if (!success) {
+			return false;
+		}
+
+		double b_d = b.type == FcTypeInteger ? (double)b.u.i : b.u.d;
+
+		return b_d >= from && b_d <= to;
+	}
+
+	if (a.type == FcTypeRange && b.type == FcTypeRange) {
+		double a_from;
+		double a_to;
+		double b_from;
+		double b_to;
+		bool success = FcRangeGetDouble(a.u.r, &a_from, &a_to)
+				& FcRangeGetDouble(b.u.r, &b_from, &b_to);
+		if (!success) {
+			return false;
+		}
+
+		return b_from >= a_from && b_to <= a_to;
+	}
+
+	if (a.type == FcTypeCharSet && b.type == FcTypeCharSet) {
+		return FcCharSetIsSubset(b.u.c, a.u.c);
+	}
+
+	return false;
+}
+
+// Decides a charset comparison without an exact subset test when the page
+// summaries alone prove the result
+bool reject_by_page_summary(FfComparison comparison, const Eval *eval,
+		bool *ret_result)
+{
+	if (eval == NULL) {
+		return false;
+	}
+
+	const FontInfo *info = &eval->index->fonts[eval->pos];
+	if (!info->has_charset
+			|| comparison.quantifier != FF_FIRST
+			|| comparison.page_summary == NULL
+			|| strcmp(comparison.object, FC_CHARSET) != 0) {
+		return false;
+	}
+
+	const FfPageSummary *font = &info->charset;
+	const FfPageSummary *value = comparison.page_summary;
+
+	switch (comparison.oper) {
+	case FF_CONTAINS:
+	case FF_DOES_NOT_CONTAIN:
+		if (page_summary_is_subset(value, font)) {
+			return false;
+		}
+		*ret_result = comparison.oper == FF_DOES_NOT_CONTAIN;
+		return true;
+	case FF_CONTAINED_IN:
+	case FF_NOT_CONTAINED_IN:
+		if (page_summary_is_subset(font, value)) {
+			return false;
+		}
+		*ret_result = comparison.oper == FF_NOT_CONTAINED_IN;
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool page_summary_is_subset(const FfPageSummary *a, const FfPageSummary *b)
+{
+	uint64_t missing = 0;
+	for (size_t i = 0; i < PAGE_SUMMARY_NWORDS; ++i) {
+		missing |= a->words[i] & ~b->words[i];
+	}
+
+	return missing == 0;
+}
+
+void summarize_charset(const FcCharSet *charset, FfPageSummary *summary)
+{
+	*summary = (FfPageSummary){ .words = { 0 } };
+
+	FcChar32 map[FC_CHARSET_MAP_SIZE];
+	FcChar32 next;
+	FcChar32 base = FcCharSetFirstPage(charset, map, &next);
+	while (base != FC_CHARSET_DONE) {
+		FcChar32 any = 0;
+		for (size_t i = 0; i < FC_CHARSET_MAP_SIZE; ++i) {
+			any |= map[i];
+		}
+
+		FcChar32 block = base >> PAGE_SUMMARY_BLOCK_BITS;
+		if (any != 0 && block < PAGE_SUMMARY_NWORDS * 64) {
+			summary->words[block / 64] |= (uint64_t)1 << block % 64;
+		}
+
+		base = FcCharSetNextPage(charset, map, &next);
+	}
+}
+
+// Returns NULL if the table couldn't be created
+const LangTable *get_lang_table(void)
+{
+	pthread_once(&lang_table_once, init_lang_table);
+
+	return has_lang_table ? &lang_table : NULL;
+}
+
+void init_lang_table(void)
+{
+	has_lang_table = create_lang_table(&lang_table);
+}
+
+// The languages known to fontconfig, sorted, so that a language's position
+// is the same for every condition and index
+bool create_lang_table(LangTable *table)
+{
+	FcStrSet *set = FcGetLangs();
+	if (set == NULL) {
+		goto err_exit;
+	}
+
+	FcStrList *list = FcStrListCreate(set);
+	if (list == NULL) {
+		goto err_destroy_set;
+	}
+
+	size_t len = 0;
+	while (FcStrListNext(list) != NULL) {
+		++len;
+	}
+
+	const FcChar8 **langs = TYRANT_ALLOC_ARR(langs, len == 0 ? 1 : len);
+	if (langs == NULL) {
+		goto err_destroy_list;
+	}
+
+	FcStrListFirst(list);
+	for (size_t i = 0; i < len; ++i) {
+		langs[i] = FcStrListNext(list);
+	}
+
+	FcStrListDone(list);
+
+	qsort(langs, len, sizeof(*langs), compare_langs);
+
+	*table = (LangTable){
+		.set = set,
+		.langs = langs,
+		.len = len
+	};
+	return true;
+
+err_destroy_list:
+	FcStrListDone(list);
+err_destroy_set:
+	FcStrSetDestroy(set);
+err_exit:
+	return false;
+}
+
+int compare_langs(const void *a, const void *b)
+{
+	const FcChar8 *a_lang = *(const FcChar8 *const *)a;
+	const FcChar8 *b_lang = *(const FcChar8 *const *)b;
+
+	return FcStrCmpIgnoreCase(a_lang, b_lang);
+}
+
+// Returns the position of `lang` in `table`, or `SIZE_MAX` if it isn't there
+size_t find_lang(const LangTable *table, const FcChar8 *lang)
+{
+	const FcChar8 **found = bsearch(&lang, table->langs, table->len,
+			sizeof(*table->langs), compare_langs);
+	if (found == NULL) {
+		return SIZE_MAX;
+	}
+
+	return found - table->langs;
+}
+
+void summarize_langset(const LangTable *table, const FcLangSet *langset,
+		FfLangMask *mask)
+{
+	*mask = (FfLangMask){ .words = { 0 } };
+
+	FcStrSet *set = FcLangSetGetLangs(langset);
+	if (set == NULL) {
+		return;
+	}
+
+	FcStrList *list = FcStrListCreate(set);
+	if (list != NULL) {
+		FcChar8 *lang;
+		while ((lang = FcStrListNext(list)) != NULL) {
+			size_t bit = find_lang(table, lang);
+			if (bit < LANG_MASK_NWORDS * 64) {
+				mask->words[bit / 64] |=
+						(uint64_t)1 << bit % 64;
+			}
+		}
+
+		FcStrListDone(list);
+	}
+
+	FcStrSetDestroy(set);
+}
+
+void init_font_info(FcPattern *font, const LangTable *table, FontInfo *info)
+{
+	*info = (FontInfo){ .has_charset = false, .has_langs = false };
+
+	FcCharSet *charset;
+	FcResult result = FcPatternGetCharSet(font, FC_CHARSET, 0, &charset);
+	if (result == FcResultMatch) {
+		summarize_charset(charset, &info->charset);
+		info->has_charset = true;
+	}
+
+	FcLangSet *langset;
+	result = FcPatternGetLangSet(font, FC_LANG, 0, &langset);
+	if (result == FcResultMatch) {
+		summarize_langset(table, langset, &info->langs);
+		info->has_langs = true;
+	}
+}
+
+// Copies the values of every property with several values, so that testing
+// them all takes a single walk. Counts them first, to allocate once.
+bool index_values(FfIndex *index)
+{
+	FcFontSet *set = index->set;
+
+	size_t nvalue_lists = 0;
+	size_t nvalues = 0;
+	for (int i = 0; i < set->nfont; ++i) {
+		FcPattern *font = set->fonts[i];
+
+		FcPatternIter iter;
+		FcPatternIterStart(font, &iter);
+		if (!FcPatternIterIsValid(font, &iter)) {
+			continue;
+		}
+
+		do {
+			int len = FcPatternIterValueCount(font, &iter);
+			if (len >= 2) {
+				++nvalue_lists;
+				nvalues += len;
+			}
+		} while (FcPatternIterNext(font, &iter));
+	}
+
+	ValueList *value_lists = TYRANT_ALLOC_ARR(value_lists,
+			nvalue_lists == 0 ? 1 : nvalue_lists);
+	if (value_lists == NULL) {
+		goto err_exit;
+	}
+
+	FcValue *values = TYRANT_ALLOC_ARR(values, nvalues == 0 ? 1 : nvalues);
+	if (values == NULL) {
+		goto err_free_value_lists;
+	}
+
+	nvalue_lists = 0;
+	nvalues = 0;
+	for (int i = 0; i < set->nfont; ++i) {
+		FcPattern *font = set->fonts[i];
+		FontInfo *info = &index->fonts[i];
+		info->first_value_list = nvalue_lists;
+		info->nvalue_lists = 0;
+
+		FcPatternIter iter;
+		FcPatternIterStart(font, &iter);
+		if (!FcPatternIterIsValid(font, &iter)) {
+			continue;
+		}
+
+		do {
+			int len = FcPatternIterValueCount(font, &iter);
+			if (len < 2) {
+				continue;
+			}
+
+			value_lists[nvalue_lists++] = (ValueList){
+				.object = FcPatternIterGetObject(font, &iter),
+				.first = nvalues,
+				.len = len
+			};
+			++info->nvalue_lists;
+
+			// Walks the values before each one, but only once per
+			// index rather than once per test
+			for (int j = 0; j < len; ++j) {
+				FcValueBinding binding;
+				FcPatternIterGetValue(font, &iter, j,
+						&values[nvalues++], &binding);
+			}
+		} while (FcPatternIterNext(font, &iter));
+	}
+
+	index->value_lists = value_lists;
+	index->values = values;
+
+	return true;
+
+err_free_value_lists:
+	tyrant_free(value_lists);
+err_exit:
+	return false;
+}
+
+// Returns NULL without an index, or if the font has at most one value of
+// `object`
+const ValueList *find_value_list(const Eval *eval, const char *object)
+{
+	if (eval == NULL) {
+		return NULL;
+	}
+
+	const FontInfo *info = &eval->index->fonts[eval->pos];
+	const ValueList *value_lists =
+			&eval->index->value_lists[info->first_value_list];
+	for (size_t i = 0; i < info->nvalue_lists; ++i) {
+		if (strcmp(value_lists[i].object, object) == 0) {
+			return &value_lists[i];
+		}
+	}
+
+	return NULL;
+}
+
+const FoldTable *get_fold_table(void)
+{
+	pthread_once(&fold_table_once, init_fold_table);
+
+	return has_fold_table ? &fold_table : NULL;
+}
+
+void init_fold_table(void)
+{
+	has_fold_table = create_fold_table(&fold_table);
+}
+
+bool create_fold_table(FoldTable *table)
+{
+	Fold *folds = NULL;
+	size_t len = 0;
+	size_t cap = 0;
+
+	for (FcChar32 c = 0x80; c <= MAX_FOLDED_CHAR; ++c) {
+		if (is_surrogate(c)) {
+			continue;
+		}
+
+		FcChar8 utf8[FC_UTF8_MAX_LEN + 1];
+		utf8[FcUcs4ToUtf8(c, utf8)] = '\0';
+
+		FcChar8 *folded = FcStrDowncase(utf8);
+		if (folded == NULL) {
+			goto err_free_folds;
+		}
+
+		// fontconfig folds a few code points to nothing, which ends
+		// the folded string there
+		Fold fold = { .c = c, .len = 0 };
+		const FcChar8 *chars = folded;
+		int nleft = strlen((const char *)folded);
+		while (nleft > 0) {
+			int n = -1;
+			if (fold.len < MAX_FOLD_LEN) {
+				n = FcUtf8ToUcs4(chars,
+						&fold.folded[fold.len++],
+						nleft);
+			}
+			if (n <= 0) {
+				FcStrFree(folded);
+				goto err_free_folds;
+			}
+
+			chars += n;
+			nleft -= n;
+		}
+		FcStrFree(folded);
+
+		if (fold.len == 1 && fold.folded[0] == c) {
+			continue;
+		}
+
+		if (len == cap) {
+			size_t new_cap = cap == 0 ? 1024 : cap * 2;
+
+			bool success;
+			folds = TYRANT_REALLOC_ARR(folds, new_cap, &success);
+			if (!success) {
+				goto err_free_folds;
+			}
+
+			cap = new_cap;
+		}
+
+		folds[len++] = fold;
+	}
+
+	*table = (FoldTable){
+		.folds = folds,
+		.len = len
+	};
+	return true;
+
+err_free_folds:
+	tyrant_free(folds);
+	return false;
+}
+
+// Surrogates aren't valid in UTF-8
+bool is_surrogate(FcChar32 c)
+{
+	return c >= 0xd800 && c <= 0xdfff;
+}
+
+// Writes the code points `c` folds to into `folded`, returning how many there
+// are, 0 meaning that the folded string ends before `c`
+size_t fold_char(const FoldTable *table, FcChar32 c, FcChar32 *folded)
+{
+	if (c < 0x80) {
+		folded[0] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+		return 1;
+	}
+
+	size_t lo = 0;
+	size_t hi = table->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (table->folds[mid].c < c) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo == table->len || table->folds[lo].c != c) {
+		folded[0] = c;
+		return 1;
+	}
+
+	const Fold *fold = &table->folds[lo];
+	for (size_t i = 0; i < fold->len; ++i) {
+		folded[i] = fold->folded[i];
+	}
+
+	return fold->len;
+}
+
+// Returns NULL if `string` isn't valid UTF-8
+FcChar32 *fold_string(const FcChar8 *string, size_t *ret_len)
+{
+	FcChar8 *folded = FcStrDowncase(string);
+	if (folded == NULL) {
+		return NULL;
+	}
+
+	FcChar32 *chars = decode_utf8(folded, ret_len);
+	FcStrFree(folded);
+
+	return chars;
+}
+
+FcChar32 *decode_utf8(const FcChar8 *string, size_t *ret_len)
+{
+	int nbytes = strlen((const char *)string);
+	int len;
+	int width;
+	if (!FcUtf8Len(string, nbytes, &len, &width)) {
+		return NULL;
+	}
+
+	FcChar32 *chars = TYRANT_ALLOC_ARR(chars, len == 0 ? 1 : len);
+	if (chars == NULL) {
+		return NULL;
+	}
+
+	for (int i = 0; i < len; ++i) {
+		int n = FcUtf8ToUcs4(string, &chars[i], nbytes);
+		string += n;
+		nbytes -= n;
+	}
+
+	*ret_len = len;
+	return chars;
+}
+
+// Levenshtein distance between `a` and `b`, or `bound + 1` if it's greater
+// than `bound`. `row` must have room for `a_len + 1` entries.
+size_t edit_distance(const FcChar32 *a, size_t a_len, const FcChar32 *b,
+		size_t b_len, size_t bound, size_t *row)
+{
+	size_t len_diff = a_len > b_len ? a_len - b_len : b_len - a_len;
+	if (len_diff > bound) {
+		return bound + 1;
+	}
+
+	for (size_t i = 0; i <= a_len; ++i) {
+		row[i] = i;
+	}
+
+	for (size_t j = 1; j <= b_len; ++j) {
+		// Distances never decrease from one row to the next
+		if (update_distances(a, a_len, b[j - 1], j, row) > bound) {
+			return bound + 1;
+		}
+	}
+
+	return row[a_len] > bound ? bound + 1 : row[a_len];
+}
+
+// Same as `edit_distance()`, but case folds `b` while decoding it. `b` never
+// matches if it isn't valid UTF-8.
+size_t edit_distance_folded(const FcChar32 *a, size_t a_len, const FcChar8 *b,
+		const FoldTable *table, size_t bound, size_t *row)
+{
+	int nbytes = strlen((const char *)b);
+	int len;
+	int width;
+	if (!FcUtf8Len(b, nbytes, &len, &width)) {
+		return bound + 1;
+	}
+
+	for (size_t i = 0; i <= a_len; ++i) {
+		row[i] = i;
+	}
+
+	size_t j = 0;
+	while (nbytes > 0) {
+		FcChar32 c;
+		int n = FcUtf8ToUcs4(b, &c, nbytes);
+		b += n;
+		nbytes -= n;
+
+		FcChar32 folded[MAX_FOLD_LEN];
+		size_t nfolded = fold_char(table, c, folded);
+		if (nfolded == 0) {
+			break;
+		}
+
+		for (size_t k = 0; k < nfolded; ++k) {
+			if (update_distances(a, a_len, folded[k], ++j, row)
+					> bound) {
+				return bound + 1;
+			}
+		}
+	}
+
+	return row[a_len] > bound ? bound + 1 : row[a_len];
+}
+
+// Advances `row` from the distances to the first `j - 1` code points of `b` to
+// those to the first `j`, `c` being the `j`th, and returns the least of them
+size_t update_distances(const FcChar32 *a, size_t a_len, FcChar32 c, size_t j,
+		size_t *row)
+{
+	size_t diagonal = row[0];
+	row[0] = j;
+
+	size_t least = row[0];
+	for (size_t i = 1; i <= a_len; ++i) {
+		size_t above = row[i];
+
+		size_t cost = diagonal + (a[i - 1] != c);
+		if (row[i - 1] + 1 < cost) {
+			cost = row[i - 1] + 1;
+		}
+		if (above + 1 < cost) {
+			cost = above + 1;
+		}
+
+		row[i] = cost;
+		diagonal = above;
+
+		if (cost < least) {
+			least = cost;
+		}
+	}
+
+	return least;
+}
+
+bool index_names(FfIndex *index)
+{
+	Interner interner = (Interner){ .strings = NULL, .slots = NULL };
+	size_t cap = 0;
+
+	FcFontSet *set = index->set;
+	for (int i = 0; i < set->nfont; ++i) {
+		FcValue value;
+		for (int j = 0; FcPatternGet(set->fonts[i], FC_FAMILY, j,
+					&value) == FcResultMatch; ++j) {
+			if (value.type != FcTypeString) {
+				continue;
+			}
+
+			FcChar8 *folded = FcStrDowncase(value.u.s);
+			if (folded == NULL) {
+				goto err_destroy_interner;
+			}
+
+			int len;
+			int width;
+			if (!FcUtf8Len(folded, strlen((const char *)folded),
+						&len, &width)) {
+				// Never matched by `test_fuzzy_match()` either
+				FcStrFree(folded);
+				continue;
+			}
+
+			if (!add_name(index, &interner, &cap, folded, i)) {
+				goto err_destroy_interner;
+			}
+		}
+	}
+
+	destroy_interner(interner);
+
+	size_t *row = TYRANT_ALLOC_ARR(row, index->max_name_len + 1);
+	if (row == NULL) {
+		goto err_destroy_names;
+	}
+
+	build_name_tree(index, row);
+	tyrant_free(row);
+
+	return true;
+
+err_destroy_interner:
+	destroy_interner(interner);
+err_destroy_names:
+	destroy_names(index);
+	return false;
+}
+
+// Takes ownership of `folded`
+bool add_name(FfIndex *index, Interner *interner, size_t *cap,
+		FcChar8 *folded, size_t pos)
+{
+	if (index->nnames == *cap) {
+		size_t new_cap = *cap == 0 ? 16 : *cap * 2;
+
+		bool success;
+		index->names = TYRANT_REALLOC_ARR(index->names, new_cap,
+				&success);
+		if (!success) {
+			goto err_free_folded;
+		}
+
+		*cap = new_cap;
+	}
+
+	uint32_t id;
+	if (!intern_string(interner, folded, &id)) {
+		goto err_free_folded;
+	}
+
+	if (id <= index->nnames) {
+		FcStrFree(folded);
+	} else {
+		size_t len;
+		FcChar32 *chars = decode_utf8(folded, &len);
+		if (chars == NULL) {
+			goto err_free_folded;
+		}
+
+		index->names[index->nnames++] = (FuzzyName){
+			.folded = folded,
+			.chars = chars,
+			.len = len,
+			.fonts = NULL,
+			.nfonts = 0,
+			.cap = 0,
+			.first_child = NO_NAME,
+			.next_sibling = NO_NAME,
+			.distance = 0,
+			.max_child_distance = 0
+		};
+
+		if (len > index->max_name_len) {
+			index->max_name_len = len;
+		}
+	}
+
+	FuzzyName *name = &index->names[id - 1];
+
+	// A font may list the same name twice, e.g. in different cases
+	if (name->nfonts > 0 && name->fonts[name->nfonts - 1] == pos) {
+		return true;
+	}
+
+	if (name->nfonts == name->cap) {
+		size_t new_cap = name->cap == 0 ? 4 : name->cap * 2;
+
+		bool success;
+		name->fonts = TYRANT_REALLOC_ARR(name->fonts, new_cap,
+				&success);
+		if (!success) {
+			return false;
+		}
+
+		name->cap = new_cap;
+	}
+
+	name->fonts[name->nfonts++] = pos;
+	return true;
+
+err_free_folded:
+	FcStrFree(folded);
+	return false;
+}
+
+// Inserts every name but the first (the root) into a BK-tree, in which the
+// distance between a node and the members of its child labelled `d` is `d`
+void build_name_tree(FfIndex *index, size_t *row)
+{
+	for (size_t i = 1; i < index->nnames; ++i) {
+		FuzzyName *name = &index->names[i];
+
+		size_t node = 0;
+		for (;;) {
+			FuzzyName *parent = &index->names[node];
+			size_t distance = edit_distance(name->chars, name->len,
+					parent->chars, parent->len,
+					index->max_name_len, row);
+
+			size_t child = parent->first_child;
+			while (child != NO_NAME
+					&& index->names[child].distance
+						!= distance) {
+				child = index->names[child].next_sibling;
+			}
+
+			if (child == NO_NAME) {
+				name->distance = distance;
+				name->next_sibling = parent->first_child;
+				parent->first_child = i;
+				if (distance > parent->max_child_distance) {
+					parent->max_child_distance = distance;
+				}
+				break;
+			}
+
+			node = child;
+		}
+	}
+}
+
+void destroy_names(FfIndex *index)
+{
+	for (size_t i = 0; i < index->nnames; ++i) {
+		FcStrFree(index->names[i].folded);
+		tyrant_free(index->names[i].chars);
+		tyrant_free(index->names[i].fonts);
+	}
+
+	tyrant_free(index->names);
+}
+
+bool search_names(const FfIndex *index, const FcChar32 *query, size_t len,
+		size_t max_distance, FuzzyHit **ret_hits, size_t *ret_nhits)
+{
+	size_t cap = 16;
+	FuzzyHit *hits = TYRANT_ALLOC_ARR(hits, cap);
+	if (hits == NULL) {
+		goto err_exit;
+	}
+
+	size_t *row = TYRANT_ALLOC_ARR(row, len + 1);
+	if (row == NULL) {
+		goto err_free_hits;
+	}
+
+	// Each node is pushed at most once
+	size_t *stack = TYRANT_ALLOC_ARR(stack,
+			index->nnames == 0 ? 1 : index->nnames);
+	if (stack == NULL) {
+		goto err_free_row;
+	}
+
+	size_t nhits = 0;
+	size_t nstack = 0;
+	if (index->nnames > 0) {
+		stack[nstack++] = 0;
+	}
+
+	while (nstack > 0) {
+		size_t node = stack[--nstack];
+		const FuzzyName *name = &index->names[node];
+
+		// Past this, neither the node nor its children can be hits
+		size_t bound = max_distance + name->max_child_distance;
+		size_t distance = edit_distance(query, len, name->chars,
+				name->len, bound, row);
+
+		if (distance <= max_distance) {
+			if (nhits == cap) {
+				cap *= 2;
+
+				bool success;
+				hits = TYRANT_REALLOC_ARR(hits, cap, &success);
+				if (!success) {
+					goto err_free_stack;
+				}
+			}
+
+			hits[nhits++] = (FuzzyHit){
+				.name = node,
+				.distance = distance
+			};
+		}
+
+		if (distance > bound) {
+			continue;
+		}
+
+		// By the triangle inequality, hits are only found under
+		// children labelled within `max_distance` of `distance`
+		for (size_t child = name->first_child; child != NO_NAME;
+				child = index->names[child].next_sibling) {
+			size_t label = index->names[child].distance;
+			if (label + max_distance >= distance
+					&& label <= distance + max_distance) {
+				stack[nstack++] = child;
+			}
+		}
+	}
+
+	tyrant_free(stack);
+	tyrant_free(row);
+
+	*ret_hits = hits;
+	*ret_nhits = nhits;
+	return true;
+
+err_free_stack:
+	tyrant_free(stack);
+err_free_row:
+	tyrant_free(row);
+err_free_hits:
+	tyrant_free(hits);
+err_exit:
+	return false;
+}
+
+int compare_hits(const void *a, const void *b)
+{
+	const FuzzyHit *x = a;
+	const FuzzyHit *y = b;
+
+	if (x->distance != y->distance) {
+		return x->distance < y->distance ? -1 : 1;
+	}
+	if (x->name != y->name) {
+		return x->name < y->name ? -1 : 1;
+	}
+	return 0;
+}
+
+void init_eval(Eval *eval, const FfIndex *index)
+{
+	*eval = (Eval){
+		.index = index,
+		.pos = 0,
+		.prepared = NULL,
+		.nslots = 0,
+		.nprepared = 0
+	};
+}
+
+void destroy_eval(Eval *eval)
+{
+	for (size_t i = 0; i < eval->nslots; ++i) {
+		tyrant_free(eval->prepared[i].fonts);
+	}
+
+	tyrant_free(eval->prepared);
+}
+
+bool prepare_list(Eval *eval, FfList list)
+{
+	for (size_t i = 0; i < list.len; ++i) {
+		if (!prepare_condition(eval, list.conditions[i])) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool prepare_condition(Eval *eval, const FfCondition *condition)
+{
+	switch (condition->type) {
+	case FF_COMPOSITION: {
+		FfLogicalComposition composition = condition->value.composition;
+		return prepare_condition(eval, composition.p)
+				&& prepare_condition(eval, composition.q);
+	}
+	case FF_COMPARISON:
+		return prepare_comparison(eval, condition);
+	case FF_FUZZY_MATCH:
+		return prepare_fuzzy_match(eval, condition);
+	default:
+		return true;
+	}
+}
+
+// Finds the fonts matching a fuzzy family name condition in the index's tree
+// of names, so they aren't compared against the condition's string one by one
+bool prepare_fuzzy_match(Eval *eval, const FfCondition *condition)
+{
+	FfFuzzyMatch match = condition->value.fuzzy_match;
+	if (strcmp(match.object, FC_FAMILY) != 0
+			|| find_prepared(eval, condition) != NULL) {
+		return true;
+	}
+
+	const FfIndex *index = eval->index;
+
+	FuzzyHit *hits;
+	size_t nhits;
+	if (!search_names(index, match.chars, match.len, match.max_distance,
+				&hits, &nhits)) {
+		goto err_exit;
+	}
+
+	size_t nwords = (index->set->nfont + 63) / 64;
+	uint64_t *fonts = TYRANT_ALLOC_ARR(fonts, nwords == 0 ? 1 : nwords);
+	if (fonts == NULL) {
+		goto err_free_hits;
+	}
+	memset(fonts, 0, nwords * sizeof(*fonts));
+
+	for (size_t i = 0; i < nhits; ++i) {
+		const FuzzyName *name = &index->names[hits[i].name];
+		for (size_t j = 0; j < name->nfonts; ++j) {
+			size_t pos = name->fonts[j];
+			fonts[pos / 64] |= (uint64_t)1 << pos % 64;
+		}
+	}
+
+	tyrant_free(hits);
+
+	if (!add_prepared(eval, condition, fonts)) {
+		goto err_exit;
+	}
+
+	return true;
+
+err_free_hits:
+	tyrant_free(hits);
+err_exit:
+	return false;
+}
+
+// Finds the fonts passing a `FF_FIRST` containment test of a real or range in
+// the index's interval trees
+bool prepare_comparison(Eval *eval, const FfCondition *condition)
+{
+	FfComparison comparison = condition->value.comparison;
+	FfRelationalOperator oper = comparison.oper;
+
+	int r = find_range_index(comparison.object);
+	if (r < 0 || comparison.quantifier != FF_FIRST
+			|| (oper != FF_CONTAINS && oper != FF_DOES_NOT_CONTAIN)
+			|| find_prepared(eval, condition) != NULL) {
+		return true;
+	}
+
+	RangeQuery query;
+	if (!init_range_query(&query, comparison.value)) {
+		return true;
+	}
+
+	const FfIndex *index = eval->index;
+	const RangeIndex *range_index = &index->ranges[r];
+
+	query.positions = TYRANT_ALLOC_ARR(query.positions,
+			range_index->len == 0 ? 1 : range_index->len);
+	if (query.positions == NULL) {
+		goto err_exit;
+	}
+
+	size_t nwords = (index->set->nfont + 63) / 64;
+	uint64_t *fonts = TYRANT_ALLOC_ARR(fonts, nwords == 0 ? 1 : nwords);
+	if (fonts == NULL) {
+		goto err_free_positions;
+	}
+	memset(fonts, 0, nwords * sizeof(*fonts));
+
+	query_range_index(range_index, 0, range_index->len, &query);
+	for (size_t i = 0; i < query.npositions; ++i) {
+		size_t pos = query.positions[i];
+		fonts[pos / 64] |= (uint64_t)1 << pos % 64;
+	}
+
+	// Every other font with a value doesn't contain it
+	if (oper == FF_DOES_NOT_CONTAIN) {
+		for (size_t i = 0; i < nwords; ++i) {
+			fonts[i] = range_index->present[i] & ~fonts[i];
+		}
+	}
+
+	tyrant_free(query.positions);
+
+	if (!add_prepared(eval, condition, fonts)) {
+		goto err_exit;
+	}
+
+	return true;
+
+err_free_positions:
+	tyrant_free(query.positions);
+err_exit:
+	return false;
+}
+
+// Takes ownership of `fonts`, even on failure
+// `condition` must not have been added yet
+bool add_prepared(Eval *eval, const FfCondition *condition, uint64_t *fonts)
+{
+	if ((eval->nprepared + 1) * 2 > eval->nslots
+			&& !rehash_prepared(eval)) {
+		tyrant_free(fonts);
+		return false;
+	}
+
+	size_t mask = eval->nslots - 1;
+	size_t slot = hash_pointer(condition) & mask;
+	while (eval->prepared[slot].condition != NULL) {
+		slot = (slot + 1) & mask;
+	}
+
+	eval->prepared[slot] = (Prepared){
+		.condition = condition,
+		.fonts = fonts
+	};
+	++eval->nprepared;
+
+	return true;
+}
+
+bool rehash_prepared(Eval *eval)
+{
+	size_t nslots = eval->nslots == 0 ? 8 : eval->nslots * 2;
+	Prepared *prepared = TYRANT_ALLOC_ARR(prepared, nslots);
+	if (prepared == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i < nslots; ++i) {
+		prepared[i] = (Prepared){ .condition = NULL, .fonts = NULL };
+	}
+
+	size_t mask = nslots - 1;
+	for (size_t i = 0; i < eval->nslots; ++i) {
+		Prepared entry = eval->prepared[i];
+		if (entry.condition == NULL) {
+			continue;
+		}
+
+		size_t slot = hash_pointer(entry.condition) & mask;
+		while (prepared[slot].condition != NULL) {
+			slot = (slot + 1) & mask;
+		}
+		prepared[slot] = entry;
+	}
+
+	tyrant_free(eval->prepared);
+	eval->prepared = prepared;
+	eval->nslots = nslots;
+
+	return true;
+}
+
+const uint64_t *find_prepared(const Eval *eval, const FfCondition *condition)
+{
+	if (eval->nprepared == 0) {
+		return NULL;
+	}
+
+	size_t mask = eval->nslots - 1;
+	size_t slot = hash_pointer(condition) & mask;
+	while (eval->prepared[slot].condition != NULL) {
+		if (eval->prepared[slot].condition == condition) {
+			return eval->prepared[slot].fonts;
+		}
+
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+// Conditions are allocated apart, so their addresses' low bits vary little
+uint64_t hash_pointer(const void *pointer)
+{
+	uint64_t hash = (uint64_t)(uintptr_t)pointer * 0x9e3779b97f4a7c15u;
+
+	return hash ^ hash >> 32;
+}
+
+bool init_estimator(FfIndex *index)
+{
+	FcFontSet *set = index->set;
+	size_t nfont = set->nfont;
+
+	size_t i = 0;
+	for (; i < NHISTOGRAMS; ++i) {
+		if (!build_histogram(set, histogram_objects[i],
+					&index->histograms[i])) {
+			goto err_free_histograms;
+		}
+	}
+
+	size_t *order = TYRANT_ALLOC_ARR(order, nfont == 0 ? 1 : nfont);
+	if (order == NULL) {
+		goto err_free_histograms;
+	}
+
+	for (size_t j = 0; j < nfont; ++j) {
+		order[j] = j;
+	}
+
+	// Partial Fisher-Yates shuffle, with a fixed seed so that estimates are
+	// reproducible
+	size_t nsample = nfont < ESTIMATE_SAMPLE_LEN ? nfont
+			: ESTIMATE_SAMPLE_LEN;
+	uint64_t state = 0x9e3779b97f4a7c15;
+	for (size_t j = 0; j < nsample; ++j) {
+		size_t k = j + next_random(&state) % (nfont - j);
+
+		size_t swp = order[j];
+		order[j] = order[k];
+		order[k] = swp;
+	}
+
+	size_t *sample = TYRANT_ALLOC_ARR(sample, nsample == 0 ? 1 : nsample);
+	if (sample == NULL) {
+		goto err_free_order;
+	}
+	memcpy(sample, order, nsample * sizeof(*sample));
+
+	tyrant_free(order);
+
+	index->sample = sample;
+	index->nsample = nsample;
+	return true;
+
+err_free_order:
+	tyrant_free(order);
+err_free_histograms:
+	while (i > 0) {
+		tyrant_free(index->histograms[--i].buckets);
+	}
+	return false;
+}
+
+void destroy_estimator(FfIndex *index)
+{
+	for (size_t i = 0; i < NHISTOGRAMS; ++i) {
+		tyrant_free(index->histograms[i].buckets);
+	}
+
+	tyrant_free(index->sample);
+}
+
+bool build_histogram(FcFontSet *set, const char *object,
+		Histogram *histogram)
+{
+	double *values = TYRANT_ALLOC_ARR(values,
+			set->nfont == 0 ? 1 : set->nfont);
+	if (values == NULL) {
+		goto err_exit;
+	}
+
+	size_t nreal = 0;
+	size_t nother = 0;
+	for (int i = 0; i < set->nfont; ++i) {
+		FcValue value;
+		FcResult result = FcPatternGet(set->fonts[i], object, 0,
+				&value);
+		if (result != FcResultMatch) {
+			continue;
+		}
+
+		if (value.type == FcTypeInteger) {
+			values[nreal++] = value.u.i;
+		} else if (value.type == FcTypeDouble && !isnan(value.u.d)) {
+			values[nreal++] = value.u.d;
+		} else {
+			nother++;
+		}
+	}
+
+	qsort(values, nreal, sizeof(*values), compare_doubles);
+
+	size_t ndistinct = 0;
+	for (size_t i = 0; i < nreal; ++i) {
+		if (i == 0 || values[i] != values[i - 1]) {
+			++ndistinct;
+		}
+	}
+
+	Bucket *buckets = TYRANT_ALLOC_ARR(buckets, HISTOGRAM_MAX_BUCKETS);
+	if (buckets == NULL) {
+		goto err_free_values;
+	}
+
+	// A bucket per distinct value if possible, else buckets of roughly
+	// equal counts, never splitting a value across buckets
+	size_t depth = 1;
+	if (ndistinct > HISTOGRAM_MAX_BUCKETS) {
+		depth = (nreal + HISTOGRAM_MAX_BUCKETS - 1)
+				/ HISTOGRAM_MAX_BUCKETS;
+	}
+
+	size_t nbuckets = 0;
+	for (size_t start = 0; start < nreal;) {
+		size_t end = start + depth < nreal ? start + depth : nreal;
+		while (end < nreal && values[end] == values[end - 1]) {
+			++end;
+		}
+
+		size_t bucket_ndistinct = 1;
+		for (size_t i = start + 1; i < end; ++i) {
+			if (values[i] != values[i - 1]) {
+				++bucket_ndistinct;
+			}
+		}
+
+		buckets[nbuckets++] = (Bucket){
+			.lo = values[start],
+			.hi = values[end - 1],
+			.count = end - start,
+			.ndistinct = bucket_ndistinct
+		};
+		start = end;
+	}
+
+	tyrant_free(values);
+
+	*histogram = (Histogram){
+		.buckets = buckets,
+		.nbuckets = nbuckets,
+		.nreal = nreal,
+		.nother = nother
+	};
+	return true;
+
+err_free_values:
+	tyrant_free(values);
+err_exit:
+	return false;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+// xorshift64
+uint64_t next_random(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+bool init_range_indexes(FfIndex *index)
+{
+	size_t i = 0;
+	for (; i < NRANGE_INDEXES; ++i) {
+		if (!build_range_index(index->set, range_objects[i],
+					&index->ranges[i])) {
+			goto err_destroy_range_indexes;
+		}
+	}
+
+	return true;
+
+err_destroy_range_indexes:
+	while (i > 0) {
+		--i;
+		tyrant_free(index->ranges[i].entries);
+		tyrant_free(index->ranges[i].present);
+	}
+	return false;
+}
+
+void destroy_range_indexes(FfIndex *index)
+{
+	for (size_t i = 0; i < NRANGE_INDEXES; ++i) {
+		tyrant_free(index->ranges[i].entries);
+		tyrant_free(index->ranges[i].present);
+	}
+}
+
+bool build_range_index(FcFontSet *set, const char *object,
+		RangeIndex *range_index)
+{
+	size_t nfont = set->nfont;
+
+	RangeEntry *entries = TYRANT_ALLOC_ARR(entries, nfont == 0 ? 1 : nfont);
+	if (entries == NULL) {
+		goto err_exit;
+	}
+
+	size_t nwords = (nfont + 63) / 64;
+	uint64_t *present = TYRANT_ALLOC_ARR(present, nwords == 0 ? 1 : nwords);
+	if (present == NULL) {
+		goto err_free_entries;
+	}
+	memset(present, 0, nwords * sizeof(*present));
+
+	size_t len = 0;
+	for (size_t i = 0; i < nfont; ++i) {
+		FcValue value;
+		FcResult result = FcPatternGet(set->fonts[i], object, 0,
+				&value);
+		if (result != FcResultMatch) {
+			continue;
+		}
+
+		present[i / 64] |= (uint64_t)1 << i % 64;
+
+		double from;
+		double to;
+		if (value.type == FcTypeInteger) {
+			from = to = value.u.i;
+		} else if (value.type == FcTypeDouble) {
+			from = to = value.u.d;
+		} else if (value.type != FcTypeRange
+				|| !FcRangeGetDouble(value.u.r, &from, &to)) {
+			continue;
+		}
+
+		// Never contain, nor are contained by, anything
+		if (isnan(from) || isnan(to)) {
+			continue;
+		}
+
+		entries[len++] = (RangeEntry){
+			.from = from,
+			.to = to,
+			.pos = i,
+			.is_range = value.type == FcTypeRange,
+			.split = 0
+		};
+	}
+
+	qsort(entries, len, sizeof(*entries), compare_range_entries);
+	build_priority_tree(entries, len);
+
+	*range_index = (RangeIndex){
+		.entries = entries,
+		.len = len,
+		.present = present
+	};
+	return true;
+
+err_free_entries:
+	tyrant_free(entries);
+err_exit:
+	return false;
+}
+
+// Rearranges `entries`, sorted by `from`, into a priority search tree
+void build_priority_tree(RangeEntry *entries, size_t len)
+{
+	if (len <= 1) {
+		return;
+	}
+
+	size_t top = 0;
+	for (size_t i = 1; i < len; ++i) {
+		if (entries[i].to > entries[top].to) {
+			top = i;
+		}
+	}
+
+	RangeEntry root = entries[top];
+	memmove(&entries[1], &entries[0], top * sizeof(*entries));
+	entries[0] = root;
+
+	// The left subtree is never the smaller one
+	size_t nleft = len / 2;
+	entries[0].split = entries[nleft].from;
+
+	build_priority_tree(&entries[1], nleft);
+	build_priority_tree(&entries[1 + nleft], len - 1 - nleft);
+}
+
+int compare_range_entries(const void *a, const void *b)
+{
+	const RangeEntry *x = a;
+	const RangeEntry *y = b;
+
+	if (x->from != y->from) {
+		return x->from < y->from ? -1 : 1;
+	}
+	if (x->pos != y->pos) {
+		return x->pos < y->pos ? -1 : 1;
+	}
+	return 0;
+}
+
+int find_range_index(const char *object)
+{
+	for (int i = 0; i < NRANGE_INDEXES; ++i) {
+		if (strcmp(range_objects[i], object) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Returns false if `value` can't be contained in any range
+bool init_range_query(RangeQuery *query, FcValue value)
+{
+	double from;
+	double to;
+	if (value.type == FcTypeInteger) {
+		from = to = value.u.i;
+	} else if (value.type == FcTypeDouble) {
+		from = to = value.u.d;
+	} else if (value.type != FcTypeRange
+			|| !FcRangeGetDouble(value.u.r, &from, &to)) {
+		return false;
+	}
+
+	*query = (RangeQuery){
+		.from = from,
+		.to = to,
+		.is_range = value.type == FcTypeRange,
+		.positions = NULL,
+		.npositions = 0
+	};
+	return true;
+}
+
+// Reports the entries of the subtree stored in `[start, end)` which contain
+// the query. Only one path down the tree is followed beyond the subtrees in
+// which every entry starts early enough, so it takes O(log n + k) time.
+void query_range_index(const RangeIndex *range_index, size_t start,
+		size_t end, RangeQuery *query)
+{
+	while (start < end) {
+		const RangeEntry *root = &range_index->entries[start];
+		if (root->to < query->to) {
+			return;
+		}
+
+		// Reals only contain reals (i.e. if they're equal)
+		if (root->from <= query->from
+				&& (root->is_range || !query->is_range)) {
+			query->positions[query->npositions++] = root->pos;
+		}
+
+		size_t len = end - start;
+		size_t left = start + 1;
+		size_t right = start + 1 + len / 2;
+		if (len == 1) {
+			return;
+		}
+
+		if (root->split <= query->from) {
+			report_range_entries(range_index, left, right, query);
+			start = right;
+		} else {
+			end = right;
+			start = left;
+		}
+	}
+}
+
+// Reports the entries of the subtree stored in `[start, end)` which end late
+// enough to contain the query, given that they all start early enough
+void report_range_entries(const RangeIndex *range_index, size_t start,
+		size_t end, RangeQuery *query)
+{
+	if (start >= end) {
+		return;
+	}
+
+	const RangeEntry *root = &range_index->entries[start];
+	if (root->to < query->to) {
+		return;
+	}
+
+	if (root->is_range || !query->is_range) {
+		query->positions[query->npositions++] = root->pos;
+	}
+
+	size_t len = end - start;
+	report_range_entries(range_index, start + 1, start + 1 + len / 2,
+			query);
+	report_range_entries(range_index, start + 1 + len / 2, end, query);
+}
+
+FcFontSet *find_containing(FfIndex *index, const char *object, FcValue value)
+{
+	FcFontSet *set = index->set;
+
+	FcFontSet *found = FcFontSetCreate();
+	if (found == NULL) {
+		goto err_exit;
+	}
+
+	int r = find_range_index(object);
+	RangeQuery query;
+	if (!init_range_query(&query, value)) {
+		return found;
+	}
+
+	if (r < 0) {
+		FfComparison comparison = {
+			.object = object,
+			.value = value,
+			.oper = FF_CONTAINS,
+			.quantifier = FF_FIRST,
+			.page_summary = NULL
+		};
+
+		for (int i = 0; i < set->nfont; ++i) {
+			FcPattern *font = set->fonts[i];
+			if (!test_comparison(comparison, font, NULL)) {
+				continue;
+			}
+
+			FcPatternReference(font);
+			bool success = FcFontSetAdd(found, font);
+			if (!success) {
+				goto err_destroy_found;
+			}
+		}
+
+		return found;
+	}
+
+	const RangeIndex *range_index = &index->ranges[r];
+	query.positions = TYRANT_ALLOC_ARR(query.positions,
+			range_index->len == 0 ? 1 : range_index->len);
+	if (query.positions == NULL) {
+		goto err_destroy_found;
+	}
+
+	query_range_index(range_index, 0, range_index->len, &query);
+	qsort(query.positions, query.npositions, sizeof(*query.positions),
+			compare_positions);
+
+	for (size_t i = 0; i < query.npositions; ++i) {
+		FcPattern *font = set->fonts[query.positions[i]];
+
+		FcPatternReference(font);
+		bool success = FcFontSetAdd(found, font);
+		if (!success) {
+			goto err_free_positions;
+		}
+	}
+
+	tyrant_free(query.positions);
+	return found;
+
+err_free_positions:
+	tyrant_free(query.positions);
+err_destroy_found:
+	FcFontSetDestroy(found);
+err_exit:
+	return NULL;
+}
+
+int compare_positions(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a;
+	size_t y = *(const size_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+// Estimates the fraction of fonts satisfying `condition` from histograms, or
+// returns false if it would need to be tested on fonts
+bool model_condition(const FfIndex *index, FfCondition *condition,
+		Model *ret_model)
+{
+	switch (condition->type) {
+	case FF_COMPARISON:
+		return model_comparison(index, condition->value.comparison,
+				ret_model);
+	case FF_COMPOSITION:
+		return model_composition(index, condition->value.composition,
+				ret_model);
+	case FF_INTERVAL:
+		return model_interval(index, condition->value.interval,
+				ret_model);
+	case FF_CONSTANT: {
+		double p = condition->value.constant.value ? 1 : 0;
+		*ret_model = (Model){
+			.p = p,
+			.low = p,
+			.high = p,
+			.objects = 0
+		};
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+bool model_comparison(const FfIndex *index, FfComparison comparison,
+		Model *ret_model)
+{
+	int h = find_histogram(comparison.object);
+	if (h < 0 || comparison.quantifier != FF_FIRST) {
+		return false;
+	}
+
+	FcValue value = comparison.value;
+	double d;
+	if (value.type == FcTypeInteger) {
+		d = value.u.i;
+	} else if (value.type == FcTypeDouble) {
+		d = value.u.d;
+	} else {
+		return false;
+	}
+
+	FfInterval interval = {
+		.object = comparison.object,
+		.from = -INFINITY,
+		.to = INFINITY,
+		.from_inclusive = true,
+		.to_inclusive = true
+	};
+
+	FfRelationalOperator oper = comparison.oper;
+	switch (oper) {
+	case FF_LESS_THAN:
+		interval.to_inclusive = false;
+		// fallthrough
+	case FF_LESS_THAN_EQUAL:
+		interval.to = d;
+		break;
+	case FF_GREATER_THAN:
+		interval.from_inclusive = false;
+		// fallthrough
+	case FF_GREATER_THAN_EQUAL:
+		interval.from = d;
+		break;
+	default:
+		// (In)equality, which is what containment is between reals
+		interval.from = d;
+		interval.to = d;
+		break;
+	}
+
+	const Histogram *histogram = &index->histograms[h];
+	Model model = count_in_interval(histogram, interval);
+
+	double nreal = histogram->nreal;
+	double nother = histogram->nother;
+	if (oper == FF_NOT_EQUAL || oper == FF_DOES_NOT_CONTAIN
+			|| oper == FF_NOT_CONTAINED_IN) {
+		model = (Model){
+			.p = nreal - model.p,
+			.low = nreal - model.high,
+			.high = nreal - model.low
+		};
+	}
+
+	switch (oper) {
+	case FF_NOT_EQUAL:
+		// Values of other types never equal reals
+		model.p += nother;
+		model.low += nother;
+		model.high += nother;
+		break;
+	case FF_CONTAINS:
+	case FF_DOES_NOT_CONTAIN:
+	case FF_CONTAINED_IN:
+	case FF_NOT_CONTAINED_IN:
+		// Ranges, for example, may or may not contain `d`
+		model.p += nreal > 0 ? nother * model.p / nreal : nother / 2;
+		model.high += nother;
+		break;
+	default:
+		// Values of other types never pass ordering comparisons
+		break;
+	}
+
+	double nfont = index->set->nfont == 0 ? 1 : index->set->nfont;
+	*ret_model = (Model){
+		.p = model.p / nfont,
+		.low = model.low / nfont,
+		.high = model.high / nfont,
+		.objects = (uint32_t)1 << h
+	};
+	return true;
+}
+
+bool model_interval(const FfIndex *index, FfInterval interval,
+		Model *ret_model)
+{
+	int h = find_histogram(interval.object);
+	if (h < 0) {
+		return false;
+	}
+
+	// Values which aren't real never pass
+	Model model = count_in_interval(&index->histograms[h], interval);
+
+	double nfont = index->set->nfont == 0 ? 1 : index->set->nfont;
+	*ret_model = (Model){
+		.p = model.p / nfont,
+		.low = model.low / nfont,
+		.high = model.high / nfont,
+		.objects = (uint32_t)1 << h
+	};
+	return true;
+}
+
+// Combines estimates of conditions on different properties, as if the
+// properties were independent, but with bounds which hold whatever they are
+bool model_composition(const FfIndex *index, FfLogicalComposition composition,
+		Model *ret_model)
+{
+	Model p;
+	Model q;
+	if (!model_condition(index, composition.p, &p)
+			|| !model_condition(index, composition.q, &q)
+			|| (p.objects & q.objects) != 0) {
+		return false;
+	}
+
+	FfLogicalOperator oper = composition.oper;
+
+	double low;
+	double high;
+	bound_truth_table(oper, p, q, &low, &high);
+
+	*ret_model = (Model){
+		.p = eval_truth_table(oper, p.p, q.p),
+		.low = low,
+		.high = high,
+		.objects = p.objects | q.objects
+	};
+	return true;
+}
+
+// Combines estimates of a list's conditions like `model_composition()`, but
+// first intersects the intervals of comparisons on the same property, which
+// then aren't independent
+bool model_list(const FfIndex *index, const FfList *list, Model *ret_model)
+{
+	FfInterval intervals[NHISTOGRAMS];
+	uint32_t merged = 0;
+
+	Model model = { .p = 1, .low = 1, .high = 1, .objects = 0 };
+	for (size_t i = 0; i < list->len; ++i) {
+		FfCondition *condition = list->conditions[i];
+
+		Literal lit = { .condition = condition, .positive = true };
+		FfInterval interval;
+		int h = literal_interval(lit, &interval)
+				? find_histogram(interval.object) : -1;
+		if (h >= 0) {
+			if (merged & (uint32_t)1 << h) {
+				intervals[h] = intersect_intervals(intervals[h],
+						interval);
+			} else {
+				intervals[h] = interval;
+				merged |= (uint32_t)1 << h;
+			}
+			continue;
+		}
+
+		Model m;
+		if (!model_condition(index, condition, &m)
+				|| (m.objects & model.objects) != 0) {
+			return false;
+		}
+		model = and_models(model, m);
+	}
+
+	for (int h = 0; h < NHISTOGRAMS; ++h) {
+		if (!(merged & (uint32_t)1 << h)) {
+			continue;
+		}
+
+		Model m;
+		if (!model_interval(index, intervals[h], &m)
+				|| (m.objects & model.objects) != 0) {
+			return false;
+		}
+		model = and_models(model, m);
+	}
+
+	*ret_model = model;
+	return true;
+}
+
+// Estimates the fonts passing both `p` and `q`, which are on different
+// properties
+Model and_models(Model p, Model q)
+{
+	FfLogicalOperator and = {
+		.pt_qt = true,
+		.pt_qf = false,
+		.pf_qt = false,
+		.pf_qf = false
+	};
+
+	double low;
+	double high;
+	bound_truth_table(and, p, q, &low, &high);
+
+	return (Model){
+		.p = p.p * q.p,
+		.low = low,
+		.high = high,
+		.objects = p.objects | q.objects
+	};
+}
+
+// Probability of passing, given independent operands which pass with
+// probabilities `p` and `q`
+double eval_truth_table(FfLogicalOperator oper, double p, double q)
+{
+	return oper.pt_qt * p * q
+			+ oper.pt_qf * p * (1 - q)
+			+ oper.pf_qt * (1 - p) * q
+			+ oper.pf_qf * (1 - p) * (1 - q);
+}
+
+// Fréchet bounds: the least and greatest fraction of fonts passing, over every
+// joint distribution of operands which pass with fractions within the bounds
+// of `p` and `q`
+void bound_truth_table(FfLogicalOperator oper, Model p, Model q,
+		double *ret_low, double *ret_high)
+{
+	// Given the operands' fractions, the result is linear in the fraction
+	// passing both, which ranges from max(0, p + q - 1) to min(p, q). Those
+	// are linear but for kinks along p + q = 1 and p = q, so the extremes
+	// are at the corners of the operands' bounds or where those lines cross
+	// the bounds' edges.
+	double ps[12];
+	double qs[12];
+	size_t n = 0;
+
+	double p_edges[2] = { p.low, p.high };
+	double q_edges[2] = { q.low, q.high };
+	for (size_t i = 0; i < 2; ++i) {
+		for (size_t j = 0; j < 2; ++j) {
+			ps[n] = p_edges[i];
+			qs[n++] = q_edges[j];
+		}
+
+		double crossings[2] = { 1 - p_edges[i], p_edges[i] };
+		for (size_t j = 0; j < 2; ++j) {
+			if (crossings[j] > q.low && crossings[j] < q.high) {
+				ps[n] = p_edges[i];
+				qs[n++] = crossings[j];
+			}
+		}
+	}
+	for (size_t i = 0; i < 2; ++i) {
+		double crossings[2] = { 1 - q_edges[i], q_edges[i] };
+		for (size_t j = 0; j < 2; ++j) {
+			if (crossings[j] > p.low && crossings[j] < p.high) {
+				ps[n] = crossings[j];
+				qs[n++] = q_edges[i];
+			}
+		}
+	}
+
+	double low = INFINITY;
+	double high = -INFINITY;
+	for (size_t i = 0; i < n; ++i) {
+		double least_both = fmax(ps[i] + qs[i] - 1, 0);
+		double most_both = fmin(ps[i], qs[i]);
+
+		double a = eval_joint(oper, ps[i], qs[i], least_both);
+		double b = eval_joint(oper, ps[i], qs[i], most_both);
+		low = fmin(low, fmin(a, b));
+		high = fmax(high, fmax(a, b));
+	}
+
+	*ret_low = fmin(fmax(low, 0), 1);
+	*ret_high = fmin(fmax(high, 0), 1);
+}
+
+// Fraction passing, given the fractions of fonts passing `p`, `q` and both
+double eval_joint(FfLogicalOperator oper, double p, double q, double both)
+{
+	return oper.pt_qt * both
+			+ oper.pt_qf * (p - both)
+			+ oper.pf_qt * (q - both)
+			+ oper.pf_qf * (1 - p - q + both);
+}
+
+int find_histogram(const char *object)
+{
+	for (int i = 0; i < NHISTOGRAMS; ++i) {
+		if (strcmp(histogram_objects[i], object) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Counts the fonts with a real value in `interval`, assuming that values are
+// spread evenly over the buckets which are only partially in it
+Model count_in_interval(const Histogram *histogram, FfInterval interval)
+{
+	Model model = { .p = 0, .low = 0, .high = 0, .objects = 0 };
+
+	// Such as intersections of disjoint intervals
+	if (interval_is_empty(interval)) {
+		return model;
+	}
+
+	for (size_t i = 0; i < histogram->nbuckets; ++i) {
+		Bucket bucket = histogram->buckets[i];
+
+		bool above_from = interval.from_inclusive
+				? bucket.hi >= interval.from
+				: bucket.hi > interval.from;
+		bool below_to = interval.to_inclusive
+				? bucket.lo <= interval.to
+				: bucket.lo < interval.to;
+		if (!above_from || !below_to) {
+			continue;
+		}
+
+		model.high += bucket.count;
+
+		bool lo_inside = interval.from_inclusive
+				? bucket.lo >= interval.from
+				: bucket.lo > interval.from;
+		bool hi_inside = interval.to_inclusive
+				? bucket.hi <= interval.to
+				: bucket.hi < interval.to;
+		if (lo_inside && hi_inside) {
+			model.p += bucket.count;
+			model.low += bucket.count;
+			continue;
+		}
+
+		// Only reached if `bucket.lo < bucket.hi`
+		double fraction;
+		if (interval.from == interval.to) {
+			fraction = 1.0 / bucket.ndistinct;
+		} else {
+			double overlap = fmin(bucket.hi, interval.to)
+					- fmax(bucket.lo, interval.from);
+			fraction = overlap / (bucket.hi - bucket.lo);
+		}
+		model.p += bucket.count * fmin(fmax(fraction, 0), 1);
+	}
+
+	return model;
+}
+
+bool eval_logical_operation(FfLogicalOperator oper, bool p, bool q)
+{
+	if (p && q) {
+		return oper.pt_qt;
+	}
+	if (p && !q) {
+		return oper.pt_qf;
+	}
+	if (!p && q) {
+		return oper.pf_qt;
+	}
+	return oper.pf_qf;
+}
+
+FcFontSet *copy_font_set(FcFontSet *set)
+{
+	FcFontSet *copy = FcFontSetCreate();
+	if (copy == NULL) {
+		goto err_exit;
+	}
+
+	for (int i = 0; i < set->nfont; ++i) {
+		FcPattern *font = set->fonts[i];
+
+		FcPatternReference(font);
+		bool success = FcFontSetAdd(copy, font);
+		if (!success) {
+			goto err_destroy_copy;
+		}
+	}
+
+	return copy;
+	
+err_destroy_copy:
+	FcFontSetDestroy(copy);
+err_exit:
+	return NULL;
+}
+
+FfCondition *optimize(Optimizer *opt, FfCondition *condition)
+{
+	if (condition->type != FF_COMPOSITION) {
+		return intern(opt, ff_condition_ref(condition));
+	}
+
+	FfLogicalComposition composition = condition->value.composition;
+
+	int ntrue = count_true(composition.oper);
+	if (composition.p != composition.q && (ntrue == 1 || ntrue == 3)) {
+		return optimize_junction(opt, condition, ntrue == 1);
+	}
+
+	FfCondition *p = optimize(opt, composition.p);
+	if (p == NULL) {
+		return NULL;
+	}
+
+	FfCondition *q;
+	if (composition.q == composition.p) {
+		q = ff_condition_ref(p);
+	} else {
+		q = optimize(opt, composition.q);
+	}
+	if (q == NULL) {
+		ff_condition_unref(p);
+		return NULL;
+	}
+
+	return simplify(opt, p, composition.oper, q);
+}
+
+// Flattens a whole chain of conjunctions (`conj`) or disjunctions once, rather
+// than simplifying every nested junction of the chain on its own
+FfCondition *optimize_junction(Optimizer *opt, FfCondition *condition,
+		bool conj)
+{
+	LiteralList list = { .literals = NULL, .len = 0, .cap = 0 };
+
+	bool success = collect_literals(opt, &list,
+			(Literal){ .condition = condition, .positive = true },
+			conj);
+	if (!success) {
+		destroy_literal_list(list);
+		return NULL;
+	}
+
+	return reduce_junction(opt, list, conj);
+}
+
+// Same as `add_literal()`, but for unoptimized conditions: the operands of the
+// junctions are optimized and then added
+bool collect_literals(Optimizer *opt, LiteralList *list, Literal lit,
+		bool conj)
+{
+	FfCondition *condition = lit.condition;
+
+	if (is_negation(condition)) {
+		return collect_literals(opt, list, (Literal){
+			.condition = condition->value.composition.p,
+			.positive = !lit.positive
+		}, conj);
+	}
+
+	Literal sub[2];
+	if (junction_literals(condition, lit.positive ? conj : !conj, sub)) {
+		if (!lit.positive) {
+			sub[0].positive = !sub[0].positive;
+			sub[1].positive = !sub[1].positive;
+		}
+
+		return collect_literals(opt, list, sub[0], conj)
+				&& collect_literals(opt, list, sub[1], conj);
+	}
+
+	FfCondition *optimized = optimize(opt, condition);
+	if (optimized == NULL) {
+		return false;
+	}
+
+	bool success = add_literal(list, (Literal){
+		.condition = optimized,
+		.positive = lit.positive
+	}, conj);
+	ff_condition_unref(optimized);
+
+	return success;
+}
+
+// Consumes the references to `p` and `q`
+FfCondition *simplify(Optimizer *opt, FfCondition *p, FfLogicalOperator oper,
+		FfCondition *q)
+{
+	while (is_negation(p)) {
+		FfCondition *inner = ff_condition_ref(p->value.composition.p);
+		ff_condition_unref(p);
+		p = inner;
+		oper = swap_p(oper);
+	}
+
+	while (is_negation(q)) {
+		FfCondition *inner = ff_condition_ref(q->value.composition.p);
+		ff_condition_unref(q);
+		q = inner;
+		oper = swap_q(oper);
+	}
+
+	if (p->type == FF_CONSTANT) {
+		bool c = p->value.constant.value;
+		ff_condition_unref(p);
+		return simplify_unary(opt, q,
+				eval_logical_operation(oper, c, true),
+				eval_logical_operation(oper, c, false));
+	}
+
+	if (q->type == FF_CONSTANT) {
+		bool c = q->value.constant.value;
+		ff_condition_unref(q);
+		return simplify_unary(opt, p,
+				eval_logical_operation(oper, true, c),
+				eval_logical_operation(oper, false, c));
+	}
+
+	if (p == q) {
+		ff_condition_unref(q);
+		return simplify_unary(opt, p, oper.pt_qt, oper.pf_qf);
+	}
+
+	if (oper.pt_qt == oper.pt_qf && oper.pf_qt == oper.pf_qf) {
+		ff_condition_unref(q);
+		return simplify_unary(opt, p, oper.pt_qt, oper.pf_qt);
+	}
+
+	if (oper.pt_qt == oper.pf_qt && oper.pt_qf == oper.pf_qf) {
+		ff_condition_unref(p);
+		return simplify_unary(opt, q, oper.pt_qt, oper.pt_qf);
+	}
+
+	int ntrue = count_true(oper);
+	if (ntrue == 1 || ntrue == 3) {
+		return simplify_junction(opt, p, oper, q, ntrue == 1);
+	}
+
+	return intern(opt, ff_compose_unref(p, oper, q));
+}
+
+// Rewrites a conjunction (`conj`) or disjunction of `p` and `q` as a flat list
+// of literals and reduces it
+FfCondition *simplify_junction(Optimizer *opt, FfCondition *p,
+		FfLogicalOperator oper, FfCondition *q, bool conj)
+{
+	FfCondition *composition = ff_compose_unref(p, oper, q);
+	if (composition == NULL) {
+		goto err_exit;
+	}
+
+	LiteralList list = { .literals = NULL, .len = 0, .cap = 0 };
+
+	bool success = add_literal(&list,
+			(Literal){ .condition = composition, .positive = true },
+			conj);
+	ff_condition_unref(composition);
+	if (!success) {
+		goto err_destroy_list;
+	}
+
+	return reduce_junction(opt, list, conj);
+
+err_destroy_list:
+	destroy_literal_list(list);
+err_exit:
+	return NULL;
+}
+
+// Folds and merges the literals of a conjunction (`conj`) or disjunction, then
+// rebuilds the chain with the cheapest literals first. Consumes `list`.
+FfCondition *reduce_junction(Optimizer *opt, LiteralList list, bool conj)
+{
+	bool absorbed = false;
+	for (size_t i = 0; i < list.len && !absorbed; ++i) {
+		Literal lit = list.literals[i];
+		if (lit.condition->type == FF_CONSTANT) {
+			bool value = lit.condition->value.constant.value
+					== lit.positive;
+			if (value != conj) {
+				absorbed = true;
+			} else {
+				remove_literal(&list, i--);
+			}
+			continue;
+		}
+
+		for (size_t j = i + 1; j < list.len; ++j) {
+			Literal other = list.literals[j];
+			if (other.condition != lit.condition) {
+				continue;
+			}
+
+			if (other.positive != lit.positive) {
+				absorbed = true;
+				break;
+			}
+
+			remove_literal(&list, j--);
+		}
+	}
+
+	if (!absorbed && conj) {
+		if (!merge_intervals(opt, &list, &absorbed)) {
+			goto err_destroy_list;
+		}
+	}
+
+	if (absorbed) {
+		destroy_literal_list(list);
+		return intern(opt, ff_constant(!conj));
+	}
+
+	if (list.len == 0) {
+		destroy_literal_list(list);
+		return intern(opt, ff_constant(conj));
+	}
+
+	// Stable insertion sort, so that cheap literals are tested first
+	for (size_t i = 1; i < list.len; ++i) {
+		Literal lit = list.literals[i];
+		unsigned cost = condition_cost(lit.condition);
+
+		size_t j = i;
+		while (j > 0 && condition_cost(list.literals[j - 1].condition)
+				> cost) {
+			list.literals[j] = list.literals[j - 1];
+			--j;
+		}
+		list.literals[j] = lit;
+	}
+
+	Literal first = list.literals[0];
+	FfCondition *chain;
+	if (list.len == 1) {
+		chain = ff_condition_ref(first.condition);
+		if (!first.positive) {
+			chain = negate(opt, chain);
+		}
+	} else {
+		Literal second = list.literals[1];
+		chain = intern(opt, ff_compose(first.condition,
+				junction_operator(first.positive,
+					second.positive, conj),
+				second.condition));
+	}
+
+	for (size_t i = 2; i < list.len && chain != NULL; ++i) {
+		Literal lit = list.literals[i];
+		chain = intern(opt, ff_compose_unref(chain,
+				junction_operator(true, lit.positive, conj),
+				ff_condition_ref(lit.condition)));
+	}
+
+	destroy_literal_list(list);
+	return chain;
+
+err_destroy_list:
+	destroy_literal_list(list);
+	return NULL;
+}
+
+// Consumes the reference to `x`
+FfCondition *simplify_unary(Optimizer *opt, FfCondition *x, bool on_true,
+		bool on_false)
+{
+	if (on_true == on_false) {
+		ff_condition_unref(x);
+		return intern(opt, ff_constant(on_true));
+	}
+
+	if (on_true) {
+		return x;
+	}
+
+	return negate(opt, x);
+}
+
+// Consumes the reference to `x`
+FfCondition *negate(Optimizer *opt, FfCondition *x)
+{
+	if (x == NULL) {
+		return NULL;
+	}
+
+	if (x->type == FF_CONSTANT) {
+		bool value = x->value.constant.value;
+		ff_condition_unref(x);
+		return intern(opt, ff_constant(!value));
+	}
+
+	if (is_negation(x)) {
+		FfCondition *inner = ff_condition_ref(x->value.composition.p);
+		ff_condition_unref(x);
+		return inner;
+	}
+
+	return intern(opt, ff_compose_unref(x, FF_NOT_P, ff_condition_ref(x)));
+}
+
+// Consumes the reference to `condition` and returns a reference to an
+// identical condition which has already been produced, if there is one
+FfCondition *intern(Optimizer *opt, FfCondition *condition)
+{
+	if (condition == NULL) {
+		return NULL;
+	}
+
+	uint64_t hash = hash_condition(condition);
+
+	if (opt->nslots > 0) {
+		size_t mask = opt->nslots - 1;
+		for (size_t slot = hash & mask; opt->slots[slot] != 0;
+				slot = (slot + 1) & mask) {
+			FfCondition *node = opt->nodes[opt->slots[slot] - 1];
+			if (conditions_equal(node, condition)) {
+				ff_condition_unref(condition);
+				return ff_condition_ref(node);
+			}
+		}
+	}
+
+	if ((opt->len + 1) * 2 > opt->nslots && !rehash_nodes(opt)) {
+		ff_condition_unref(condition);
+		return NULL;
+	}
+
+	if (opt->len == opt->cap) {
+		size_t cap = opt->cap == 0 ? 16 : opt->cap * 2;
+
+		bool success;
+		opt->nodes = TYRANT_REALLOC_ARR(opt->nodes, cap, &success);
+		if (!success) {
+			ff_condition_unref(condition);
+			return NULL;
+		}
+
+		opt->cap = cap;
+	}
+
+	opt->nodes[opt->len++] = ff_condition_ref(condition);
+
+	size_t mask = opt->nslots - 1;
+	size_t slot = hash & mask;
+	while (opt->slots[slot] != 0) {
+		slot = (slot + 1) & mask;
+	}
+	opt->slots[slot] = opt->len;
+
+	return condition;
+}
+
+bool rehash_nodes(Optimizer *opt)
+{
+	size_t nslots = opt->nslots == 0 ? 64 : opt->nslots * 2;
+	size_t *slots = TYRANT_ALLOC_ARR(slots, nslots);
+	if (slots == NULL) {
+		return false;
+	}
+	memset(slots, 0, nslots * sizeof(*slots));
+
+	size_t mask = nslots - 1;
+	for (size_t i = 0; i < opt->len; ++i) {
+		size_t slot = hash_condition(opt->nodes[i]) & mask;
+		while (slots[slot] != 0) {
+			slot = (slot + 1) & mask;
+		}
+		slots[slot] = i + 1;
+	}
+
+	tyrant_free(opt->slots);
+	opt->slots = slots;
+	opt->nslots = nslots;
+
+	return true;
+}
+
+// Appends `lit` to `list`, expanding nested junctions of the same kind (and
+// negated junctions of the dual kind)
+bool add_literal(LiteralList *list, Literal lit, bool conj)
+{
+	FfCondition *condition = lit.condition;
+
+	if (is_negation(condition)) {
+		return add_literal(list, (Literal){
+			.condition = condition->value.composition.p,
+			.positive = !lit.positive
+		}, conj);
+	}
+
+	Literal sub[2];
+	if (junction_literals(condition, lit.positive ? conj : !conj, sub)) {
+		if (!lit.positive) {
+			sub[0].positive = !sub[0].positive;
+			sub[1].positive = !sub[1].positive;
+		}
+
+		return add_literal(list, sub[0], conj)
+				&& add_literal(list, sub[1], conj);
+	}
+
+	if (list->len == list->cap) {
+		size_t cap = list->cap == 0 ? 8 : list->cap * 2;
+
+		bool success;
+		list->literals = TYRANT_REALLOC_ARR(list->literals, cap,
+				&success);
+		if (!success) {
+			return false;
+		}
+
+		list->cap = cap;
+	}
+
+	if (ff_condition_ref(condition) == NULL) {
+		return false;
+	}
+
+	list->literals[list->len++] = lit;
+
+	return true;
+}
+
+void remove_literal(LiteralList *list, size_t i)
+{
+	ff_condition_unref(list->literals[i].condition);
+
+	memmove(&list->literals[i], &list->literals[i + 1],
+			(list->len - i - 1) * sizeof(*list->literals));
+	--list->len;
+}
+
+void destroy_literal_list(LiteralList list)
+{
+	for (size_t i = 0; i < list.len; ++i) {
+		ff_condition_unref(list.literals[i].condition);
+	}
+
+	tyrant_free(list.literals);
+}
+
+// Replaces every group of real bounds on the same property with a single
+// interval
+bool merge_intervals(Optimizer *opt, LiteralList *list, bool *ret_empty)
+{
+	*ret_empty = false;
+
+	for (size_t i = 0; i < list->len; ++i) {
+		FfInterval merged;
+		if (!literal_interval(list->literals[i], &merged)) {
+			continue;
+		}
+
+		size_t nmerged = 1;
+		for (size_t j = i + 1; j < list->len; ++j) {
+			FfInterval interval;
+			if (!literal_interval(list->literals[j], &interval)
+					|| strcmp(interval.object,
+						merged.object) != 0) {
+				continue;
+			}
+
+			merged = intersect_intervals(merged, interval);
+			remove_literal(list, j--);
+			++nmerged;
+		}
+
+		if (interval_is_empty(merged)) {
+			*ret_empty = true;
+			return true;
+		}
+
+		if (nmerged == 1) {
+			continue;
+		}
+
+		FfCondition *condition = intern(opt, ff_compare_interval(
+				merged.object, merged.from,
+				merged.from_inclusive, merged.to,
+				merged.to_inclusive));
+		if (condition == NULL) {
+			return false;
+		}
+
+		ff_condition_unref(list->literals[i].condition);
+		list->literals[i].condition = condition;
+	}
+
+	return true;
+}
+
+bool literal_interval(Literal lit, FfInterval *interval)
+{
+	FfCondition *condition = lit.condition;
+	if (!lit.positive) {
+		return false;
+	}
+
+	if (condition->type == FF_INTERVAL) {
+		*interval = condition->value.interval;
+		return true;
+	}
+
+	if (condition->type != FF_COMPARISON) {
+		return false;
+	}
+
+	FfComparison comparison = condition->value.comparison;
+	if (comparison.quantifier != FF_FIRST) {
+		return false;
+	}
+
+	FcValue value = comparison.value;
+	double d;
+	if (value.type == FcTypeInteger) {
+		d = value.u.i;
+	} else if (value.type == FcTypeDouble) {
+		d = value.u.d;
+	} else {
+		return false;
+	}
+
+	*interval = (FfInterval){
+		.object = comparison.object,
+		.from = -INFINITY,
+		.to = INFINITY,
+		.from_inclusive = true,
+		.to_inclusive = true
+	};
+
+	switch (comparison.oper) {
+	case FF_EQUAL:
+		interval->from = d;
+		interval->to = d;
+		return true;
+	case FF_LESS_THAN:
+		interval->to_inclusive = false;
+		// fallthrough
+	case FF_LESS_THAN_EQUAL:
+		interval->to = d;
+		return true;
+	case FF_GREATER_THAN:
+		interval->from_inclusive = false;
+		// fallthrough
+	case FF_GREATER_THAN_EQUAL:
+		interval->from = d;
+		return true;
+	default:
+		return false;
+	}
+}
+
+FfInterval intersect_intervals(FfInterval a, FfInterval b)
+{
+	FfInterval interval = a;
+
+	if (b.from > a.from || (b.from == a.from && !b.from_inclusive)) {
+		interval.from = b.from;
+		interval.from_inclusive = b.from_inclusive;
+	}
+
+	if (b.to < a.to || (b.to == a.to && !b.to_inclusive)) {
+		interval.to = b.to;
+		interval.to_inclusive = b.to_inclusive;
+	}
+
+	// NaN bounds are never satisfied
+	if (isnan(a.from) || isnan(a.to) || isnan(b.from) || isnan(b.to)) {
+		interval.from = NAN;
+	}
+
+	return interval;
+}
+
+bool interval_is_empty(FfInterval interval)
+{
+	if (isnan(interval.from) || isnan(interval.to)) {
+		return true;
+	}
+
+	if (interval.from == interval.to) {
+		return !interval.from_inclusive || !interval.to_inclusive;
+	}
+
+	return interval.from > interval.to;
+}
+
+bool is_negation(FfCondition *condition)
+{
+	if (condition->type != FF_COMPOSITION) {
+		return false;
+	}
+
+	FfLogicalComposition composition = condition->value.composition;
+
+	return composition.p == composition.q
+			&& !composition.oper.pt_qt
+			&& composition.oper.pf_qf;
+}
+
+// Splits a conjunction (`conj`) or disjunction of two literals
+bool junction_literals(FfCondition *condition, bool conj, Literal ret_lits[2])
+{
+	if (condition->type != FF_COMPOSITION) {
+		return false;
+	}
+
+	FfLogicalComposition composition = condition->value.composition;
+	if (composition.p == composition.q
+			|| count_true(composition.oper) != (conj ? 1 : 3)) {
+		return false;
+	}
+
+	for (int i = 0; i < 4; ++i) {
+		bool p = i < 2;
+		bool q = i % 2 == 0;
+		if (eval_logical_operation(composition.oper, p, q) == conj) {
+			ret_lits[0] = (Literal){
+				.condition = composition.p,
+				.positive = conj ? p : !p
+			};
+			ret_lits[1] = (Literal){
+				.condition = composition.q,
+				.positive = conj ? q : !q
+			};
+			return true;
+		}
+	}
+
+	return false;
+}
+
+FfLogicalOperator junction_operator(bool p_positive, bool q_positive,
+		bool conj)
+{
+	if (conj) {
+		return (FfLogicalOperator){
+			.pt_qt = p_positive && q_positive,
+			.pt_qf = p_positive && !q_positive,
+			.pf_qt = !p_positive && q_positive,
+			.pf_qf = !p_positive && !q_positive
+		};
+	}
+
+	return (FfLogicalOperator){
+		.pt_qt = p_positive || q_positive,
+		.pt_qf = p_positive || !q_positive,
+		.pf_qt = !p_positive || q_positive,
+		.pf_qf = !p_positive || !q_positive
+	};
+}
+
+FfLogicalOperator swap_p(FfLogicalOperator oper)
+{
+	return (FfLogicalOperator){
+		.pt_qt = oper.pf_qt,
+		.pt_qf = oper.pf_qf,
+		.pf_qt = oper.pt_qt,
+		.pf_qf = oper.pt_qf
+	};
+}
+
+FfLogicalOperator swap_q(FfLogicalOperator oper)
+{
+	return (FfLogicalOperator){
+		.pt_qt = oper.pt_qf,
+		.pt_qf = oper.pt_qt,
+		.pf_qt = oper.pf_qf,
+		.pf_qf = oper.pf_qt
+	};
+}
+
+int count_true(FfLogicalOperator oper)
+{
+	return oper.pt_qt + oper.pt_qf + oper.pf_qt + oper.pf_qf;
+}
+
+// Rough relative cost of testing `condition` against a pattern
+unsigned condition_cost(FfCondition *condition)
+{
+	switch (condition->type) {
+	case FF_COMPARISON:
+		switch (condition->value.comparison.value.type) {
+		case FcTypeCharSet:
+		case FcTypeLangSet:
+			return 8;
+		case FcTypeString:
+			return 2;
+		default:
+			return 1;
+		}
+	case FF_COMPOSITION: {
+		FfLogicalComposition composition = condition->value.composition;
+		unsigned cost = 1 + condition_cost(composition.p);
+		if (composition.q != composition.p) {
+			cost += condition_cost(composition.q);
+		}
+		return cost;
+	}
+	case FF_CHAR_REQUIREMENT:
+	case FF_LANG_REQUIREMENT:
+		return 2;
+	case FF_FUZZY_MATCH:
+		return 8;
+	case FF_CONSTANT:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+// Children of compositions are compared by identity, which is sufficient
+// because the optimizer only composes interned conditions
+bool conditions_equal(FfCondition *a, FfCondition *b)
+{
+	if (a == b) {
+		return true;
+	}
+
+	if (a->type != b->type) {
+		return false;
+	}
+
+	switch (a->type) {
+	case FF_COMPARISON: {
+		FfComparison a_cmp = a->value.comparison;
+		FfComparison b_cmp = b->value.comparison;
+		return a_cmp.oper == b_cmp.oper
+				&& a_cmp.quantifier == b_cmp.quantifier
+				&& strcmp(a_cmp.object, b_cmp.object) == 0
+				&& values_identical(a_cmp.value, b_cmp.value);
+	}
+	case FF_COMPOSITION: {
+		FfLogicalComposition a_comp = a->value.composition;
+		FfLogicalComposition b_comp = b->value.composition;
+		return a_comp.p == b_comp.p
+				&& a_comp.q == b_comp.q
+				&& a_comp.oper.pt_qt == b_comp.oper.pt_qt
+				&& a_comp.oper.pt_qf == b_comp.oper.pt_qf
+				&& a_comp.oper.pf_qt == b_comp.oper.pf_qt
+				&& a_comp.oper.pf_qf == b_comp.oper.pf_qf;
+	}
+	case FF_CHAR_REQUIREMENT:
+		return a->value.char_requirement.c
+				== b->value.char_requirement.c;
+	case FF_CONSTANT:
+		return a->value.constant.value == b->value.constant.value;
+	case FF_LANG_REQUIREMENT: {
+		FfLangRequirement a_req = a->value.lang_requirement;
+		FfLangRequirement b_req = b->value.lang_requirement;
+		if (a_req.all != b_req.all || a_req.nlangs != b_req.nlangs) {
+			return false;
+		}
+		for (size_t i = 0; i < a_req.nlangs; ++i) {
+			if (strcmp((const char *)a_req.langs[i],
+						(const char *)b_req.langs[i])
+					!= 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+	case FF_INTERVAL: {
+		FfInterval a_int = a->value.interval;
+		FfInterval b_int = b->value.interval;
+		return a_int.from == b_int.from
+				&& a_int.to == b_int.to
+				&& a_int.from_inclusive == b_int.from_inclusive
+				&& a_int.to_inclusive == b_int.to_inclusive
+				&& strcmp(a_int.object, b_int.object) == 0;
+	}
+	case FF_FUZZY_MATCH: {
+		FfFuzzyMatch a_fuz = a->value.fuzzy_match;
+		FfFuzzyMatch b_fuz = b->value.fuzzy_match;
+		return a_fuz.max_distance == b_fuz.max_distance
+				&& a_fuz.len == b_fuz.len
+				&& memcmp(a_fuz.chars, b_fuz.chars,
+					a_fuz.len * sizeof(*a_fuz.chars)) == 0
+				&& strcmp(a_fuz.object, b_fuz.object) == 0;
+	}
+	default:
+		return false;
+	}
+}
+
+// Unlike `FcValueEqual()`, doesn't promote types or ignore case
+bool values_identical(FcValue a, FcValue b)
+{
+	if (a.type != b.type) {
+		return false;
+	}
+
+	switch (a.type) {
+	case FcTypeInteger:
+		return a.u.i == b.u.i;
+	case FcTypeDouble:
+		return a.u.d == b.u.d;
+	case FcTypeString:
+		return strcmp((const char *)a.u.s, (const char *)b.u.s) == 0;
+	case FcTypeBool:
+		return a.u.b == b.u.b;
+	case FcTypeMatrix:
+		return FcMatrixEqual(a.u.m, b.u.m);
+	case FcTypeCharSet:
+		return FcCharSetEqual(a.u.c, b.u.c);
+	case FcTypeLangSet:
+		return FcLangSetEqual(a.u.l, b.u.l);
+	case FcTypeRange:
+		return a.u.r == b.u.r;
+	case FcTypeFTFace:
+		return a.u.f == b.u.f;
+	default:
+		return true;
+	}
+}
+
+// Consistent with `conditions_equal()`
+uint64_t hash_condition(FfCondition *condition)
+{
+	uint64_t hash = 0xcbf29ce484222325u ^ condition->type;
+
+	switch (condition->type) {
+	case FF_COMPARISON: {
+		FfComparison comparison = condition->value.comparison;
+		hash ^= hash_string((const FcChar8 *)comparison.object);
+		hash = (hash ^ comparison.oper) * 0x100000001b3u;
+		hash = (hash ^ comparison.quantifier) * 0x100000001b3u;
+		hash ^= hash_value(comparison.value);
+		break;
+	}
+	case FF_COMPOSITION: {
+		FfLogicalComposition composition = condition->value.composition;
+		hash = (hash ^ (uintptr_t)composition.p) * 0x100000001b3u;
+		hash = (hash ^ (uintptr_t)composition.q) * 0x100000001b3u;
+		hash = (hash ^ composition.oper.pt_qt) * 0x100000001b3u;
+		hash = (hash ^ composition.oper.pt_qf) * 0x100000001b3u;
+		hash = (hash ^ composition.oper.pf_qt) * 0x100000001b3u;
+		hash = (hash ^ composition.oper.pf_qf) * 0x100000001b3u;
+		break;
+	}
+	case FF_CHAR_REQUIREMENT:
+		hash ^= condition->value.char_requirement.c;
+		break;
+	case FF_CONSTANT:
+		hash ^= condition->value.constant.value;
+		break;
+	case FF_LANG_REQUIREMENT: {
+		FfLangRequirement lang_requirement =
+				condition->value.lang_requirement;
+		hash ^= lang_requirement.all;
+		for (size_t i = 0; i < lang_requirement.nlangs; ++i) {
+			hash = (hash ^ hash_string(lang_requirement.langs[i]))
+					* 0x100000001b3u;
+		}
+		break;
+	}
+	case FF_INTERVAL: {
+		FfInterval interval = condition->value.interval;
+		hash ^= hash_string((const FcChar8 *)interval.object);
+		hash = (hash ^ hash_double(interval.from)) * 0x100000001b3u;
+		hash = (hash ^ hash_double(interval.to)) * 0x100000001b3u;
+		hash = (hash ^ interval.from_inclusive) * 0x100000001b3u;
+		hash = (hash ^ interval.to_inclusive) * 0x100000001b3u;
+		break;
+	}
+	case FF_FUZZY_MATCH: {
+		FfFuzzyMatch fuzzy_match = condition->value.fuzzy_match;
+		hash ^= hash_string((const FcChar8 *)fuzzy_match.object);
+		hash = (hash ^ fuzzy_match.max_distance) * 0x100000001b3u;
+		for (size_t i = 0; i < fuzzy_match.len; ++i) {
+			hash = (hash ^ fuzzy_match.chars[i]) * 0x100000001b3u;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	return hash * 0x100000001b3u;
+}
+
+// Consistent with `values_identical()`
+uint64_t hash_value(FcValue value)
+{
+	uint64_t hash = 0xcbf29ce484222325u ^ (uint64_t)value.type;
+
+	switch (value.type) {
+	case FcTypeInteger:
+		hash ^= (uint64_t)value.u.i;
+		break;
+	case FcTypeDouble:
+		hash ^= hash_double(value.u.d);
+		break;
+	case FcTypeString:
+		hash ^= hash_string(value.u.s);
+		break;
+	case FcTypeBool:
+		hash ^= (uint64_t)value.u.b;
+		break;
+	case FcTypeMatrix:
+		hash = (hash ^ hash_double(value.u.m->xx)) * 0x100000001b3u;
+		hash = (hash ^ hash_double(value.u.m->xy)) * 0x100000001b3u;
+		hash = (hash ^ hash_double(value.u.m->yx)) * 0x100000001b3u;
+		hash ^= hash_double(value.u.m->yy);
+		break;
+	case FcTypeCharSet:
+		hash ^= FcCharSetCount(value.u.c);
+		break;
+	case FcTypeLangSet:
+		hash ^= FcLangSetHash(value.u.l);
+		break;
+	case FcTypeRange:
+		hash ^= (uintptr_t)value.u.r;
+		break;
+	case FcTypeFTFace:
+		hash ^= (uintptr_t)value.u.f;
+		break;
+	default:
+		break;
+	}
+
+	return hash * 0x100000001b3u;
+}
+
+// Equal doubles (i.e. 0.0 and -0.0 too) hash the same
+uint64_t hash_double(double d)
+{
+	if (d == 0) {
+		return 0;
+	}
+
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+
+	return bits;
+}
+
+bool init_grouper(Grouper *grouper, const char *const *objects,
+		size_t nobjects, const FfList *best)
+{
+	*grouper = (Grouper){
+		.objects = objects,
+		.nobjects = nobjects,
+		.best = best,
+		.interner = (Interner){ .strings = NULL, .slots = NULL },
+		.keys = NULL,
+		.passed = NULL,
+		.slots = NULL,
+		.font_key = NULL
+	};
+
+	grouper->groups = tyrant_alloc(sizeof(*grouper->groups));
+	if (grouper->groups == NULL) {
+		goto err_exit;
+	}
+	*grouper->groups = (FfGroupSet){
+		.groups = NULL,
+		.ngroups = 0,
+		.nobjects = nobjects
+	};
+
+	grouper->font_key = TYRANT_ALLOC_ARR(grouper->font_key,
+			nobjects == 0 ? 1 : nobjects);
+	if (grouper->font_key == NULL) {
+		goto err_destroy_grouper;
+	}
+
+	return true;
+
+err_destroy_grouper:
+	destroy_grouper(grouper);
+err_exit:
+	return false;
+}
+
+void destroy_grouper(Grouper *grouper)
+{
+	ff_group_set_destroy(grouper->groups);
+	destroy_interner(grouper->interner);
+	tyrant_free(grouper->keys);
+	tyrant_free(grouper->passed);
+	tyrant_free(grouper->slots);
+	tyrant_free(grouper->font_key);
+}
+
+bool add_to_group(Grouper *grouper, FcPattern *font)
+{
+	size_t nobjects = grouper->nobjects;
+	uint32_t *font_key = grouper->font_key;
+
+	for (size_t i = 0; i < nobjects; ++i) {
+		FcChar8 *string;
+		FcResult result = FcPatternGetString(font, grouper->objects[i],
+				0, &string);
+		if (result != FcResultMatch) {
+			font_key[i] = 0;
+		} else if (!intern_string(&grouper->interner, string,
+					&font_key[i])) {
+			return false;
+		}
+	}
+
+	size_t group = SIZE_MAX;
+	size_t slot = 0;
+	if (grouper->nslots > 0) {
+		size_t mask = grouper->nslots - 1;
+		slot = hash_ids(font_key, nobjects) & mask;
+		while (grouper->slots[slot] != 0) {
+			size_t candidate = grouper->slots[slot] - 1;
+			const uint32_t *key =
+					&grouper->keys[candidate * nobjects];
+			if (memcmp(key, font_key, nobjects * sizeof(*key))
+					== 0) {
+				group = candidate;
+				break;
+			}
+
+			slot = (slot + 1) & mask;
+		}
+	}
+
+	bool is_new = group == SIZE_MAX;
+	if (is_new && !create_group(grouper, &group)) {
+		return false;
+	}
+
+	FcFontSet *fonts = grouper->groups->groups[group].fonts;
+
+	FcPatternReference(font);
+	if (!FcFontSetAdd(fonts, font)) {
+		FcPatternDestroy(font);
+		return false;
+	}
+
+	update_best(grouper, group, font, is_new);
+
+	return true;
+}
+
+// Creates a group keyed by `grouper->font_key`
+bool create_group(Grouper *grouper, size_t *ret_group)
+{
+	FfGroupSet *groups = grouper->groups;
+	size_t nobjects = grouper->nobjects;
+	size_t nbest = grouper->best != NULL ? grouper->best->len : 0;
+
+	if (groups->ngroups == grouper->cap) {
+		size_t cap = grouper->cap == 0 ? 16 : grouper->cap * 2;
+
+		bool success;
+		groups->groups = TYRANT_REALLOC_ARR(groups->groups, cap,
+				&success);
+		if (!success) {
+			return false;
+		}
+
+		grouper->keys = TYRANT_REALLOC_ARR(grouper->keys,
+				cap * (nobjects == 0 ? 1 : nobjects), &success);
+		if (!success) {
+			return false;
+		}
+
+		grouper->passed = TYRANT_REALLOC_ARR(grouper->passed,
+				cap * (nbest == 0 ? 1 : nbest), &success);
+		if (!success) {
+			return false;
+		}
+
+		grouper->cap = cap;
+	}
+
+	if ((groups->ngroups + 1) * 2 > grouper->nslots
+			&& !rehash_groups(grouper)) {
+		return false;
+	}
+
+	FcChar8 **key = TYRANT_ALLOC_ARR(key, nobjects == 0 ? 1 : nobjects);
+	if (key == NULL) {
+		goto err_exit;
+	}
+
+	FcFontSet *fonts = FcFontSetCreate();
+	if (fonts == NULL) {
+		goto err_free_key;
+	}
+
+	size_t nkey = 0;
+	for (; nkey < nobjects; ++nkey) {
+		uint32_t id = grouper->font_key[nkey];
+		if (id == 0) {
+			key[nkey] = NULL;
+			continue;
+		}
+
+		key[nkey] = FcStrCopy(grouper->interner.strings[id - 1]);
+		if (key[nkey] == NULL) {
+			goto err_free_key_strings;
+		}
+	}
+
+	size_t group = groups->ngroups++;
+	groups->groups[group] = (FfGroup){
+		.key = key,
+		.fonts = fonts,
+		.best = NULL
+	};
+
+	memcpy(&grouper->keys[group * nobjects], grouper->font_key,
+			nobjects * sizeof(*grouper->keys));
+
+	size_t mask = grouper->nslots - 1;
+	size_t slot = hash_ids(grouper->font_key, nobjects) & mask;
+	while (grouper->slots[slot] != 0) {
+		slot = (slot + 1) & mask;
+	}
+	grouper->slots[slot] = group + 1;
+
+	*ret_group = group;
+	return true;
+
+err_free_key_strings:
+	for (size_t i = 0; i < nkey; ++i) {
+		FcStrFree(key[i]);
+	}
+	FcFontSetDestroy(fonts);
+err_free_key:
+	tyrant_free(key);
+err_exit:
+	return false;
+}
+
+bool rehash_groups(Grouper *grouper)
+{
+	size_t nslots = grouper->nslots == 0 ? 32 : grouper->nslots * 2;
+	size_t *slots = TYRANT_ALLOC_ARR(slots, nslots);
+	if (slots == NULL) {
+		return false;
+	}
+	memset(slots, 0, nslots * sizeof(*slots));
+
+	size_t nobjects = grouper->nobjects;
+	size_t mask = nslots - 1;
+	for (size_t i = 0; i < grouper->groups->ngroups; ++i) {
+		size_t slot = hash_ids(&grouper->keys[i * nobjects], nobjects)
+				& mask;
+		while (slots[slot] != 0) {
+			slot = (slot + 1) & mask;
+		}
+		slots[slot] = i + 1;
+	}
+
+	tyrant_free(grouper->slots);
+	grouper->slots = slots;
+	grouper->nslots = nslots;
+
+	return true;
+}
+
+// Keeps the first font with the lexicographically greatest results for the
+// `best` list, which is the font `ff_list_filter_soft()` would put first
+void update_best(Grouper *grouper, size_t group, FcPattern *font, bool is_new)
+{
+	const FfList *best = grouper->best;
+	if (best == NULL) {
+		return;
+	}
+
+	FfGroup *g = &grouper->groups->groups[group];
+	size_t stride = best->len == 0 ? 1 : best->len;
+	bool *passed = &grouper->passed[group * stride];
+
+	size_t i = 0;
+	if (!is_new) {
+		bool better = false;
+		for (; i < best->len && !better; ++i) {
+			bool font_passed = test_condition(best->conditions[i],
+					font, NULL);
+			if (font_passed == passed[i]) {
+				continue;
+			}
+
+			if (!font_passed) {
+				return;
+			}
+
+			passed[i] = true;
+			better = true;
+		}
+
+		if (!better) {
+			return;
+		}
+	}
+
+	for (; i < best->len; ++i) {
+		passed[i] = test_condition(best->conditions[i], font, NULL);
+	}
+
+	g->best = font;
+}
+
+bool intern_string(Interner *interner, const FcChar8 *string,
+		uint32_t *ret_id)
+{
+	uint64_t hash = hash_string(string);
+
+	if (interner->nslots > 0) {
+		size_t mask = interner->nslots - 1;
+		size_t slot = hash & mask;
+		while (interner->slots[slot] != 0) {
+			uint32_t id = interner->slots[slot];
+			if (strcmp((const char *)interner->strings[id - 1],
+						(const char *)string) == 0) {
+				*ret_id = id;
+				return true;
+			}
+
+			slot = (slot + 1) & mask;
+		}
+	}
+
+	if (interner->len == UINT32_MAX - 1) {
+		return false;
+	}
+
+	if (interner->len == interner->cap) {
+		size_t cap = interner->cap == 0 ? 16 : interner->cap * 2;
+
+		bool success;
+		interner->strings = TYRANT_REALLOC_ARR(interner->strings, cap,
+				&success);
+		if (!success) {
+			return false;
+		}
+
+		interner->cap = cap;
+	}
+
+	if ((interner->len + 1) * 2 > interner->nslots) {
+		size_t nslots = interner->nslots == 0 ? 32
+				: interner->nslots * 2;
+		uint32_t *slots = TYRANT_ALLOC_ARR(slots, nslots);
+		if (slots == NULL) {
+			return false;
+		}
+		memset(slots, 0, nslots * sizeof(*slots));
+
+		size_t mask = nslots - 1;
+		for (size_t i = 0; i < interner->len; ++i) {
+			size_t slot = hash_string(interner->strings[i]) & mask;
+			while (slots[slot] != 0) {
+				slot = (slot + 1) & mask;
+			}
+			slots[slot] = i + 1;
+		}
+
+		tyrant_free(interner->slots);
+		interner->slots = slots;
+		interner->nslots = nslots;
+	}
+
+	uint32_t id = ++interner->len;
+	interner->strings[id - 1] = string;
+
+	size_t mask = interner->nslots - 1;
+	size_t slot = hash & mask;
+	while (interner->slots[slot] != 0) {
+		slot = (slot + 1) & mask;
+	}
+	interner->slots[slot] = id;
+
+	*ret_id = id;
+	return true;
+}
+
+void destroy_interner(Interner interner)
+{
+	tyrant_free(interner.strings);
+	tyrant_free(interner.slots);
+}
+
+// Sets `*ret_added` to false if a font with the same key was added before.
+// The key borrows the font's file name, so the font must outlive `keys`.
+bool add_font_key(FontKeys *keys, FcPattern *font, bool *ret_added)
+{
+	FontKey key = { .file = NULL, .index = 0 };
+	if (FcPatternGetString(font, FC_FILE, 0, (FcChar8 **)&key.file)
+			!= FcResultMatch) {
+		*ret_added = true;
+		return true;
+	}
+	if (FcPatternGetInteger(font, FC_INDEX, 0, &key.index)
+			!= FcResultMatch) {
+		key.index = 0;
+	}
+
+	if ((keys->len + 1) * 2 > keys->nslots && !rehash_font_keys(keys)) {
+		return false;
+	}
+
+	size_t mask = keys->nslots - 1;
+	size_t slot = hash_font_key(key) & mask;
+	while (keys->slots[slot].file != NULL) {
+		FontKey other = keys->slots[slot];
+		if (other.index == key.index
+				&& strcmp((const char *)other.file,
+					(const char *)key.file) == 0) {
+			*ret_added = false;
+			return true;
+		}
+
+		slot = (slot + 1) & mask;
+	}
+
+	keys->slots[slot] = key;
+	++keys->len;
+
+	*ret_added = true;
+	return true;
+}
+
+bool rehash_font_keys(FontKeys *keys)
+{
+	size_t nslots = keys->nslots == 0 ? 64 : keys->nslots * 2;
+	FontKey *slots = TYRANT_ALLOC_ARR(slots, nslots);
+	if (slots == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i < nslots; ++i) {
+		slots[i].file = NULL;
+	}
+
+	size_t mask = nslots - 1;
+	for (size_t i = 0; i < keys->nslots; ++i) {
+		FontKey key = keys->slots[i];
+		if (key.file == NULL) {
+			continue;
+		}
+
+		size_t slot = hash_font_key(key) & mask;
+		while (slots[slot].file != NULL) {
+			slot = (slot + 1) & mask;
+		}
+		slots[slot] = key;
+	}
+
+	tyrant_free(keys->slots);
+	keys->slots = slots;
+	keys->nslots = nslots;
+
+	return true;
+}
+
+uint64_t hash_font_key(FontKey key)
+{
+	return hash_string(key.file)
+			^ (uint64_t)(unsigned)key.index * 0x9e3779b97f4a7c15u;
+}
+
+// FNV-1a
+uint64_t hash_string(const FcChar8 *string)
+{
+	uint64_t hash = 0xcbf29ce484222325u;
+	for (; *string != '\0'; ++string) {
+		hash ^= *string;
+		hash *= 0x100000001b3u;
+	}
+
+	return hash;
+}
+
+uint64_t hash_ids(const uint32_t *ids, size_t nids)
+{
+	uint64_t hash = 0xcbf29ce484222325u;
+	for (size_t i = 0; i < nids; ++i) {
+		hash ^= ids[i];
+		hash *= 0x100000001b3u;
+	}
+
+	return hash;
+}
+
+bool init_cover(Cover *cover, const FcChar32 *text, size_t len,
+		size_t nconditions)
+{
+	FcChar32 *chars = TYRANT_ALLOC_ARR(chars, len == 0 ? 1 : len);
+	if (chars == NULL) {
+		goto err_exit;
+	}
+
+	memcpy(chars, text, len * sizeof(*chars));
+	qsort(chars, len, sizeof(*chars), compare_chars);
+
+	size_t nchars = 0;
+	for (size_t i = 0; i < len; ++i) {
+		if (nchars == 0 || chars[i] != chars[nchars - 1]) {
+			chars[nchars++] = chars[i];
+		}
+	}
+
+	size_t nwords = (nchars + 63) / 64;
+	uint64_t *uncovered = TYRANT_ALLOC_ARR(uncovered,
+			nwords == 0 ? 1 : nwords);
+	if (uncovered == NULL) {
+		goto err_free_chars;
+	}
+
+	for (size_t i = 0; i < nwords; ++i) {
+		uncovered[i] = ~(uint64_t)0;
+	}
+
+	*cover = (Cover){
+		.chars = chars,
+		.nchars = nchars,
+		.nwords = nwords,
+		.uncovered = uncovered,
+		.nconditions = nconditions,
+		.positions = NULL,
+		.covered = NULL,
+		.passed = NULL,
+		.gains = NULL,
+		.ncandidates = 0,
+		.cap = 0,
+		.heap = NULL,
+		.nheap = 0
+	};
+	return true;
+
+err_free_chars:
+	tyrant_free(chars);
+err_exit:
+	return false;
+}
+
+void destroy_cover(Cover *cover)
+{
+	tyrant_free(cover->chars);
+	tyrant_free(cover->uncovered);
+	tyrant_free(cover->positions);
+	tyrant_free(cover->covered);
+	tyrant_free(cover->passed);
+	tyrant_free(cover->gains);
+	tyrant_free(cover->heap);
+}
+
+bool add_cover_candidate(Cover *cover, FfList list, FcPattern *font,
+		size_t pos)
+{
+	FcCharSet *charset;
+	FcResult result = FcPatternGetCharSet(font, FC_CHARSET, 0, &charset);
+	if (result != FcResultMatch) {
+		return true;
+	}
+
+	if (cover->ncandidates == cover->cap) {
+		size_t cap = cover->cap == 0 ? 16 : cover->cap * 2;
+
+		bool success;
+		cover->positions = TYRANT_REALLOC_ARR(cover->positions, cap,
+				&success);
+		if (!success) {
+			return false;
+		}
+		// Rows may be empty, but the arrays shouldn't be
+		size_t nwords = cover->nwords == 0 ? 1 : cover->nwords;
+		cover->covered = TYRANT_REALLOC_ARR(cover->covered,
+				cap * nwords, &success);
+		if (!success) {
+			return false;
+		}
+		size_t nconditions = cover->nconditions == 0 ? 1
+				: cover->nconditions;
+		cover->passed = TYRANT_REALLOC_ARR(cover->passed,
+				cap * nconditions, &success);
+		if (!success) {
+			return false;
+		}
+		cover->gains = TYRANT_REALLOC_ARR(cover->gains, cap,
+				&success);
+		if (!success) {
+			return false;
+		}
+
+		cover->cap = cap;
+	}
+
+	size_t c = cover->ncandidates;
+	uint64_t *covered = &cover->covered[c * cover->nwords];
+
+	for (size_t i = 0; i < cover->nwords; ++i) {
+		covered[i] = 0;
+	}
+
+	// Walks the charset's pages alongside the (sorted) code points, rather
+	// than looking each one up
+	FcChar32 map[FC_CHARSET_MAP_SIZE];
+	FcChar32 next;
+	FcChar32 page = FcCharSetFirstPage(charset, map, &next);
+
+	size_t gain = 0;
+	for (size_t i = 0; i < cover->nchars && page != FC_CHARSET_DONE;) {
+		FcChar32 ch = cover->chars[i];
+		if (ch >= page + 256) {
+			page = FcCharSetNextPage(charset, map, &next);
+			continue;
+		}
+
+		if (ch >= page && map[(ch - page) / 32] >> ch % 32 & 1) {
+			covered[i / 64] |= (uint64_t)1 << i % 64;
+			++gain;
+		}
+		++i;
+	}
+
+	if (gain == 0) {
+		return true;
+	}
+
+	bool *passed = &cover->passed[c * cover->nconditions];
+	for (size_t i = 0; i < cover->nconditions; ++i) {
+		passed[i] = test_condition(list.conditions[i], font, NULL);
+	}
+
+	cover->positions[c] = pos;
+	cover->gains[c] = gain;
+	++cover->ncandidates;
+
+	return true;
+}
+
+// Fills the heap with the candidates, keeping only the most preferred of those
+// which cover the same code points
+bool build_cover_heap(Cover *cover)
+{
+	size_t n = cover->ncandidates;
+
+	size_t nslots = 32;
+	while (nslots < n * 2) {
+		nslots *= 2;
+	}
+
+	size_t *slots = TYRANT_ALLOC_ARR(slots, nslots);
+	if (slots == NULL) {
+		goto err_exit;
+	}
+
+	cover->heap = TYRANT_ALLOC_ARR(cover->heap, n == 0 ? 1 : n);
+	if (cover->heap == NULL) {
+		goto err_free_slots;
+	}
+
+	for (size_t i = 0; i < nslots; ++i) {
+		slots[i] = SIZE_MAX;
+	}
+
+	size_t nwords = cover->nwords;
+	size_t mask = nslots - 1;
+	for (size_t c = 0; c < n; ++c) {
+		const uint64_t *covered = &cover->covered[c * nwords];
+
+		size_t slot = hash_words(covered, nwords) & mask;
+		for (; slots[slot] != SIZE_MAX; slot = (slot + 1) & mask) {
+			const uint64_t *other =
+					&cover->covered[slots[slot] * nwords];
+			if (memcmp(covered, other,
+						nwords * sizeof(*covered))
+					== 0) {
+				break;
+			}
+		}
+
+		// Candidates come in set order, so the earlier font is kept
+		// between equally preferred ones
+		if (slots[slot] == SIZE_MAX
+				|| cover_is_preferred(cover, c, slots[slot])) {
+			slots[slot] = c;
+		}
+	}
+
+	cover->nheap = 0;
+	for (size_t i = 0; i < nslots; ++i) {
+		if (slots[i] != SIZE_MAX) {
+			cover->heap[cover->nheap++] = slots[i];
+		}
+	}
+
+	for (size_t i = cover->nheap / 2; i > 0; --i) {
+		cover_sift_down(cover, i - 1);
+	}
+
+	tyrant_free(slots);
+	return true;
+
+err_free_slots:
+	tyrant_free(slots);
+err_exit:
+	return false;
+}
+
+// Whether candidate `a` should be chosen before candidate `b`
+bool cover_is_better(const Cover *cover, size_t a, size_t b)
+{
+	if (cover->gains[a] != cover->gains[b]) {
+		return cover->gains[a] > cover->gains[b];
+	}
+
+	if (cover_is_preferred(cover, a, b)) {
+		return true;
+	}
+	if (cover_is_preferred(cover, b, a)) {
+		return false;
+	}
+
+	return cover->positions[a] < cover->positions[b];
+}
+
+// Whether the list prefers candidate `a` over candidate `b`, as soft filtering
+// would
+bool cover_is_preferred(const Cover *cover, size_t a, size_t b)
+{
+	const bool *a_passed = &cover->passed[a * cover->nconditions];
+	const bool *b_passed = &cover->passed[b * cover->nconditions];
+
+	for (size_t i = 0; i < cover->nconditions; ++i) {
+		if (a_passed[i] != b_passed[i]) {
+			return a_passed[i];
+		}
+	}
+
+	return false;
+}
+
+void cover_sift_down(Cover *cover, size_t i)
+{
+	size_t *heap = cover->heap;
+	size_t len = cover->nheap;
+
+	for (;;) {
+		size_t best = i;
+		size_t left = 2 * i + 1;
+		size_t right = 2 * i + 2;
+
+		if (left < len && cover_is_better(cover, heap[left],
+					heap[best])) {
+			best = left;
+		}
+		if (right < len && cover_is_better(cover, heap[right],
+					heap[best])) {
+			best = right;
+		}
+
+		if (best == i) {
+			return;
+		}
+
+		size_t swp = heap[i];
+		heap[i] = heap[best];
+		heap[best] = swp;
+
+		i = best;
+	}
+}
+
+// Number of code points a candidate covers which aren't covered yet
+size_t count_gain(const Cover *cover, size_t candidate)
+{
+	const uint64_t *covered = &cover->covered[candidate * cover->nwords];
+
+	size_t gain = 0;
+	for (size_t i = 0; i < cover->nwords; ++i) {
+		uint64_t word = covered[i] & cover->uncovered[i];
+		for (; word != 0; word &= word - 1) {
+			++gain;
+		}
+	}
+
+	return gain;
+}
+
+uint64_t hash_words(const uint64_t *words, size_t nwords)
+{
+	uint64_t hash = 0xcbf29ce484222325u;
+	for (size_t i = 0; i < nwords; ++i) {
+		hash ^= words[i];
+		hash *= 0x100000001b3u;
+	}
+
+	return hash;
+}
+
+int compare_chars(const void *a, const void *b)
+{
+	FcChar32 x = *(const FcChar32 *)a;
+	FcChar32 y = *(const FcChar32 *)b;
+
+	return (x > y) - (x < y);
+}
+
+bool ranked_is_worse(Ranked a, Ranked b)
+{
+	return a.score < b.score || (a.score == b.score && a.pos > b.pos);
+}
+
+void sift_down(Ranked *heap, size_t len, size_t i)
+{
+	for (;;) {
+		size_t worst = i;
+		size_t left = 2 * i + 1;
+		size_t right = 2 * i + 2;
+
+		if (left < len && ranked_is_worse(heap[left], heap[worst])) {
+			worst = left;
+		}
+		if (right < len && ranked_is_worse(heap[right], heap[worst])) {
+			worst = right;
+		}
+
+		if (worst == i) {
+			return;
+		}
+
+		Ranked swp = heap[i];
+		heap[i] = heap[worst];
+		heap[worst] = swp;
+
+		i = worst;
+	}
+}
+
+void sift_up(Ranked *heap, size_t i)
+{
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!ranked_is_worse(heap[i], heap[parent])) {
+			return;
+		}
+
+		Ranked swp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = swp;
+
+		i = parent;
+	}
+}
+
+// Best first
+int compare_ranked(const void *a, const void *b)
+{
+	Ranked a_ranked = *(const Ranked *)a;
+	Ranked b_ranked = *(const Ranked *)b;
+
+	if (ranked_is_worse(b_ranked, a_ranked)) {
+		return -1;
+	}
+	if (ranked_is_worse(a_ranked, b_ranked)) {
+		return 1;
+	}
+	return 0;
+}
+
+void start_workers(void)
+{
+	long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nworkers = nprocs < 1 ? 1 : (size_t)nprocs;
+	nworkers = MIN(nworkers, MAX_WORKERS);
+
+	pthread_attr_t attr;
+	if (pthread_attr_init(&attr) != 0) {
+		return;
+	}
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (size_t i = 0; i < nworkers; ++i) {
+		pthread_t thread;
+		if (pthread_create(&thread, &attr, run_worker, NULL) == 0) {
+			++pool.nworkers;
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+void *run_worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&pool.mutex);
+
+	for (;;) {
+		while (pool.head == NULL) {
+			pthread_cond_wait(&pool.work, &pool.mutex);
+		}
+
+		FfFilterTicket *ticket = pool.head;
+		pool.head = ticket->next_run;
+		if (pool.head == NULL) {
+			pool.tail = NULL;
+		}
+		ticket->in_run_queue = false;
+		ticket->next_run = NULL;
+
+		bool cancelled = ticket->cancelled;
+
+		pthread_mutex_unlock(&pool.mutex);
+
+		bool done = false;
+		bool failed = false;
+		if (!cancelled) {
+			failed = !step_ticket(ticket, FILTER_SLICE_LEN, &done);
+		}
+		FcFontSet *result = NULL;
+		if (done) {
+			result = finish_ticket(ticket);
+			failed = result == NULL;
+		}
+
+		pthread_mutex_lock(&pool.mutex);
+
+		// Take turns with the other queued tickets
+		if (!cancelled && !failed && !done && !ticket->cancelled) {
+			push_run_queue(ticket);
+			continue;
+		}
+
+		if (failed) {
+			ticket->status = FF_FILTER_FAILED;
+		} else if (done) {
+			// Published under the lock, like the status, since
+			// `ff_filter_take_result()` may be reading it
+			ticket->status = FF_FILTER_DONE;
+			ticket->result = result;
+		} else {
+			ticket->status = FF_FILTER_CANCELLED;
+		}
+
+		if (ticket->status != FF_FILTER_DONE) {
+			discard_progress(ticket);
+		}
+
+		pthread_mutex_unlock(&pool.mutex);
+
+		deliver_ticket(ticket);
+
+		pthread_mutex_lock(&pool.mutex);
+		unref_ticket(ticket);
+	}
+
+	return NULL;
+}
+
+// Tests up to `budget` fonts
+bool step_ticket(FfFilterTicket *ticket, size_t budget, bool *ret_done)
+{
+	if (ticket->kind == FF_FILTER_LIST_SOFT) {
+		return step_soft_ticket(ticket, budget, ret_done);
+	}
+
+	FcFontSet *set = ticket->set;
+	for (; ticket->pos < set->nfont && budget > 0; ++ticket->pos) {
+		FcPattern *font = set->fonts[ticket->pos];
+		--budget;
+
+		bool passed;
+		if (ticket->kind == FF_FILTER_CONDITION) {
+			passed = test_condition(ticket->condition, font, NULL);
+		} else {
+			passed = test_list(ticket->list, font, NULL);
+		}
+
+		if (passed) {
+			FcPatternReference(font);
+			bool success = FcFontSetAdd(ticket->filtered, font);
+			if (!success) {
+				FcPatternDestroy(font);
+				return false;
+			}
+		}
+	}
+
+	*ret_done = ticket->pos == set->nfont;
+	return true;
+}
+
+// Same as `ff_list_filter_soft()`, but stops after `budget` fonts and resumes
+// from there on the next step
+bool step_soft_ticket(FfFilterTicket *ticket, size_t budget, bool *ret_done)
+{
+	FfList list = ticket->list;
+
+	for (;;) {
+		FcFontSet *candidates = ticket->candidates != NULL
+				? ticket->candidates : ticket->set;
+
+		if (ticket->ncondition == list.len || candidates->nfont <= 1) {
+			*ret_done = true;
+			return true;
+		}
+
+		if (budget == 0) {
+			*ret_done = false;
+			return true;
+		}
+
+		FfCondition *condition = list.conditions[ticket->ncondition];
+		for (; ticket->pos < candidates->nfont && budget > 0;
+				++ticket->pos) {
+			FcPattern *font = candidates->fonts[ticket->pos];
+			--budget;
+
+			if (test_condition(condition, font, NULL)) {
+				FcPatternReference(font);
+				bool success = FcFontSetAdd(ticket->filtered,
+						font);
+				if (!success) {
+					FcPatternDestroy(font);
+					return false;
+				}
+			}
+		}
+
+		if (ticket->pos < candidates->nfont) {
+			*ret_done = false;
+			return true;
+		}
+
+		if (ticket->filtered->nfont > 0) {
+			FcFontSet *filtered = FcFontSetCreate();
+			if (filtered == NULL) {
+				return false;
+			}
+
+			if (ticket->candidates != NULL) {
+				FcFontSetDestroy(ticket->candidates);
+			}
+			ticket->candidates = ticket->filtered;
+			ticket->filtered = filtered;
+		}
+
+		++ticket->ncondition;
+		ticket->pos = 0;
+	}
+}
+
+// Returns the ticket's result, which the caller publishes, or NULL on failure
+FcFontSet *finish_ticket(FfFilterTicket *ticket)
+{
+	FcFontSet *result;
+	if (ticket->kind != FF_FILTER_LIST_SOFT) {
+		result = ticket->filtered;
+		ticket->filtered = NULL;
+		return result;
+	}
+
+	if (ticket->candidates != NULL) {
+		result = ticket->candidates;
+		ticket->candidates = NULL;
+	} else {
+		result = copy_font_set(ticket->set);
+	}
+
+	FcFontSetDestroy(ticket->filtered);
+	ticket->filtered = NULL;
+
+	return result;
+}
+
+void discard_progress(FfFilterTicket *ticket)
+{
+	if (ticket->filtered != NULL) {
+		FcFontSetDestroy(ticket->filtered);
+		ticket->filtered = NULL;
+	}
+
+	if (ticket->candidates != NULL) {
+		FcFontSetDestroy(ticket->candidates);
+		ticket->candidates = NULL;
+	}
+
+	if (ticket->result != NULL) {
+		FcFontSetDestroy(ticket->result);
+		ticket->result = NULL;
+	}
+}
+
+void deliver_ticket(FfFilterTicket *ticket)
+{
+	if (ticket->callback != NULL) {
+		ticket->callback(ticket, ticket->data);
+	}
+
+	pthread_mutex_lock(&pool.mutex);
+
+	FfCompletionQueue *queue = ticket->queue;
+	if (queue != NULL) {
+		if (queue->tail != NULL) {
+			queue->tail->next_completed = ticket;
+		} else {
+			queue->head = ticket;
+		}
+		queue->tail = ticket;
+
+		ticket->in_completion_queue = true;
+		++ticket->nrefs;
+
+		uint64_t one = 1;
+		ssize_t nwritten = write(queue->fd, &one, sizeof(one));
+		(void)nwritten;
+
+		--queue->nundelivered;
+	}
+
+	// Only now may the ticket be released, or its queue destroyed
+	ticket->delivered = true;
+	pthread_cond_broadcast(&pool.finished);
+
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+// Must be called with `pool.mutex` locked
+void push_run_queue(FfFilterTicket *ticket)
+{
+	ticket->next_run = NULL;
+	ticket->in_run_queue = true;
+
+	if (pool.tail != NULL) {
+		pool.tail->next_run = ticket;
+	} else {
+		pool.head = ticket;
+	}
+	pool.tail = ticket;
+
+	pthread_cond_signal(&pool.work);
+}
+
+// Removes `ticket` from its completion queue, if it's in it. Must be called
+// with `pool.mutex` locked
+void unlink_completed(FfFilterTicket *ticket)
+{
+	if (!ticket->in_completion_queue) {
+		return;
+	}
+
+	FfCompletionQueue *queue = ticket->queue;
+
+	FfFilterTicket *prev = NULL;
+	FfFilterTicket *cur = queue->head;
+	while (cur != ticket) {
+		prev = cur;
+		cur = cur->next_completed;
+	}
+
+	if (prev != NULL) {
+		prev->next_completed = ticket->next_completed;
+	} else {
+		queue->head = ticket->next_completed;
+	}
+	if (queue->tail == ticket) {
+		queue->tail = prev;
+	}
+
+	ticket->next_completed = NULL;
+	ticket->in_completion_queue = false;
+
+	// Keep the descriptor readable only while there are tickets to pop
+	if (queue->head == NULL) {
+		uint64_t count;
+		ssize_t nread = read(queue->fd, &count, sizeof(count));
+		(void)nread;
+	}
+
+	unref_ticket(ticket);
+}
+
+// Must be called with `pool.mutex` locked
+void unref_ticket(FfFilterTicket *ticket)
+{
+	if (--ticket->nrefs == 0) {
+		tyrant_free(ticket);
+	}
+}
@@ -4,6 +4,7 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <fontconfig/fontconfig.h>
 
@@ -31,7 +32,11 @@
 typedef enum FfConditionType {
 	FF_COMPARISON,
 	FF_COMPOSITION,
-	FF_CHAR_REQUIREMENT
+	FF_CHAR_REQUIREMENT,
+	FF_CONSTANT,
+	FF_INTERVAL,
+	FF_LANG_REQUIREMENT,
+	FF_FUZZY_MATCH
 } FfConditionType;
 
 typedef enum FfRelationalOperator {
@@ -47,13 +52,54 @@ typedef enum FfRelationalOperator {
 	FF_NOT_CONTAINED_IN
 } FfRelationalOperator;
 
+// Which of a property's values a comparison is made against
+typedef enum FfQuantifier {
+	FF_FIRST = 0,
+	FF_ANY,
+	FF_ALL
+} FfQuantifier;
+
+typedef enum FfFilterKind {
+	FF_FILTER_CONDITION,
+	FF_FILTER_LIST,
+	FF_FILTER_LIST_SOFT
+} FfFilterKind;
+
+typedef enum FfFilterStatus {
+	FF_FILTER_PENDING,
+	FF_FILTER_DONE,
+	FF_FILTER_CANCELLED,
+	FF_FILTER_FAILED
+} FfFilterStatus;
+
 typedef struct FfLogicalOperator FfLogicalOperator;
 typedef struct FfComparison FfComparison;
 typedef struct FfLogicalComposition FfLogicalComposition;
 typedef struct FfCharRequirement FfCharRequirement;
+typedef struct FfConstant FfConstant;
+typedef struct FfInterval FfInterval;
+typedef struct FfLangRequirement FfLangRequirement;
+typedef struct FfFuzzyMatch FfFuzzyMatch;
 typedef union FfConditionValue FfConditionValue;
 typedef struct FfCondition FfCondition;
 typedef struct FfList FfList;
+typedef struct FfPageSummary FfPageSummary;
+typedef struct FfLangMask FfLangMask;
+typedef struct FfIndex FfIndex;
+typedef struct FfGroup FfGroup;
+typedef struct FfGroupSet FfGroupSet;
+typedef struct FfEstimate FfEstimate;
+typedef struct FfCoverage FfCoverage;
+typedef struct FfFilterQuery FfFilterQuery;
+typedef struct FfFilterTicket FfFilterTicket;
+typedef struct FfCompletionQueue FfCompletionQueue;
+
+/// Called on a worker thread once a submitted query has completed.
+/**
+ * The ticket's status and result are available to the callback, but it must
+ * not wait for or release the ticket, which would never return.
+ */
+typedef void FfFilterCallback(FfFilterTicket *ticket, void *data);
 
 struct FfLogicalOperator {
 	bool pt_qt;
@@ -66,6 +112,10 @@ struct FfComparison {
 	const char *object;
 	FcValue value;
 	FfRelationalOperator oper;
+	FfQuantifier quantifier;
+
+	// Blocks of code points present in a `FcTypeCharSet` value, else NULL
+	FfPageSummary *page_summary;
 };
 
 struct FfLogicalComposition {
@@ -78,10 +128,47 @@ struct FfCharRequirement {
 	FcChar32 c;
 };
 
+struct FfConstant {
+	bool value;
+};
+
+struct FfInterval {
+	const char *object;
+	double from;
+	double to;
+	bool from_inclusive;
+	bool to_inclusive;
+};
+
+struct FfLangRequirement {
+	// Normalized languages, those which are known to fontconfig first
+	FcChar8 **langs;
+	size_t nlangs;
+	size_t nknown;
+	bool all;
+
+	// Known languages, as bits over fontconfig's sorted list of languages
+	FfLangMask *mask;
+};
+
+struct FfFuzzyMatch {
+	const char *object;
+
+	// Case folded string, as code points
+	FcChar32 *chars;
+	size_t len;
+
+	unsigned max_distance;
+};
+
 union FfConditionValue {
 	FfComparison comparison;
 	FfLogicalComposition composition;
 	FfCharRequirement char_requirement;
+	FfConstant constant;
+	FfInterval interval;
+	FfLangRequirement lang_requirement;
+	FfFuzzyMatch fuzzy_match;
 };
 
 struct FfCondition {
@@ -97,6 +184,58 @@ struct FfList {
 	size_t cap;
 };
 
+struct FfFilterQuery {
+	// `ff_condition_filter()`, `ff_list_filter()` or `ff_list_filter_soft()`
+	FfFilterKind kind;
+	FfCondition *condition;
+	FfList list;
+	FcFontSet *set;
+
+	// Any of these may be NULL
+	FfFilterCallback *callback;
+	void *data;
+	FfCompletionQueue *queue;
+};
+
+struct FfGroup {
+	// One string per grouping object, NULL where the fonts lack the object
+	FcChar8 **key;
+	FcFontSet *fonts;
+
+	// Font in `fonts` preferred by the `best` list, NULL without a list
+	FcPattern *best;
+};
+
+struct FfGroupSet {
+	FfGroup *groups;
+	size_t ngroups;
+	size_t nobjects;
+};
+
+struct FfEstimate {
+	// Number of fonts
+	double count;
+
+	// Bounds which the number of fonts is within, unless the estimate was
+	// made from a sample, in which case they're its confidence interval
+	double low;
+	double high;
+
+	// Error bound which the estimate achieves, as a fraction of the number
+	// of fonts, 0 for exact counts
+	double error_bound;
+};
+
+struct FfCoverage {
+	// Fonts which together cover the text, in the order they were chosen
+	FcFontSet *fonts;
+
+	// Per code point of the text, the position in `fonts` of the font it's
+	// assigned to, or -1 if no font has it
+	int *assignment;
+	size_t len;
+};
+
 /// Converts the (first and only) variadic argument to an `FcValue` with the
 /// given type and calls `ff_compare_value()`.
 FfCondition *ff_compare(const char *object, FfRelationalOperator oper,
@@ -104,9 +243,36 @@ FfCondition *ff_compare(const char *object, FfRelationalOperator oper,
 
 /// Creates a condition representing a comparison between `value` and the value
 /// which is associated with the property `object` for some pattern.
+/**
+ * If `value` is a charset, a summary of it is computed here, so the charset
+ * must not be modified while the condition is alive.
+ */
 FfCondition *ff_compare_value(const char *object, FfRelationalOperator oper,
 		FcValue value);
 
+/// Same as `ff_compare()`, but the condition is satisfied if any of the values
+/// associated with `object` satisfy the comparison.
+FfCondition *ff_compare_any(const char *object, FfRelationalOperator oper,
+		FcType type, ...);
+
+/// Same as `ff_compare()`, but the condition is satisfied if all of the values
+/// (and at least one) associated with `object` satisfy the comparison.
+FfCondition *ff_compare_all(const char *object, FfRelationalOperator oper,
+		FcType type, ...);
+
+/// Same as `ff_compare_value()`, but compares `value` with the values of
+/// `object` selected by `quantifier`.
+/**
+ * `FF_FIRST` compares with the first value only, like `ff_compare_value()`.
+ * `FF_ANY` and `FF_ALL` look `object` up once and test its values in order,
+ * stopping at the first value which decides the result. When filtering through
+ * an `FfIndex` the values are walked once, since the index keeps them. Without
+ * one, fetching each value from fontconfig walks the values before it.
+ */
+FfCondition *ff_compare_quantified_value(const char *object,
+		FfQuantifier quantifier, FfRelationalOperator oper,
+		FcValue value);
+
 /// Creates a condition representing a logical operation between two conditions.
 FfCondition *ff_compose(FfCondition *p, FfLogicalOperator oper, FfCondition *q);
 
@@ -114,6 +280,46 @@ FfCondition *ff_compose(FfCondition *p, FfLogicalOperator oper, FfCondition *q);
 /// contains `c`.
 FfCondition *ff_require_char(FcChar32 c);
 
+/// Creates a condition representing a requirement that a pattern's langset
+/// contains `lang`.
+FfCondition *ff_require_lang(const char *lang);
+
+/// Creates a condition representing a requirement that a pattern's langset
+/// contains at least one of `langs`.
+FfCondition *ff_require_any_lang(const char *const *langs, size_t nlangs);
+
+/// Creates a condition representing a requirement that a pattern's langset
+/// contains all of `langs`.
+FfCondition *ff_require_all_langs(const char *const *langs, size_t nlangs);
+
+/// Creates a condition which is satisfied by every pattern if `value` is true,
+/// and by no pattern otherwise.
+FfCondition *ff_constant(bool value);
+
+/// Creates a condition representing a requirement that the (real) value which
+/// is associated with the property `object` lies between `from` and `to`.
+/**
+ * Non-real values never satisfy the condition, which makes it equivalent to
+ * composing `FF_GREATER_THAN(_EQUAL)` and `FF_LESS_THAN(_EQUAL)` comparisons
+ * with `FF_AND`.
+ */
+FfCondition *ff_compare_interval(const char *object, double from,
+		bool from_inclusive, double to, bool to_inclusive);
+
+/// Creates a condition representing a requirement that one of the (string)
+/// values which are associated with the property `object` is within
+/// `max_distance` edits of `string`.
+/**
+ * Strings are compared case-insensitively, using the Levenshtein distance over
+ * code points. Indexed filtering looks `FC_FAMILY` matches up in the index's
+ * tree of family names instead of comparing `string` against every font.
+ *
+ * Returns NULL if `string` isn't valid UTF-8, if it's longer than 256 code
+ * points once case folded, or on failure. Testing the condition never fails.
+ */
+FfCondition *ff_compare_fuzzy(const char *object, const char *string,
+		unsigned max_distance);
+
 /// Calls `ff_compose()` and decrements the reference counts of `p` and `q`.
 /**
  * Intention is to transfer "ownership" of the references to the resulting
@@ -132,6 +338,18 @@ FfCondition *ff_condition_ref(FfCondition *condition);
 /// becomes zero.
 void ff_condition_unref(FfCondition *condition);
 
+/// Creates a condition which is equivalent to `condition`, but which is
+/// cheaper to test.
+/**
+ * Compositions are folded using their truth tables (operands which cannot
+ * affect the result are dropped, negations are absorbed into the operator),
+ * chains of `FF_AND`/`FF_OR` are flattened, identical sub-trees are shared,
+ * and bounds on the same real property are merged into a single interval.
+ *
+ * Returns a new reference, or NULL on failure. `condition` is not modified.
+ */
+FfCondition *ff_condition_optimize(FfCondition *condition);
+
 /// Creates a list.
 FfList ff_list_create(int *ret_status);
 
@@ -183,4 +401,224 @@ FcFontSet *ff_list_filter(FfList list, FcFontSet *set);
  */
 FcFontSet *ff_list_filter_soft(FfList list, FcFontSet *set);
 
+/// Same as `ff_condition_filter()`, for the union of `nsets` font sets.
+/**
+ * The sets are scanned once, in order, and a font is skipped if a font with
+ * the same `FC_FILE` and `FC_INDEX` (0 if missing) came before it, whether or
+ * not that font satisfied `condition`. Fonts without a file are never skipped.
+ * NULL sets (e.g. from `FcConfigGetFonts()`) are ignored.
+ */
+FcFontSet *ff_condition_filter_sets(FfCondition *condition, FcFontSet **sets,
+		size_t nsets);
+
+/// Same as `ff_list_filter()`, for the union of `nsets` font sets, as in
+/// `ff_condition_filter_sets()`.
+FcFontSet *ff_list_filter_sets(FfList list, FcFontSet **sets, size_t nsets);
+
+/// Same as `ff_list_filter_soft()`, for the union of `nsets` font sets, as in
+/// `ff_condition_filter_sets()`.
+/**
+ * The result is the same as that of soft filtering the deduplicated union at
+ * once, i.e. a condition is only skipped if no font in any of the sets would
+ * remain, but it's computed in a single scan.
+ */
+FcFontSet *ff_list_filter_soft_sets(FfList list, FcFontSet **sets,
+		size_t nsets);
+
+/// Filters `set` like `ff_condition_filter()`, grouping the fonts which satisfy
+/// `condition` by the (first) string values of `objects`.
+/**
+ * Groups are ordered by their first font, and fonts keep their order within
+ * a group.
+ *
+ * If `best` isn't NULL, each group's best font is selected as if by
+ * `ff_list_filter_soft()` with `best` (taking the first of the results).
+ *
+ * Returns NULL on failure.
+ */
+FfGroupSet *ff_condition_filter_grouped(FfCondition *condition,
+		FcFontSet *set, const char *const *objects, size_t nobjects,
+		const FfList *best);
+
+/// Same as `ff_condition_filter_grouped()`, but filters like
+/// `ff_list_filter()`.
+FfGroupSet *ff_list_filter_grouped(FfList list, FcFontSet *set,
+		const char *const *objects, size_t nobjects,
+		const FfList *best);
+
+/// Destroys `groups`.
+void ff_group_set_destroy(FfGroupSet *groups);
+
+/// Returns a font set containing the (at most) `k` fonts in `set` with the
+/// highest scores, in order of decreasing score.
+/**
+ * A font's score is the sum of `weights[i]` for each condition `i` in `list`
+ * which it satisfies. If `weights` is NULL, each condition weighs 1.
+ *
+ * Fonts with equal scores keep their order in `set`.
+ */
+FcFontSet *ff_list_rank(FfList list, const double *weights, FcFontSet *set,
+		size_t k);
+
+/// Chooses a small set of fonts in `set` which together cover the code points
+/// of `text`, and assigns each code point to one of them.
+/**
+ * Fonts are chosen greedily, each covering as many of the remaining code points
+ * as possible. Ties go to the font preferred by `list`, that is the one which
+ * `ff_list_filter_soft()` would keep, and then to the font which comes first
+ * in `set`. A code point is assigned to the first chosen font which has it.
+ *
+ * Every font's charset is tested once against the text's distinct code points,
+ * and `list` is only tested on fonts which have at least one of them.
+ *
+ * Returns NULL on failure.
+ */
+FfCoverage *ff_cover_text(FfList list, FcFontSet *set, const FcChar32 *text,
+		size_t len);
+
+/// Destroys `coverage`.
+void ff_coverage_destroy(FfCoverage *coverage);
+
+/// Submits `query` to the library's worker pool and returns a ticket for it,
+/// or NULL on failure.
+/**
+ * The query's conditions are referenced until the ticket is released, but
+ * `query->set` is not copied, so it must outlive the query's evaluation.
+ *
+ * Queries are evaluated in slices, taking turns on the pool's threads, so a
+ * large query doesn't hold up those submitted after it.
+ *
+ * On completion, the ticket's status is set, then the callback is called (on a
+ * worker thread) and the ticket is pushed to the completion queue, if they were
+ * given. `ff_filter_wait()` and `ff_filter_release()` return only after both.
+ */
+FfFilterTicket *ff_filter_submit(const FfFilterQuery *query);
+
+/// Returns the status of `ticket` without blocking.
+FfFilterStatus ff_filter_status(FfFilterTicket *ticket);
+
+/// Blocks until `ticket` has completed and has been delivered to its callback
+/// and completion queue, and returns its status.
+FfFilterStatus ff_filter_wait(FfFilterTicket *ticket);
+
+/// Requests that `ticket` stops being evaluated.
+/**
+ * A query which is cancelled before it finishes completes with
+ * `FF_FILTER_CANCELLED`.
+ */
+void ff_filter_cancel(FfFilterTicket *ticket);
+
+/// Returns the result of a ticket which has completed with `FF_FILTER_DONE`,
+/// transferring ownership to the caller, or NULL.
+FcFontSet *ff_filter_take_result(FfFilterTicket *ticket);
+
+/// Cancels `ticket` if it's pending, waits for it to stop being evaluated and
+/// to be delivered, and destroys it (and its result, if it wasn't taken).
+/**
+ * The callback is never called after this returns.
+ *
+ * Reference counts aren't atomic, so this should be called from the thread
+ * which owns the query's conditions.
+ */
+void ff_filter_release(FfFilterTicket *ticket);
+
+/// Creates a queue to which completed tickets are pushed.
+FfCompletionQueue *ff_completion_queue_create(void);
+
+/// Destroys `queue`.
+/**
+ * Waits for the tickets which were submitted with `queue` to be delivered, so
+ * those which are still pending should be released (or at least cancelled)
+ * first.
+ */
+void ff_completion_queue_destroy(FfCompletionQueue *queue);
+
+/// Returns a file descriptor which is readable while `queue` isn't empty, to
+/// be polled alongside other events.
+int ff_completion_queue_fd(FfCompletionQueue *queue);
+
+/// Removes and returns the oldest ticket in `queue`, or NULL if it's empty.
+FfFilterTicket *ff_completion_queue_pop(FfCompletionQueue *queue);
+
+/// Creates an index of `set`, which precomputes per-font data used to speed up
+/// filtering.
+/**
+ * The index refers to `set` rather than copying it, so `set` must outlive the
+ * index and must not be modified while the index is alive.
+ */
+FfIndex *ff_index_create(FcFontSet *set);
+
+/// Destroys `index`.
+void ff_index_destroy(FfIndex *index);
+
+/// Same as `ff_condition_filter()`, for the font set of `index`.
+FcFontSet *ff_condition_filter_index(FfCondition *condition, FfIndex *index);
+
+/// Same as `ff_list_filter()`, for the font set of `index`.
+FcFontSet *ff_list_filter_index(FfList list, FfIndex *index);
+
+/// Same as `ff_list_filter_soft()`, for the font set of `index`.
+FcFontSet *ff_list_filter_soft_index(FfList list, FfIndex *index);
+
+/// Creates a set of the fonts of `index` with a family name within
+/// `max_distance` edits of `family`, ordered by distance.
+/**
+ * Distances are measured as by `ff_compare_fuzzy()`, a font's distance being
+ * that of its closest family name. Fonts at the same distance keep their order
+ * in the index's set.
+ */
+FcFontSet *ff_index_fuzzy_search(FfIndex *index, const char *family,
+		unsigned max_distance);
+
+/// Creates a set of the fonts of `index` whose (first) value of `object`
+/// contains `value`, i.e. ranges which contain it and reals which equal it.
+/**
+ * Same as filtering with an `FF_CONTAINS` comparison, but for `FC_WEIGHT`,
+ * `FC_WIDTH` and `FC_SIZE` the fonts are found in an interval tree built by
+ * `ff_index_create()`, in O(log n + k) time. Indexed filtering uses the same
+ * trees for `FF_CONTAINS` and `FF_DOES_NOT_CONTAIN` comparisons of those
+ * properties' first values.
+ *
+ * Fonts keep their order in the index's set.
+ */
+FcFontSet *ff_index_find_containing(FfIndex *index, const char *object,
+		double value);
+
+/// Same as `ff_index_find_containing()`, but finds the fonts with a range which
+/// contains the range between `from` and `to`.
+FcFontSet *ff_index_find_covering(FfIndex *index, const char *object,
+		double from, double to);
+
+/// Estimates the number of fonts of `index` which satisfy `condition`, without
+/// testing every font.
+/**
+ * Comparisons of the first (real) value of a numeric property, such as
+ * `FC_WEIGHT` or `FC_SIZE`, are answered from histograms built by
+ * `ff_index_create()`, with bounds which always hold. Compositions (and lists)
+ * of such conditions on different properties are combined through their
+ * operator's truth table: the count assumes that the properties are
+ * independent, but the bounds hold however they're correlated, so they may be
+ * much wider than a single comparison's. Lists first intersect their
+ * comparisons of the same property into one interval, which is answered like a
+ * single comparison. These estimates are only returned if their bounds are
+ * within `error_bound * set->nfont` fonts of the count.
+ *
+ * Otherwise, and for other conditions, fonts are tested on a fixed random
+ * sample of the fonts, which is sized so that the 95% confidence interval
+ * extends at most `error_bound * set->nfont` fonts either side of the estimate.
+ * If that would need more fonts than the index has sampled (4096), the whole
+ * sample is tested and the estimate's `error_bound` is looser than the one
+ * asked for. Every font is tested, and the count is exact, if `error_bound`
+ * isn't positive or the sample is the whole set.
+ *
+ * On failure, `*ret_status` is set to `FF_FAILURE`.
+ */
+FfEstimate ff_condition_estimate(FfCondition *condition, FfIndex *index,
+		double error_bound, int *ret_status);
+
+/// Same as `ff_condition_estimate()`, for the fonts which satisfy every
+/// condition in `list`.
+FfEstimate ff_list_estimate(FfList list, FfIndex *index, double error_bound,
+		int *ret_status);
+
 #endif // fontfilter_h
@@ -0,0 +1,424 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <fontfilter.h>
+
+#include "random.h"
+
+// Checks that queries submitted to the worker pool give the same fonts as
+// filtering synchronously, and that cancelling, releasing and destroying
+// queues are safe at any point of a query's life.
+//
+// Workers run callbacks, so tickets whose callbacks block until a gate opens
+// occupy every worker, which keeps the tickets submitted after them queued.
+
+enum {
+	NFONTS = 3000,
+	NLARGE_FONTS = 30000,
+	NQUERIES = 60,
+	// At least as many as the pool has workers
+	NBLOCKERS = 64,
+	NQUEUED = 8
+};
+
+typedef struct Blockers {
+	FfFilterTicket *tickets[NBLOCKERS];
+	FcFontSet *set;
+	pthread_t opener;
+} Blockers;
+
+typedef struct Delivery {
+	pthread_mutex_t mutex;
+	int ncalls;
+	FfFilterStatus status;
+} Delivery;
+
+static FfFilterQuery random_query(FfCondition *condition, FfList list,
+		FcFontSet *set);
+static FcFontSet *filter_sync(const FfFilterQuery *query);
+static void count_delivery(FfFilterTicket *ticket, void *data);
+static void wait_at_gate(FfFilterTicket *ticket, void *data);
+static void close_gate(void);
+static void *open_gate_later(void *arg);
+static void block_workers(FcFontSet *set, Blockers *blockers);
+static void unblock_workers(Blockers *blockers);
+static void release_blockers(Blockers *blockers);
+static void test_equivalence(FcFontSet *set);
+static void test_cancel_before_run(FcFontSet *set);
+static void test_cancel_while_running(void);
+static void test_release_while_queued(FcFontSet *set);
+static void test_destroy_queue(FcFontSet *set);
+
+static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static bool gate_open;
+
+int main(void)
+{
+	random_init(32);
+
+	FcFontSet *set = random_font_set(NFONTS);
+
+	test_equivalence(set);
+	test_cancel_before_run(set);
+	test_cancel_while_running();
+	test_release_while_queued(set);
+	test_destroy_queue(set);
+
+	FcFontSetDestroy(set);
+	random_fini();
+
+	printf("async: OK\n");
+
+	return 0;
+}
+
+FfFilterQuery random_query(FfCondition *condition, FfList list,
+		FcFontSet *set)
+{
+	FfFilterKind kinds[] = {
+		FF_FILTER_CONDITION,
+		FF_FILTER_LIST,
+		FF_FILTER_LIST_SOFT
+	};
+
+	return (FfFilterQuery){
+		.kind = kinds[random_below(3)],
+		.condition = condition,
+		.list = list,
+		.set = set,
+		.callback = NULL,
+		.data = NULL,
+		.queue = NULL
+	};
+}
+
+FcFontSet *filter_sync(const FfFilterQuery *query)
+{
+	switch (query->kind) {
+	case FF_FILTER_CONDITION:
+		return ff_condition_filter(query->condition, query->set);
+	case FF_FILTER_LIST:
+		return ff_list_filter(query->list, query->set);
+	default:
+		return ff_list_filter_soft(query->list, query->set);
+	}
+}
+
+void count_delivery(FfFilterTicket *ticket, void *data)
+{
+	Delivery *delivery = data;
+
+	pthread_mutex_lock(&delivery->mutex);
+	++delivery->ncalls;
+	delivery->status = ff_filter_status(ticket);
+	pthread_mutex_unlock(&delivery->mutex);
+}
+
+void wait_at_gate(FfFilterTicket *ticket, void *data)
+{
+	(void)ticket;
+	(void)data;
+
+	pthread_mutex_lock(&gate_mutex);
+	while (!gate_open) {
+		pthread_cond_wait(&gate_cond, &gate_mutex);
+	}
+	pthread_mutex_unlock(&gate_mutex);
+}
+
+void close_gate(void)
+{
+	pthread_mutex_lock(&gate_mutex);
+	gate_open = false;
+	pthread_mutex_unlock(&gate_mutex);
+}
+
+// Opens the gate while the main thread is blocked in a call that waits for
+// a queued ticket
+void *open_gate_later(void *arg)
+{
+	(void)arg;
+
+	nanosleep(&(struct timespec){ .tv_nsec = 50 * 1000 * 1000 }, NULL);
+
+	pthread_mutex_lock(&gate_mutex);
+	gate_open = true;
+	pthread_cond_broadcast(&gate_cond);
+	pthread_mutex_unlock(&gate_mutex);
+
+	return NULL;
+}
+
+// Each worker blocks in the callback of the first blocker it completes, and
+// there are at least as many blockers as workers, so tickets submitted after
+// them stay queued until the gate opens
+void block_workers(FcFontSet *set, Blockers *blockers)
+{
+	close_gate();
+
+	blockers->set = FcFontSetCreate();
+	assert(blockers->set != NULL);
+	FcPatternReference(set->fonts[0]);
+	assert(FcFontSetAdd(blockers->set, set->fonts[0]));
+
+	FfCondition *condition = ff_constant(true);
+	assert(condition != NULL);
+
+	for (int i = 0; i < NBLOCKERS; ++i) {
+		FfFilterQuery query = {
+			.kind = FF_FILTER_CONDITION,
+			.condition = condition,
+			.set = blockers->set,
+			.callback = wait_at_gate,
+			.data = NULL,
+			.queue = NULL
+		};
+		blockers->tickets[i] = ff_filter_submit(&query);
+		assert(blockers->tickets[i] != NULL);
+	}
+
+	ff_condition_unref(condition);
+}
+
+void unblock_workers(Blockers *blockers)
+{
+	assert(pthread_create(&blockers->opener, NULL, open_gate_later, NULL)
+			== 0);
+}
+
+void release_blockers(Blockers *blockers)
+{
+	assert(pthread_join(blockers->opener, NULL) == 0);
+
+	for (int i = 0; i < NBLOCKERS; ++i) {
+		assert(ff_filter_wait(blockers->tickets[i]) == FF_FILTER_DONE);
+		ff_filter_release(blockers->tickets[i]);
+	}
+
+	FcFontSetDestroy(blockers->set);
+}
+
+// Results match synchronous filtering, and every ticket is delivered once to
+// its callback and its queue
+void test_equivalence(FcFontSet *set)
+{
+	FfCompletionQueue *queue = ff_completion_queue_create();
+	assert(queue != NULL);
+
+	FfCondition *conditions[NQUERIES];
+	FfList lists[NQUERIES];
+	FfFilterQuery queries[NQUERIES];
+	Delivery deliveries[NQUERIES];
+	FfFilterTicket *tickets[NQUERIES];
+
+	for (int i = 0; i < NQUERIES; ++i) {
+		conditions[i] = random_condition(3);
+		lists[i] = random_list(random_below(4), 2);
+		queries[i] = random_query(conditions[i], lists[i], set);
+
+		deliveries[i] = (Delivery){ .ncalls = 0 };
+		assert(pthread_mutex_init(&deliveries[i].mutex, NULL) == 0);
+		queries[i].callback = count_delivery;
+		queries[i].data = &deliveries[i];
+		queries[i].queue = queue;
+
+		tickets[i] = ff_filter_submit(&queries[i]);
+		assert(tickets[i] != NULL);
+	}
+
+	for (int i = 0; i < NQUERIES; ++i) {
+		assert(ff_filter_wait(tickets[i]) == FF_FILTER_DONE);
+		assert(deliveries[i].ncalls == 1);
+		assert(deliveries[i].status == FF_FILTER_DONE);
+
+		FcFontSet *result = ff_filter_take_result(tickets[i]);
+		FcFontSet *expected = filter_sync(&queries[i]);
+		assert(result != NULL && expected != NULL);
+		assert(font_sets_equal(result, expected));
+		assert(ff_filter_take_result(tickets[i]) == NULL);
+
+		FcFontSetDestroy(expected);
+		FcFontSetDestroy(result);
+	}
+
+	struct pollfd pollfd = {
+		.fd = ff_completion_queue_fd(queue),
+		.events = POLLIN
+	};
+	assert(poll(&pollfd, 1, 0) == 1);
+
+	int npopped = 0;
+	FfFilterTicket *ticket;
+	while ((ticket = ff_completion_queue_pop(queue)) != NULL) {
+		++npopped;
+	}
+	assert(npopped == NQUERIES);
+	assert(poll(&pollfd, 1, 0) == 0);
+
+	for (int i = 0; i < NQUERIES; ++i) {
+		ff_filter_release(tickets[i]);
+		pthread_mutex_destroy(&deliveries[i].mutex);
+		ff_list_destroy(lists[i]);
+		ff_condition_unref(conditions[i]);
+	}
+
+	ff_completion_queue_destroy(queue);
+}
+
+void test_cancel_before_run(FcFontSet *set)
+{
+	Blockers blockers;
+	block_workers(set, &blockers);
+
+	FfCondition *condition = random_condition(3);
+	FfList list = random_list(2, 2);
+	FfFilterQuery query = random_query(condition, list, set);
+
+	FfFilterTicket *ticket = ff_filter_submit(&query);
+	assert(ticket != NULL);
+	ff_filter_cancel(ticket);
+	assert(ff_filter_status(ticket) == FF_FILTER_PENDING);
+
+	unblock_workers(&blockers);
+
+	assert(ff_filter_wait(ticket) == FF_FILTER_CANCELLED);
+	assert(ff_filter_take_result(ticket) == NULL);
+	ff_filter_release(ticket);
+
+	release_blockers(&blockers);
+
+	ff_list_destroy(list);
+	ff_condition_unref(condition);
+}
+
+// The query may finish before it's cancelled, but then its result must be
+// complete
+void test_cancel_while_running(void)
+{
+	FcFontSet *large = random_font_set(NLARGE_FONTS);
+
+	for (int i = 0; i < 4; ++i) {
+		FfCondition *condition = random_condition(4);
+		FfList list = random_list(4, 3);
+		FfFilterQuery query = random_query(condition, list, large);
+
+		FfFilterTicket *ticket = ff_filter_submit(&query);
+		assert(ticket != NULL);
+
+		nanosleep(&(struct timespec){ .tv_nsec = i * 1000 * 1000 },
+				NULL);
+		ff_filter_cancel(ticket);
+
+		FfFilterStatus status = ff_filter_wait(ticket);
+		FcFontSet *result = ff_filter_take_result(ticket);
+		if (status == FF_FILTER_DONE) {
+			FcFontSet *expected = filter_sync(&query);
+			assert(result != NULL && expected != NULL);
+			assert(font_sets_equal(result, expected));
+			FcFontSetDestroy(expected);
+			FcFontSetDestroy(result);
+		} else {
+			assert(status == FF_FILTER_CANCELLED);
+			assert(result == NULL);
+		}
+
+		ff_filter_release(ticket);
+		ff_list_destroy(list);
+		ff_condition_unref(condition);
+	}
+
+	FcFontSetDestroy(large);
+}
+
+// Releasing waits for the cancelled ticket to be delivered, after which the
+// callback isn't called again
+void test_release_while_queued(FcFontSet *set)
+{
+	Blockers blockers;
+	block_workers(set, &blockers);
+
+	FfCompletionQueue *queue = ff_completion_queue_create();
+	assert(queue != NULL);
+
+	FfCondition *condition = random_condition(3);
+	FfList list = random_list(2, 2);
+	FfFilterQuery query = random_query(condition, list, set);
+
+	Delivery delivery = { .ncalls = 0 };
+	assert(pthread_mutex_init(&delivery.mutex, NULL) == 0);
+	query.callback = count_delivery;
+	query.data = &delivery;
+	query.queue = queue;
+
+	FfFilterTicket *ticket = ff_filter_submit(&query);
+	assert(ticket != NULL);
+
+	unblock_workers(&blockers);
+
+	ff_filter_release(ticket);
+	assert(delivery.ncalls == 1);
+	assert(delivery.status == FF_FILTER_CANCELLED);
+
+	// Released tickets leave their queue
+	assert(ff_completion_queue_pop(queue) == NULL);
+
+	release_blockers(&blockers);
+	assert(delivery.ncalls == 1);
+
+	ff_completion_queue_destroy(queue);
+	pthread_mutex_destroy(&delivery.mutex);
+	ff_list_destroy(list);
+	ff_condition_unref(condition);
+}
+
+// Destroying a queue waits for its tickets to be delivered, which may then be
+// released without the queue
+void test_destroy_queue(FcFontSet *set)
+{
+	Blockers blockers;
+	block_workers(set, &blockers);
+
+	FfCompletionQueue *queue = ff_completion_queue_create();
+	assert(queue != NULL);
+
+	FfCondition *condition = random_condition(3);
+	FfList list = random_list(2, 2);
+
+	FfFilterTicket *tickets[NQUEUED];
+	for (int i = 0; i < NQUEUED; ++i) {
+		FfFilterQuery query = random_query(condition, list, set);
+		query.queue = queue;
+
+		tickets[i] = ff_filter_submit(&query);
+		assert(tickets[i] != NULL);
+		if (i % 2 == 0) {
+			ff_filter_cancel(tickets[i]);
+		}
+	}
+
+	unblock_workers(&blockers);
+
+	ff_completion_queue_destroy(queue);
+
+	for (int i = 0; i < NQUEUED; ++i) {
+		FfFilterStatus status = ff_filter_status(tickets[i]);
+		assert(status == (i % 2 == 0 ? FF_FILTER_CANCELLED
+					: FF_FILTER_DONE));
+		ff_filter_release(tickets[i]);
+	}
+
+	release_blockers(&blockers);
+
+	ff_list_destroy(list);
+	ff_condition_unref(condition);
+}
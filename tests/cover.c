@@ -0,0 +1,206 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <fontfilter.h>
+
+#include "random.h"
+
+// Checks that covering a text assigns every code point to a chosen font which
+// has it, or to none when no font does, and that fonts are chosen greedily
+
+enum {
+	NFONTS = 500,
+	NTEXTS = 50,
+	MAX_LEN = 100,
+	NLISTS = 20
+};
+
+// Never in a random charset
+#define MISSING_CHAR 0x10fffd
+
+static void random_text(FcChar32 *text, size_t len);
+static bool font_has_char(FcPattern *font, FcChar32 c);
+static size_t find_distinct(const FcChar32 *text, size_t len,
+		FcChar32 *chars);
+static size_t count_gain(FcPattern *font, const FcChar32 *chars,
+		size_t nchars, const bool *covered);
+static void check_assignment(const FfCoverage *coverage, FcFontSet *set,
+		const FcChar32 *text, size_t len);
+static void check_greedy(const FfCoverage *coverage, FcFontSet *set,
+		const FcChar32 *text, size_t len, bool exact);
+
+int main(void)
+{
+	random_init(35);
+
+	FcFontSet *set = random_font_set(NFONTS);
+
+	int status;
+	FfList empty = ff_list_create(&status);
+	assert(status == FF_SUCCESS);
+
+	for (int i = 0; i < NTEXTS; ++i) {
+		FcChar32 text[MAX_LEN];
+		size_t len = random_below(MAX_LEN + 1);
+		random_text(text, len);
+
+		// Without preferences, ties go to the first font in the set,
+		// so the choice is fully determined
+		FfCoverage *coverage = ff_cover_text(empty, set, text, len);
+		assert(coverage != NULL);
+		check_assignment(coverage, set, text, len);
+		check_greedy(coverage, set, text, len, true);
+		ff_coverage_destroy(coverage);
+
+		if (i < NLISTS) {
+			FfList list = random_list(1 + random_below(3), 2);
+			coverage = ff_cover_text(list, set, text, len);
+			assert(coverage != NULL);
+			check_assignment(coverage, set, text, len);
+			check_greedy(coverage, set, text, len, false);
+			ff_coverage_destroy(coverage);
+			ff_list_destroy(list);
+		}
+	}
+
+	ff_list_destroy(empty);
+	FcFontSetDestroy(set);
+	random_fini();
+
+	printf("cover: OK\n");
+
+	return 0;
+}
+
+// Code points like those of random charsets, with repeats and some which no
+// font has
+void random_text(FcChar32 *text, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		switch (random_below(8)) {
+		case 0:
+			text[i] = i > 0 ? text[random_below(i)] : 'a';
+			break;
+		case 1:
+			text[i] = MISSING_CHAR;
+			break;
+		case 2:
+			text[i] = random_below(0x20000);
+			break;
+		default:
+			text[i] = random_below(0x3000);
+			break;
+		}
+	}
+}
+
+bool font_has_char(FcPattern *font, FcChar32 c)
+{
+	FcCharSet *charset;
+	if (FcPatternGetCharSet(font, FC_CHARSET, 0, &charset)
+			!= FcResultMatch) {
+		return false;
+	}
+
+	return FcCharSetHasChar(charset, c);
+}
+
+size_t find_distinct(const FcChar32 *text, size_t len, FcChar32 *chars)
+{
+	size_t nchars = 0;
+	for (size_t i = 0; i < len; ++i) {
+		bool seen = false;
+		for (size_t j = 0; j < nchars && !seen; ++j) {
+			seen = chars[j] == text[i];
+		}
+
+		if (!seen) {
+			chars[nchars++] = text[i];
+		}
+	}
+
+	return nchars;
+}
+
+// Number of `chars` which `font` has and which aren't yet covered
+size_t count_gain(FcPattern *font, const FcChar32 *chars, size_t nchars,
+		const bool *covered)
+{
+	size_t gain = 0;
+	for (size_t i = 0; i < nchars; ++i) {
+		if (!covered[i] && font_has_char(font, chars[i])) {
+			++gain;
+		}
+	}
+
+	return gain;
+}
+
+void check_assignment(const FfCoverage *coverage, FcFontSet *set,
+		const FcChar32 *text, size_t len)
+{
+	assert(coverage->len == len);
+
+	FcFontSet *fonts = coverage->fonts;
+	for (size_t i = 0; i < len; ++i) {
+		int a = coverage->assignment[i];
+		assert(a >= -1 && a < fonts->nfont);
+
+		if (a == -1) {
+			for (int j = 0; j < set->nfont; ++j) {
+				assert(!font_has_char(set->fonts[j], text[i]));
+			}
+			continue;
+		}
+
+		// The first chosen font which has it
+		assert(font_has_char(fonts->fonts[a], text[i]));
+		for (int j = 0; j < a; ++j) {
+			assert(!font_has_char(fonts->fonts[j], text[i]));
+		}
+	}
+}
+
+// Every chosen font must cover as many of the remaining code points as any
+// other font, and be the first which does if `exact`
+void check_greedy(const FfCoverage *coverage, FcFontSet *set,
+		const FcChar32 *text, size_t len, bool exact)
+{
+	FcChar32 chars[MAX_LEN];
+	size_t nchars = find_distinct(text, len, chars);
+	bool covered[MAX_LEN] = { false };
+
+	FcFontSet *fonts = coverage->fonts;
+	for (int i = 0; i < fonts->nfont; ++i) {
+		FcPattern *chosen = fonts->fonts[i];
+		size_t gain = count_gain(chosen, chars, nchars, covered);
+		assert(gain > 0);
+
+		bool in_set = false;
+		for (int j = 0; j < set->nfont; ++j) {
+			if (set->fonts[j] == chosen) {
+				in_set = true;
+				continue;
+			}
+
+			size_t other = count_gain(set->fonts[j], chars, nchars,
+					covered);
+			assert(exact && !in_set ? other < gain : other <= gain);
+		}
+		assert(in_set);
+
+		for (size_t j = 0; j < nchars; ++j) {
+			covered[j] = covered[j]
+					|| font_has_char(chosen, chars[j]);
+		}
+	}
+
+	// Nothing left which any font could cover
+	for (int j = 0; j < set->nfont; ++j) {
+		assert(count_gain(set->fonts[j], chars, nchars, covered) == 0);
+	}
+}
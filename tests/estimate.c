@@ -0,0 +1,303 @@
+#include <stddef.h>
+#include <stdio.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <fontfilter.h>
+
+#include "random.h"
+
+// Checks that estimates answered from histograms bound the number of fonts
+// which pass, including when the properties they combine are correlated, and
+// that they're exact without an error bound
+
+enum {
+	NCORRELATED = 100000,
+	NFONTS = 5000,
+	NCONDITIONS = 300,
+	NLISTS = 100
+};
+
+static const char *const modelled_objects[] = {
+	FC_WEIGHT,
+	FC_SLANT,
+	FC_WIDTH
+};
+enum {
+	NMODELLED_OBJECTS = sizeof(modelled_objects) / sizeof(*modelled_objects)
+};
+
+static FcFontSet *correlated_font_set(int nfonts);
+static FfCondition *modelled_leaf(const char *object);
+static FfCondition *modelled_condition(void);
+static FfList modelled_list(void);
+static void check_condition(FfCondition *condition, FcFontSet *set,
+		FfIndex *index);
+static void check_list(FfList list, FcFontSet *set, FfIndex *index);
+static void check_bounds(FfEstimate estimate, int nfont);
+static void test_correlated(void);
+static void test_random(void);
+
+int main(void)
+{
+	random_init(34);
+
+	test_correlated();
+	test_random();
+
+	random_fini();
+
+	printf("estimate: OK\n");
+
+	return 0;
+}
+
+// Fonts which are mostly slanted when they're bold, and upright otherwise
+FcFontSet *correlated_font_set(int nfonts)
+{
+	FcFontSet *set = FcFontSetCreate();
+	assert(set != NULL);
+
+	for (int i = 0; i < nfonts; ++i) {
+		FcPattern *font = FcPatternCreate();
+		assert(font != NULL);
+
+		int weight = random_below(1000);
+		bool slanted = (weight > 500) == (random_below(10) != 0);
+		FcPatternAddInteger(font, FC_WEIGHT, weight);
+		FcPatternAddInteger(font, FC_SLANT, slanted ? 100 : 0);
+
+		assert(FcFontSetAdd(set, font));
+	}
+
+	return set;
+}
+
+// A comparison of the first value of `object` with any operator, or an
+// interval of it
+FfCondition *modelled_leaf(const char *object)
+{
+	FfCondition *condition;
+	if (random_below(4) == 0) {
+		double from = random_below(250);
+		double to = from + random_below(100);
+		condition = ff_compare_interval(object, from,
+				random_below(2), to, random_below(2));
+	} else {
+		condition = ff_compare(object,
+				random_below(FF_NOT_CONTAINED_IN + 1),
+				FcTypeInteger, (int)random_below(250));
+	}
+	assert(condition != NULL);
+
+	return condition;
+}
+
+// Compositions of different properties, which are all modelled
+FfCondition *modelled_condition(void)
+{
+	FfCondition *condition = modelled_leaf(modelled_objects[0]);
+	for (size_t i = 1; i < NMODELLED_OBJECTS; ++i) {
+		FfLogicalOperator oper;
+		if (random_below(3) == 0) {
+			oper = random_below(2) == 0 ? FF_AND : FF_OR;
+		} else {
+			unsigned table = random_below(16);
+			oper = (FfLogicalOperator){
+				.pt_qt = table & 1,
+				.pt_qf = table & 2,
+				.pf_qt = table & 4,
+				.pf_qf = table & 8
+			};
+		}
+
+		condition = ff_compose_unref(condition, oper,
+				modelled_leaf(modelled_objects[i]));
+		assert(condition != NULL);
+	}
+
+	return condition;
+}
+
+// Bounds of the same property, which are intersected, and a condition on
+// another
+FfList modelled_list(void)
+{
+	static const FfRelationalOperator opers[] = {
+		FF_EQUAL,
+		FF_LESS_THAN,
+		FF_LESS_THAN_EQUAL,
+		FF_GREATER_THAN,
+		FF_GREATER_THAN_EQUAL
+	};
+
+	int status;
+	FfList list = ff_list_create(&status);
+	assert(status == FF_SUCCESS);
+
+	unsigned nbounds = 1 + random_below(4);
+	for (unsigned i = 0; i < nbounds; ++i) {
+		FfCondition *condition;
+		if (random_below(4) == 0) {
+			condition = modelled_leaf(FC_WEIGHT);
+			if (condition->type != FF_INTERVAL) {
+				ff_condition_unref(condition);
+				continue;
+			}
+		} else {
+			condition = ff_compare(FC_WEIGHT,
+					opers[random_below(5)], FcTypeDouble,
+					random_below(250) + 0.5);
+			assert(condition != NULL);
+		}
+		assert(ff_list_add_unref(&list, condition));
+	}
+
+	if (random_below(2) == 0) {
+		FfCondition *condition = ff_compose_unref(
+				modelled_leaf(FC_SLANT), FF_OR,
+				modelled_leaf(FC_WIDTH));
+		assert(ff_list_add_unref(&list, condition));
+	}
+
+	return list;
+}
+
+void check_condition(FfCondition *condition, FcFontSet *set, FfIndex *index)
+{
+	FcFontSet *filtered = ff_condition_filter(condition, set);
+	assert(filtered != NULL);
+
+	int status;
+	FfEstimate estimate = ff_condition_estimate(condition, index, 1,
+			&status);
+	assert(status == FF_SUCCESS);
+	check_bounds(estimate, filtered->nfont);
+
+	estimate = ff_condition_estimate(condition, index, 0, &status);
+	assert(status == FF_SUCCESS);
+	assert(estimate.count == filtered->nfont);
+	assert(estimate.low == filtered->nfont);
+	assert(estimate.high == filtered->nfont);
+	assert(estimate.error_bound == 0);
+
+	FcFontSetDestroy(filtered);
+}
+
+void check_list(FfList list, FcFontSet *set, FfIndex *index)
+{
+	FcFontSet *filtered = ff_list_filter(list, set);
+	assert(filtered != NULL);
+
+	int status;
+	FfEstimate estimate = ff_list_estimate(list, index, 1, &status);
+	assert(status == FF_SUCCESS);
+	check_bounds(estimate, filtered->nfont);
+
+	estimate = ff_list_estimate(list, index, 0, &status);
+	assert(status == FF_SUCCESS);
+	assert(estimate.count == filtered->nfont);
+	assert(estimate.low == filtered->nfont);
+	assert(estimate.high == filtered->nfont);
+	assert(estimate.error_bound == 0);
+
+	FcFontSetDestroy(filtered);
+}
+
+// Only modelled estimates are returned with a bound this loose (sampling would
+// test a single font), and they must hold the number of fonts
+void check_bounds(FfEstimate estimate, int nfont)
+{
+	assert(estimate.low <= estimate.count);
+	assert(estimate.count <= estimate.high);
+	assert(estimate.low <= nfont && nfont <= estimate.high);
+	assert(estimate.error_bound <= 1);
+}
+
+void test_correlated(void)
+{
+	FcFontSet *set = correlated_font_set(NCORRELATED);
+	FfIndex *index = ff_index_create(set);
+	assert(index != NULL);
+
+	FfCondition *bold = ff_compare(FC_WEIGHT, FF_GREATER_THAN,
+			FcTypeInteger, 500);
+	FfCondition *slanted = ff_compare(FC_SLANT, FF_EQUAL, FcTypeInteger,
+			100);
+	assert(bold != NULL && slanted != NULL);
+
+	FfCondition *both = ff_compose(bold, FF_AND, slanted);
+	FfCondition *either = ff_compose(bold, FF_OR, slanted);
+	assert(both != NULL && either != NULL);
+	check_condition(both, set, index);
+	check_condition(either, set, index);
+
+	int status;
+	FfList list = ff_list_create(&status);
+	assert(status == FF_SUCCESS);
+	assert(ff_list_add(&list, bold));
+	assert(ff_list_add(&list, slanted));
+	check_list(list, set, index);
+	ff_list_destroy(list);
+
+	ff_condition_unref(either);
+	ff_condition_unref(both);
+	ff_condition_unref(slanted);
+	ff_condition_unref(bold);
+
+	ff_index_destroy(index);
+	FcFontSetDestroy(set);
+}
+
+void test_random(void)
+{
+	FcFontSet *set = random_font_set(NFONTS);
+	FfIndex *index = ff_index_create(set);
+	assert(index != NULL);
+
+	for (int i = 0; i < NCONDITIONS; ++i) {
+		FfCondition *condition = modelled_condition();
+		check_condition(condition, set, index);
+		ff_condition_unref(condition);
+	}
+
+	for (int i = 0; i < NLISTS; ++i) {
+		FfList list = modelled_list();
+		check_list(list, set, index);
+		ff_list_destroy(list);
+	}
+
+	// Bounds of one property in a list are modelled like their intersection
+	int status;
+	FfList list = ff_list_create(&status);
+	assert(status == FF_SUCCESS);
+	assert(ff_list_add_unref(&list, ff_compare(FC_WEIGHT,
+					FF_GREATER_THAN_EQUAL, FcTypeInteger,
+					100)));
+	assert(ff_list_add_unref(&list, ff_compare(FC_WEIGHT,
+					FF_LESS_THAN_EQUAL, FcTypeInteger,
+					200)));
+	FfCondition *interval = ff_compare_interval(FC_WEIGHT, 100, true, 200,
+			true);
+	assert(interval != NULL);
+
+	FcFontSet *filtered = ff_condition_filter(interval, set);
+	assert(filtered != NULL);
+
+	FfEstimate merged = ff_list_estimate(list, index, 1, &status);
+	assert(status == FF_SUCCESS);
+	FfEstimate single = ff_condition_estimate(interval, index, 1, &status);
+	assert(status == FF_SUCCESS);
+	assert(merged.count == single.count);
+	assert(merged.low == single.low && merged.high == single.high);
+	check_bounds(merged, filtered->nfont);
+
+	FcFontSetDestroy(filtered);
+
+	ff_condition_unref(interval);
+	ff_list_destroy(list);
+
+	ff_index_destroy(index);
+	FcFontSetDestroy(set);
+}
@@ -0,0 +1,351 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <fontfilter.h>
+
+#include "random.h"
+
+// Checks fuzzy matches, which plain filtering tests by folding every value and
+// indexes look up in a tree of family names, against distances computed from
+// strings folded by `FcStrDowncase()`
+
+enum {
+	NFONTS = 1000,
+	NQUERIES = 100,
+	MAX_DISTANCE = 3,
+	MAX_CHARS = 64
+};
+
+typedef struct Ranked {
+	FcPattern *font;
+	size_t distance;
+	int pos;
+} Ranked;
+
+static FcFontSet *fuzzy_font_set(int nfonts);
+static const char *random_name(void);
+static void mutate(const char *name, char *query, size_t size);
+static size_t fold(const char *string, FcChar32 *chars);
+static size_t distance(const char *a, const char *b);
+static size_t font_distance(FcPattern *font, const char *object,
+		const char *query);
+static int compare_ranked(const void *a, const void *b);
+static void check_filter(FcFontSet *set, FfIndex *index, const char *object,
+		const char *query, unsigned max_distance);
+static void check_search(FcFontSet *set, FfIndex *index, const char *query,
+		unsigned max_distance);
+static void check_composed(FcFontSet *set, FfIndex *index, const char *query,
+		unsigned max_distance);
+
+// Names whose case folding changes their length or isn't ASCII
+static const char *const odd_names[] = {
+	"Straße Sans",
+	"STRASSE SANS",
+	"İstanbul",
+	"ΑΒΓ Serif",
+	"αβγ serif",
+	"Ǆemal",
+	"ﬀ Ligatures",
+	"𐐀 Deseret"
+};
+enum { NODD_NAMES = sizeof(odd_names) / sizeof(*odd_names) };
+
+static const char *const edits[] = { "a", "Z", "ß", "İ", "Σ", "-", " " };
+enum { NEDITS = sizeof(edits) / sizeof(*edits) };
+
+int main(void)
+{
+	random_init(33);
+
+	FcFontSet *set = fuzzy_font_set(NFONTS);
+	FfIndex *index = ff_index_create(set);
+	assert(index != NULL);
+
+	for (int i = 0; i < NQUERIES; ++i) {
+		char query[MAX_CHARS * 4];
+		mutate(random_name(), query, sizeof(query));
+		unsigned max_distance = random_below(MAX_DISTANCE + 1);
+
+		check_filter(set, index, FC_FAMILY, query, max_distance);
+		check_filter(set, index, FC_STYLE, query, max_distance);
+		check_search(set, index, query, max_distance);
+		check_composed(set, index, query, max_distance);
+	}
+
+	// Too long to test without allocating
+	char long_query[300];
+	memset(long_query, 'a', sizeof(long_query) - 1);
+	long_query[sizeof(long_query) - 1] = '\0';
+	assert(ff_compare_fuzzy(FC_FAMILY, long_query, 1) == NULL);
+
+	ff_index_destroy(index);
+	FcFontSetDestroy(set);
+	random_fini();
+
+	printf("fuzzy: OK\n");
+
+	return 0;
+}
+
+FcFontSet *fuzzy_font_set(int nfonts)
+{
+	FcFontSet *set = FcFontSetCreate();
+	assert(set != NULL);
+
+	for (int i = 0; i < nfonts; ++i) {
+		FcPattern *font = random_font();
+
+		if (random_below(3) == 0) {
+			char name[MAX_CHARS * 4];
+			mutate(random_name(), name, sizeof(name));
+			FcPatternAddString(font, FC_FAMILY,
+					(const FcChar8 *)name);
+		}
+		if (random_below(4) == 0) {
+			FcPatternAddString(font, FC_STYLE, (const FcChar8 *)
+					odd_names[random_below(NODD_NAMES)]);
+		}
+
+		assert(FcFontSetAdd(set, font));
+	}
+
+	return set;
+}
+
+const char *random_name(void)
+{
+	return random_below(3) == 0 ? odd_names[random_below(NODD_NAMES)]
+			: random_family();
+}
+
+// A few random insertions, deletions and substitutions (of bytes, keeping
+// UTF-8 valid by only editing before ASCII bytes)
+void mutate(const char *name, char *query, size_t size)
+{
+	snprintf(query, size, "%s", name);
+
+	unsigned nedits = random_below(4);
+	for (unsigned i = 0; i < nedits; ++i) {
+		size_t len = strlen(query);
+		size_t at = random_below(len + 1);
+		if (at < len && (unsigned char)query[at] >= 0x80) {
+			continue;
+		}
+
+		const char *edit = edits[random_below(NEDITS)];
+		size_t edit_len = strlen(edit);
+		if (len + edit_len >= size) {
+			continue;
+		}
+
+		switch (random_below(3)) {
+		case 0:
+			memmove(query + at + edit_len, query + at,
+					len - at + 1);
+			memcpy(query + at, edit, edit_len);
+			break;
+		case 1:
+			if (at < len) {
+				memmove(query + at, query + at + 1, len - at);
+			}
+			break;
+		default:
+			if (at < len) {
+				memmove(query + at + edit_len,
+						query + at + 1, len - at);
+				memcpy(query + at, edit, edit_len);
+			}
+			break;
+		}
+	}
+}
+
+size_t fold(const char *string, FcChar32 *chars)
+{
+	FcChar8 *folded = FcStrDowncase((const FcChar8 *)string);
+	assert(folded != NULL);
+
+	size_t len = 0;
+	const FcChar8 *utf8 = folded;
+	int nbytes = strlen((const char *)folded);
+	while (nbytes > 0) {
+		assert(len < MAX_CHARS * 2);
+		int n = FcUtf8ToUcs4(utf8, &chars[len++], nbytes);
+		assert(n > 0);
+		utf8 += n;
+		nbytes -= n;
+	}
+
+	FcStrFree(folded);
+	return len;
+}
+
+// Levenshtein distance over the folded code points, with a full matrix
+size_t distance(const char *a, const char *b)
+{
+	static FcChar32 a_chars[MAX_CHARS * 2];
+	static FcChar32 b_chars[MAX_CHARS * 2];
+	static size_t d[MAX_CHARS * 2 + 1][MAX_CHARS * 2 + 1];
+
+	size_t a_len = fold(a, a_chars);
+	size_t b_len = fold(b, b_chars);
+
+	for (size_t i = 0; i <= a_len; ++i) {
+		d[i][0] = i;
+	}
+	for (size_t j = 0; j <= b_len; ++j) {
+		d[0][j] = j;
+	}
+
+	for (size_t i = 1; i <= a_len; ++i) {
+		for (size_t j = 1; j <= b_len; ++j) {
+			size_t cost = d[i - 1][j - 1]
+					+ (a_chars[i - 1] != b_chars[j - 1]);
+			if (d[i - 1][j] + 1 < cost) {
+				cost = d[i - 1][j] + 1;
+			}
+			if (d[i][j - 1] + 1 < cost) {
+				cost = d[i][j - 1] + 1;
+			}
+			d[i][j] = cost;
+		}
+	}
+
+	return d[a_len][b_len];
+}
+
+// Least distance to a string value of `object`, SIZE_MAX without any
+size_t font_distance(FcPattern *font, const char *object, const char *query)
+{
+	size_t least = SIZE_MAX;
+
+	FcValue value;
+	for (int i = 0; FcPatternGet(font, object, i, &value) == FcResultMatch;
+			++i) {
+		if (value.type != FcTypeString) {
+			continue;
+		}
+
+		size_t d = distance((const char *)value.u.s, query);
+		if (d < least) {
+			least = d;
+		}
+	}
+
+	return least;
+}
+
+int compare_ranked(const void *a, const void *b)
+{
+	const Ranked *a_ranked = a;
+	const Ranked *b_ranked = b;
+
+	if (a_ranked->distance != b_ranked->distance) {
+		return a_ranked->distance < b_ranked->distance ? -1 : 1;
+	}
+
+	return a_ranked->pos - b_ranked->pos;
+}
+
+void check_filter(FcFontSet *set, FfIndex *index, const char *object,
+		const char *query, unsigned max_distance)
+{
+	FfCondition *condition = ff_compare_fuzzy(object, query, max_distance);
+	assert(condition != NULL);
+
+	FcFontSet *filtered = ff_condition_filter(condition, set);
+	FcFontSet *indexed = ff_condition_filter_index(condition, index);
+	assert(filtered != NULL && indexed != NULL);
+	assert(font_sets_equal(filtered, indexed));
+
+	int nexpected = 0;
+	for (int i = 0; i < set->nfont; ++i) {
+		FcPattern *font = set->fonts[i];
+		if (font_distance(font, object, query) <= max_distance) {
+			assert(nexpected < filtered->nfont);
+			assert(filtered->fonts[nexpected] == font);
+			++nexpected;
+		}
+	}
+	assert(nexpected == filtered->nfont);
+
+	FcFontSetDestroy(indexed);
+	FcFontSetDestroy(filtered);
+	ff_condition_unref(condition);
+}
+
+void check_search(FcFontSet *set, FfIndex *index, const char *query,
+		unsigned max_distance)
+{
+	Ranked *ranked = malloc(set->nfont * sizeof(*ranked));
+	assert(ranked != NULL);
+
+	int nranked = 0;
+	for (int i = 0; i < set->nfont; ++i) {
+		size_t d = font_distance(set->fonts[i], FC_FAMILY, query);
+		if (d <= max_distance) {
+			ranked[nranked++] = (Ranked){
+				.font = set->fonts[i],
+				.distance = d,
+				.pos = i
+			};
+		}
+	}
+	qsort(ranked, nranked, sizeof(*ranked), compare_ranked);
+
+	FcFontSet *found = ff_index_fuzzy_search(index, query, max_distance);
+	assert(found != NULL);
+	assert(found->nfont == nranked);
+	for (int i = 0; i < nranked; ++i) {
+		assert(found->fonts[i] == ranked[i].font);
+	}
+
+	FcFontSetDestroy(found);
+	free(ranked);
+}
+
+// Fuzzy matches within compositions and lists, where indexed filtering looks
+// prepared results up for each font
+void check_composed(FcFontSet *set, FfIndex *index, const char *query,
+		unsigned max_distance)
+{
+	FfCondition *condition = ff_compose_unref(
+			ff_compare_fuzzy(FC_FAMILY, query, max_distance),
+			random_below(2) == 0 ? FF_AND : FF_OR,
+			random_condition(2));
+	assert(condition != NULL);
+
+	FcFontSet *filtered = ff_condition_filter(condition, set);
+	FcFontSet *indexed = ff_condition_filter_index(condition, index);
+	assert(filtered != NULL && indexed != NULL);
+	assert(font_sets_equal(filtered, indexed));
+	FcFontSetDestroy(indexed);
+	FcFontSetDestroy(filtered);
+
+	FfList list = random_list(random_below(3), 2);
+	assert(ff_list_add(&list, condition));
+	assert(ff_list_add_unref(&list, ff_compare_fuzzy(FC_FAMILY,
+					random_name(), random_below(3))));
+
+	filtered = ff_list_filter(list, set);
+	indexed = ff_list_filter_index(list, index);
+	assert(filtered != NULL && indexed != NULL);
+	assert(font_sets_equal(filtered, indexed));
+	FcFontSetDestroy(indexed);
+	FcFontSetDestroy(filtered);
+
+	filtered = ff_list_filter_soft(list, set);
+	indexed = ff_list_filter_soft_index(list, index);
+	assert(filtered != NULL && indexed != NULL);
+	assert(font_sets_equal(filtered, indexed));
+	FcFontSetDestroy(indexed);
+	FcFontSetDestroy(filtered);
+
+	ff_list_destroy(list);
+	ff_condition_unref(condition);
+}
@@ -0,0 +1,129 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <fontfilter.h>
+
+#include "random.h"
+
+// Checks that grouping partitions the filtered fonts by their keys, and that
+// each group's best font is the one soft filtering the group would keep first
+
+enum {
+	NFONTS = 1000,
+	NLISTS = 100
+};
+
+static const char *const objects[] = { FC_FAMILY, FC_STYLE };
+enum { NOBJECTS = sizeof(objects) / sizeof(*objects) };
+
+static bool has_key(FcPattern *font, FcChar8 *const *key, size_t nobjects);
+static void check_groups(const FfGroupSet *groups, const FcFontSet *filtered,
+		const FfList *best);
+
+int main(void)
+{
+	random_init(29);
+
+	FcFontSet *set = random_font_set(NFONTS);
+
+	for (int i = 0; i < NLISTS; ++i) {
+		FfList list = random_list(1 + random_below(3), 2);
+		FfList best = random_list(random_below(3), 2);
+		const FfList *best_ptr = i % 3 == 0 ? NULL : &best;
+
+		FcFontSet *filtered = ff_list_filter(list, set);
+		FfGroupSet *groups = ff_list_filter_grouped(list, set,
+				objects, NOBJECTS, best_ptr);
+		assert(filtered != NULL && groups != NULL);
+		check_groups(groups, filtered, best_ptr);
+		ff_group_set_destroy(groups);
+		FcFontSetDestroy(filtered);
+
+		FfCondition *condition = random_condition(3);
+		filtered = ff_condition_filter(condition, set);
+		groups = ff_condition_filter_grouped(condition, set, objects,
+				1 + random_below(NOBJECTS), best_ptr);
+		assert(filtered != NULL && groups != NULL);
+		check_groups(groups, filtered, best_ptr);
+		ff_group_set_destroy(groups);
+		FcFontSetDestroy(filtered);
+
+		ff_condition_unref(condition);
+		ff_list_destroy(best);
+		ff_list_destroy(list);
+	}
+
+	FcFontSetDestroy(set);
+	random_fini();
+
+	printf("group: OK\n");
+
+	return 0;
+}
+
+bool has_key(FcPattern *font, FcChar8 *const *key, size_t nobjects)
+{
+	for (size_t i = 0; i < nobjects; ++i) {
+		FcChar8 *string;
+		if (FcPatternGetString(font, objects[i], 0, &string)
+				!= FcResultMatch) {
+			string = NULL;
+		}
+
+		if (string == NULL || key[i] == NULL) {
+			if (string != key[i]) {
+				return false;
+			}
+		} else if (FcStrCmp(string, key[i]) != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Every filtered font must be in exactly one group, which has its key, and
+// groups must keep the fonts' order
+void check_groups(const FfGroupSet *groups, const FcFontSet *filtered,
+		const FfList *best)
+{
+	int nfonts = 0;
+	int prev_first = -1;
+	for (size_t i = 0; i < groups->ngroups; ++i) {
+		const FfGroup *group = &groups->groups[i];
+		assert(group->fonts->nfont > 0);
+		nfonts += group->fonts->nfont;
+
+		int pos = 0;
+		for (int j = 0; j < group->fonts->nfont; ++j) {
+			FcPattern *font = group->fonts->fonts[j];
+			assert(has_key(font, group->key, groups->nobjects));
+
+			while (pos < filtered->nfont
+					&& filtered->fonts[pos] != font) {
+				++pos;
+			}
+			assert(pos < filtered->nfont);
+			if (j == 0) {
+				assert(pos > prev_first);
+				prev_first = pos;
+			}
+		}
+
+		if (best == NULL) {
+			assert(group->best == NULL);
+			continue;
+		}
+
+		FcFontSet *preferred = ff_list_filter_soft(*best, group->fonts);
+		assert(preferred != NULL && preferred->nfont > 0);
+		assert(group->best == preferred->fonts[0]);
+		FcFontSetDestroy(preferred);
+	}
+
+	assert(nfonts == filtered->nfont);
+}
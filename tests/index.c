@@ -0,0 +1,123 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <fontfilter.h>
+
+#include "random.h"
+
+// Checks that filtering through an index, which takes shortcuts through the
+// data precomputed for every font, gives the same fonts as plain filtering
+
+enum {
+	NFONTS = 2000,
+	NCONDITIONS = 300,
+	NLISTS = 100
+};
+
+static void check_condition(FfCondition *condition, FcFontSet *set,
+		FfIndex *index);
+static void check_list(FfList list, FcFontSet *set, FfIndex *index);
+static void test_charsets(FcFontSet *set, FfIndex *index);
+static void test_random_conditions(FcFontSet *set, FfIndex *index);
+
+int main(void)
+{
+	random_init(27);
+
+	FcFontSet *set = random_font_set(NFONTS);
+	FfIndex *index = ff_index_create(set);
+	assert(index != NULL);
+
+	test_charsets(set, index);
+	test_random_conditions(set, index);
+
+	ff_index_destroy(index);
+	FcFontSetDestroy(set);
+	random_fini();
+
+	printf("index: OK\n");
+
+	return 0;
+}
+
+void check_condition(FfCondition *condition, FcFontSet *set, FfIndex *index)
+{
+	FcFontSet *expected = ff_condition_filter(condition, set);
+	FcFontSet *filtered = ff_condition_filter_index(condition, index);
+	assert(expected != NULL && filtered != NULL);
+	assert(font_sets_equal(filtered, expected));
+
+	FcFontSetDestroy(filtered);
+	FcFontSetDestroy(expected);
+}
+
+void check_list(FfList list, FcFontSet *set, FfIndex *index)
+{
+	FcFontSet *expected = ff_list_filter(list, set);
+	FcFontSet *filtered = ff_list_filter_index(list, index);
+	assert(expected != NULL && filtered != NULL);
+	assert(font_sets_equal(filtered, expected));
+
+	FcFontSetDestroy(filtered);
+	FcFontSetDestroy(expected);
+
+	expected = ff_list_filter_soft(list, set);
+	filtered = ff_list_filter_soft_index(list, index);
+	assert(expected != NULL && filtered != NULL);
+	assert(font_sets_equal(filtered, expected));
+
+	FcFontSetDestroy(filtered);
+	FcFontSetDestroy(expected);
+}
+
+// Required charsets of every size, including the fonts' own charsets (which
+// their fonts contain) and charsets spanning many pages
+void test_charsets(FcFontSet *set, FfIndex *index)
+{
+	for (int i = 0; i < NCONDITIONS; ++i) {
+		FcCharSet *charset;
+		if (i % 3 == 0) {
+			FcPattern *font = set->fonts[random_below(set->nfont)];
+			FcCharSet *font_charset;
+			if (FcPatternGetCharSet(font, FC_CHARSET, 0,
+						&font_charset)
+					!= FcResultMatch) {
+				continue;
+			}
+			charset = FcCharSetCopy(font_charset);
+		} else {
+			charset = random_charset(random_below(200));
+		}
+		assert(charset != NULL);
+
+		FfRelationalOperator oper = i % 2 == 0 ? FF_CONTAINS
+				: FF_DOES_NOT_CONTAIN;
+		FfCondition *condition = ff_compare(FC_CHARSET, oper,
+				FcTypeCharSet, charset);
+		assert(condition != NULL);
+
+		check_condition(condition, set, index);
+
+		ff_condition_unref(condition);
+		FcCharSetDestroy(charset);
+	}
+}
+
+void test_random_conditions(FcFontSet *set, FfIndex *index)
+{
+	for (int i = 0; i < NCONDITIONS; ++i) {
+		FfCondition *condition = random_condition(4);
+		check_condition(condition, set, index);
+		ff_condition_unref(condition);
+	}
+
+	for (int i = 0; i < NLISTS; ++i) {
+		FfList list = random_list(1 + random_below(5), 2);
+		check_list(list, set, index);
+		ff_list_destroy(list);
+	}
+}
@@ -0,0 +1,142 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <fontfilter.h>
+
+#include "random.h"
+
+// Checks that language requirements, which an index tests through a bitset of
+// the languages fontconfig knows, select the same fonts as testing langsets
+
+enum {
+	NFONTS = 2000,
+	NCONDITIONS = 300,
+	MAX_LANGS = 4
+};
+
+static void check_condition(FfCondition *condition, FcFontSet *set,
+		FfIndex *index);
+static const char *random_tag(void);
+static void test_single_langs(FcFontSet *set, FfIndex *index);
+static void test_lang_lists(FcFontSet *set, FfIndex *index);
+
+// Tags which are spelled differently from fontconfig's, which fontconfig
+// doesn't know, or which aren't valid at all
+static const char *const odd_tags[] = {
+	"EN",
+	"zh_CN",
+	"zh-TW.UTF-8",
+	"de_DE@euro",
+	"x-foo",
+	"xx",
+	"e",
+	""
+};
+enum { NODD_TAGS = sizeof(odd_tags) / sizeof(*odd_tags) };
+
+int main(void)
+{
+	random_init(28);
+
+	FcFontSet *set = random_font_set(NFONTS);
+	FfIndex *index = ff_index_create(set);
+	assert(index != NULL);
+
+	test_single_langs(set, index);
+	test_lang_lists(set, index);
+
+	ff_index_destroy(index);
+	FcFontSetDestroy(set);
+	random_fini();
+
+	printf("lang: OK\n");
+
+	return 0;
+}
+
+void check_condition(FfCondition *condition, FcFontSet *set, FfIndex *index)
+{
+	FcFontSet *expected = ff_condition_filter(condition, set);
+	FcFontSet *filtered = ff_condition_filter_index(condition, index);
+	assert(expected != NULL && filtered != NULL);
+	assert(font_sets_equal(filtered, expected));
+
+	FcFontSetDestroy(filtered);
+	FcFontSetDestroy(expected);
+}
+
+const char *random_tag(void)
+{
+	return random_below(3) == 0 ? odd_tags[random_below(NODD_TAGS)]
+			: random_lang();
+}
+
+// A single language is required exactly when a font's langset has it
+void test_single_langs(FcFontSet *set, FfIndex *index)
+{
+	for (unsigned i = 0; i < NODD_TAGS; ++i) {
+		FfCondition *condition = ff_require_lang(odd_tags[i]);
+		assert(condition != NULL);
+		check_condition(condition, set, index);
+		ff_condition_unref(condition);
+	}
+
+	for (int i = 0; i < NCONDITIONS / 10; ++i) {
+		const char *lang = random_lang();
+		FfCondition *condition = ff_require_lang(lang);
+		assert(condition != NULL);
+
+		FcFontSet *filtered = ff_condition_filter_index(condition,
+				index);
+		assert(filtered != NULL);
+
+		int nexpected = 0;
+		for (int j = 0; j < set->nfont; ++j) {
+			FcLangSet *langset;
+			if (FcPatternGetLangSet(set->fonts[j], FC_LANG, 0,
+						&langset)
+					== FcResultMatch
+					&& FcLangSetHasLang(langset,
+						(const FcChar8 *)lang)
+					== FcLangEqual) {
+				assert(nexpected < filtered->nfont);
+				assert(filtered->fonts[nexpected]
+						== set->fonts[j]);
+				++nexpected;
+			}
+		}
+		assert(nexpected == filtered->nfont);
+
+		FcFontSetDestroy(filtered);
+		ff_condition_unref(condition);
+	}
+}
+
+void test_lang_lists(FcFontSet *set, FfIndex *index)
+{
+	for (int i = 0; i < NCONDITIONS; ++i) {
+		const char *langs[MAX_LANGS];
+		size_t nlangs = random_below(MAX_LANGS + 1);
+		for (size_t j = 0; j < nlangs; ++j) {
+			langs[j] = random_tag();
+		}
+
+		FfCondition *condition = i % 2 == 0
+				? ff_require_any_lang(langs, nlangs)
+				: ff_require_all_langs(langs, nlangs);
+		assert(condition != NULL);
+
+		if (random_below(2) == 0) {
+			condition = ff_compose_unref(condition, FF_AND,
+					random_condition(2));
+			assert(condition != NULL);
+		}
+
+		check_condition(condition, set, index);
+		ff_condition_unref(condition);
+	}
+}
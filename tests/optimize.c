@@ -0,0 +1,279 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <fontfilter.h>
+
+// Checks that `ff_condition_optimize()` returns equivalent conditions by
+// testing random conditions before and after optimizing against random fonts
+
+enum {
+	NFONTS = 400,
+	NCONDITIONS = 3000,
+	MAX_DEPTH = 5,
+	NMAX_SHARED = 64
+};
+
+static unsigned random_below(unsigned n);
+static FcFontSet *random_font_set(int nfonts);
+static FcPattern *random_font(void);
+static FfCondition *random_condition(int depth);
+static FfCondition *random_leaf(void);
+static FfLogicalOperator random_operator(void);
+static void clear_shared(void);
+static void test_equivalence(void);
+static void test_interval_merging(void);
+static void test_long_chain(void);
+
+static const char *const families[] = {
+	"DejaVu Sans",
+	"DejaVu Sans Mono",
+	"Noto Serif",
+	"Noto Sans CJK JP",
+	"Liberation Mono",
+	"Sans"
+};
+enum { NFAMILIES = sizeof(families) / sizeof(*families) };
+
+static const int slants[] = {
+	FC_SLANT_ROMAN,
+	FC_SLANT_ITALIC,
+	FC_SLANT_OBLIQUE
+};
+
+// Conditions which random conditions may share as subtrees
+static size_t nshared;
+static FfCondition *shared[NMAX_SHARED];
+
+int main(void)
+{
+	srand(26);
+
+	test_equivalence();
+	test_interval_merging();
+	test_long_chain();
+
+	printf("optimize: OK\n");
+
+	return 0;
+}
+
+unsigned random_below(unsigned n)
+{
+	return (unsigned)rand() % n;
+}
+
+FcFontSet *random_font_set(int nfonts)
+{
+	FcFontSet *set = FcFontSetCreate();
+	assert(set != NULL);
+
+	for (int i = 0; i < nfonts; ++i) {
+		assert(FcFontSetAdd(set, random_font()));
+	}
+
+	return set;
+}
+
+FcPattern *random_font(void)
+{
+	FcPattern *font = FcPatternCreate();
+	assert(font != NULL);
+
+	switch (random_below(4)) {
+	case 0:
+		FcPatternAddInteger(font, FC_WEIGHT, random_below(250));
+		break;
+	case 1:
+		FcPatternAddDouble(font, FC_WEIGHT, random_below(250) + 0.5);
+		break;
+	case 2:
+		FcPatternAddInteger(font, FC_WEIGHT,
+				(int []){ 0, 80, 200, 210 }[random_below(4)]);
+		break;
+	default:
+		break;
+	}
+
+	if (random_below(4) != 0) {
+		FcPatternAddInteger(font, FC_SLANT,
+				slants[random_below(3)]);
+	}
+
+	if (random_below(4) != 0) {
+		FcPatternAddInteger(font, FC_WIDTH, 50 + random_below(150));
+	}
+
+	unsigned nfamilies = random_below(3);
+	for (unsigned i = 0; i < nfamilies; ++i) {
+		FcPatternAddString(font, FC_FAMILY, (const FcChar8 *)
+				families[random_below(NFAMILIES)]);
+	}
+
+	if (random_below(5) != 0) {
+		FcCharSet *charset = FcCharSetCreate();
+		assert(charset != NULL);
+
+		unsigned nchars = random_below(40);
+		for (unsigned i = 0; i < nchars; ++i) {
+			FcCharSetAddChar(charset, random_below(0x3000));
+		}
+
+		FcPatternAddCharSet(font, FC_CHARSET, charset);
+		FcCharSetDestroy(charset);
+	}
+
+	return font;
+}
+
+FfCondition *random_condition(int depth)
+{
+	if (nshared > 0 && random_below(5) == 0) {
+		return ff_condition_ref(shared[random_below(nshared)]);
+	}
+
+	FfCondition *condition;
+	if (depth == 0 || random_below(3) == 0) {
+		condition = random_leaf();
+	} else {
+		FfCondition *p = random_condition(depth - 1);
+		FfCondition *q = random_below(6) == 0 ? ff_condition_ref(p)
+				: random_condition(depth - 1);
+
+		FfLogicalOperator oper;
+		if (random_below(8) == 0) {
+			oper = FF_NOT_P;
+		} else if (random_below(3) == 0) {
+			oper = random_operator();
+		} else {
+			oper = random_below(2) == 0 ? FF_AND : FF_OR;
+		}
+
+		condition = ff_compose_unref(p, oper, q);
+	}
+	assert(condition != NULL);
+
+	if (nshared < NMAX_SHARED) {
+		shared[nshared++] = ff_condition_ref(condition);
+	}
+
+	return condition;
+}
+
+FfCondition *random_leaf(void)
+{
+	switch (random_below(7)) {
+	case 0:
+		return ff_compare(FC_WEIGHT, random_below(10), FcTypeInteger,
+				(int)random_below(250));
+	case 1:
+		return ff_compare(FC_WEIGHT, random_below(6), FcTypeDouble,
+				random_below(250) + 0.5);
+	case 2:
+		return ff_compare(FC_SLANT, random_below(6), FcTypeInteger,
+				slants[random_below(3)]);
+	case 3:
+		return ff_compare(FC_FAMILY, random_below(10), FcTypeString,
+				(const FcChar8 *)families[
+					random_below(NFAMILIES)]);
+	case 4:
+		return ff_require_char(random_below(0x3000));
+	case 5:
+		return ff_constant(random_below(2));
+	default:
+		return ff_compare(FC_WIDTH, FF_LESS_THAN + random_below(4),
+				FcTypeInteger, 50 + (int)random_below(150));
+	}
+}
+
+FfLogicalOperator random_operator(void)
+{
+	unsigned bits = random_below(16);
+
+	return (FfLogicalOperator){
+		.pt_qt = bits & 8,
+		.pt_qf = bits & 4,
+		.pf_qt = bits & 2,
+		.pf_qf = bits & 1
+	};
+}
+
+void clear_shared(void)
+{
+	for (size_t i = 0; i < nshared; ++i) {
+		ff_condition_unref(shared[i]);
+	}
+
+	nshared = 0;
+}
+
+void test_equivalence(void)
+{
+	FcFontSet *set = random_font_set(NFONTS);
+
+	for (int i = 0; i < NCONDITIONS; ++i) {
+		FfCondition *condition = random_condition(MAX_DEPTH);
+		FfCondition *optimized = ff_condition_optimize(condition);
+		assert(optimized != NULL);
+
+		for (int j = 0; j < set->nfont; ++j) {
+			FcPattern *font = set->fonts[j];
+			assert(ff_condition_test_fc_pattern(condition, font)
+					== ff_condition_test_fc_pattern(
+						optimized, font));
+		}
+
+		ff_condition_unref(optimized);
+		ff_condition_unref(condition);
+		clear_shared();
+	}
+
+	FcFontSetDestroy(set);
+}
+
+void test_interval_merging(void)
+{
+	FfCondition *condition = ff_compose_unref(
+			ff_compare(FC_WEIGHT, FF_GREATER_THAN_EQUAL,
+				FcTypeInteger, FC_WEIGHT_BOLD),
+			FF_AND,
+			ff_compare(FC_WEIGHT, FF_LESS_THAN_EQUAL,
+				FcTypeInteger, FC_WEIGHT_HEAVY));
+
+	FfCondition *optimized = ff_condition_optimize(condition);
+	assert(optimized != NULL);
+	assert(optimized->type == FF_INTERVAL);
+
+	ff_condition_unref(optimized);
+	ff_condition_unref(condition);
+}
+
+// A long chain with duplicates must collapse to its distinct literals
+void test_long_chain(void)
+{
+	FfCondition *condition = ff_require_char(0);
+	for (FcChar32 c = 1; c < 4000; ++c) {
+		condition = ff_compose_unref(condition, FF_AND,
+				ff_require_char(c % 1000));
+		assert(condition != NULL);
+	}
+
+	FfCondition *optimized = ff_condition_optimize(condition);
+	assert(optimized != NULL);
+
+	size_t nliterals = 1;
+	for (FfCondition *chain = optimized;
+			chain->type == FF_COMPOSITION;
+			chain = chain->value.composition.p) {
+		assert(chain->value.composition.q->type
+				== FF_CHAR_REQUIREMENT);
+		++nliterals;
+	}
+	assert(nliterals == 1000);
+
+	ff_condition_unref(optimized);
+	ff_condition_unref(condition);
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include "random.h"
+
+static const char *const families[] = {
+	"DejaVu Sans",
+	"DejaVu Sans Mono",
+	"Noto Serif",
+	"Noto Sans CJK JP",
+	"Liberation Mono",
+	"Sans",
+	"Serif Pro"
+};
+enum { NFAMILIES = sizeof(families) / sizeof(*families) };
+
+static const char *const styles[] = {
+	"Regular",
+	"Bold",
+	"Italic",
+	"Bold Italic"
+};
+enum { NSTYLES = sizeof(styles) / sizeof(*styles) };
+
+// "xx" is valid but unknown to fontconfig
+static const char *const langs[] = {
+	"en",
+	"ja",
+	"ko",
+	"zh-cn",
+	"zh-tw",
+	"de",
+	"ru",
+	"xx"
+};
+enum { NLANGS = sizeof(langs) / sizeof(*langs) };
+
+static const int slants[] = {
+	FC_SLANT_ROMAN,
+	FC_SLANT_ITALIC,
+	FC_SLANT_OBLIQUE
+};
+enum { NSLANTS = sizeof(slants) / sizeof(*slants) };
+
+enum { NCHARSETS = 16 };
+
+// Conditions only borrow their charsets, so conditions' charsets are picked
+// from these
+static FcCharSet *charsets[NCHARSETS];
+
+void random_init(unsigned seed)
+{
+	srand(seed);
+
+	for (size_t i = 0; i < NCHARSETS; ++i) {
+		charsets[i] = random_charset(1 + random_below(3));
+	}
+}
+
+void random_fini(void)
+{
+	for (size_t i = 0; i < NCHARSETS; ++i) {
+		FcCharSetDestroy(charsets[i]);
+		charsets[i] = NULL;
+	}
+}
+
+unsigned random_below(unsigned n)
+{
+	return (unsigned)rand() % n;
+}
+
+FcPattern *random_font(void)
+{
+	FcPattern *font = FcPatternCreate();
+	assert(font != NULL);
+
+	switch (random_below(5)) {
+	case 0:
+		FcPatternAddInteger(font, FC_WEIGHT, random_below(250));
+		break;
+	case 1:
+		FcPatternAddDouble(font, FC_WEIGHT, random_below(250) + 0.5);
+		break;
+	case 2: {
+		FcRange *range = FcRangeCreateDouble(random_below(100),
+				100 + random_below(150));
+		assert(range != NULL);
+		FcPatternAddRange(font, FC_WEIGHT, range);
+		FcRangeDestroy(range);
+		break;
+	}
+	case 3:
+		FcPatternAddInteger(font, FC_WEIGHT,
+				(int []){ 0, 80, 200, 210 }[random_below(4)]);
+		break;
+	default:
+		break;
+	}
+
+	if (random_below(4) != 0) {
+		FcPatternAddInteger(font, FC_SLANT,
+				slants[random_below(NSLANTS)]);
+	}
+
+	if (random_below(4) != 0) {
+		FcPatternAddInteger(font, FC_WIDTH, 50 + random_below(150));
+	}
+
+	unsigned nfamilies = random_below(3);
+	for (unsigned i = 0; i < nfamilies; ++i) {
+		FcPatternAddString(font, FC_FAMILY,
+				(const FcChar8 *)random_family());
+	}
+
+	if (random_below(2) != 0) {
+		FcPatternAddString(font, FC_STYLE, (const FcChar8 *)
+				styles[random_below(NSTYLES)]);
+	}
+
+	if (random_below(5) != 0) {
+		FcCharSet *charset = random_charset(random_below(40));
+		FcPatternAddCharSet(font, FC_CHARSET, charset);
+		FcCharSetDestroy(charset);
+	}
+
+	if (random_below(3) != 0) {
+		FcLangSet *langset = FcLangSetCreate();
+		assert(langset != NULL);
+
+		unsigned nlangs = random_below(4);
+		for (unsigned i = 0; i < nlangs; ++i) {
+			FcLangSetAdd(langset, (const FcChar8 *)random_lang());
+		}
+
+		FcPatternAddLangSet(font, FC_LANG, langset);
+		FcLangSetDestroy(langset);
+	}
+
+	char file[32];
+	snprintf(file, sizeof(file), "/fonts/%u.ttf", random_below(50));
+	FcPatternAddString(font, FC_FILE, (const FcChar8 *)file);
+	FcPatternAddInteger(font, FC_INDEX, random_below(2));
+
+	return font;
+}
+
+FcFontSet *random_font_set(int nfonts)
+{
+	FcFontSet *set = FcFontSetCreate();
+	assert(set != NULL);
+
+	for (int i = 0; i < nfonts; ++i) {
+		assert(FcFontSetAdd(set, random_font()));
+	}
+
+	return set;
+}
+
+FfCondition *random_leaf(void)
+{
+	FfCondition *condition;
+
+	switch (random_below(10)) {
+	case 0:
+		condition = ff_compare(FC_WEIGHT, random_below(10),
+				FcTypeInteger, (int)random_below(250));
+		break;
+	case 1:
+		condition = ff_compare(FC_WEIGHT, random_below(6),
+				FcTypeDouble, random_below(250) + 0.5);
+		break;
+	case 2:
+		condition = ff_compare(FC_SLANT, random_below(6),
+				FcTypeInteger, slants[random_below(NSLANTS)]);
+		break;
+	case 3:
+		condition = ff_compare(FC_FAMILY, random_below(10),
+				FcTypeString,
+				(const FcChar8 *)random_family());
+		break;
+	case 4:
+		condition = ff_require_char(random_below(0x3000));
+		break;
+	case 5:
+		condition = ff_constant(random_below(2));
+		break;
+	case 6:
+		condition = ff_require_lang(random_lang());
+		break;
+	case 7:
+		condition = ff_compare(FC_CHARSET,
+				random_below(2) == 0 ? FF_CONTAINS
+					: FF_DOES_NOT_CONTAIN,
+				FcTypeCharSet,
+				charsets[random_below(NCHARSETS)]);
+		break;
+	default:
+		condition = ff_compare(FC_WIDTH,
+				FF_LESS_THAN + random_below(4), FcTypeInteger,
+				50 + (int)random_below(150));
+		break;
+	}
+	assert(condition != NULL);
+
+	return condition;
+}
+
+FfCondition *random_condition(int depth)
+{
+	if (depth == 0 || random_below(3) == 0) {
+		return random_leaf();
+	}
+
+	FfCondition *p = random_condition(depth - 1);
+	FfCondition *q = random_condition(depth - 1);
+
+	FfLogicalOperator oper = random_below(2) == 0 ? FF_AND : FF_OR;
+	if (random_below(8) == 0) {
+		oper = FF_NOT_P;
+	}
+
+	FfCondition *condition = ff_compose_unref(p, oper, q);
+	assert(condition != NULL);
+
+	return condition;
+}
+
+FfList random_list(size_t len, int depth)
+{
+	int status;
+	FfList list = ff_list_create(&status);
+	assert(status == FF_SUCCESS);
+
+	for (size_t i = 0; i < len; ++i) {
+		assert(ff_list_add_unref(&list, random_condition(depth)));
+	}
+
+	return list;
+}
+
+FcCharSet *random_charset(unsigned nchars)
+{
+	FcCharSet *charset = FcCharSetCreate();
+	assert(charset != NULL);
+
+	for (unsigned i = 0; i < nchars; ++i) {
+		FcChar32 c = random_below(4) != 0 ? random_below(0x3000)
+				: random_below(0x20000);
+		FcCharSetAddChar(charset, c);
+	}
+
+	return charset;
+}
+
+const char *random_lang(void)
+{
+	return langs[random_below(NLANGS)];
+}
+
+const char *random_family(void)
+{
+	return families[random_below(NFAMILIES)];
+}
+
+bool font_sets_equal(const FcFontSet *a, const FcFontSet *b)
+{
+	if (a->nfont != b->nfont) {
+		return false;
+	}
+
+	for (int i = 0; i < a->nfont; ++i) {
+		if (a->fonts[i] != b->fonts[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,51 @@
+#ifndef fontfilter_tests_random_h
+#define fontfilter_tests_random_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <fontfilter.h>
+
+// Random fonts and conditions shared by the tests
+
+/// Seeds `rand()`, so that failures can be reproduced, and creates the charsets
+/// which random conditions refer to.
+void random_init(unsigned seed);
+
+/// Destroys the charsets created by `random_init()`.
+void random_fini(void);
+
+/// Returns a number in [0, n).
+unsigned random_below(unsigned n);
+
+/// Creates a font with random values for a few properties (some of them
+/// multi-valued, some of them missing), a charset, a langset and a file.
+FcPattern *random_font(void);
+
+/// Creates a set of `nfonts` random fonts.
+FcFontSet *random_font_set(int nfonts);
+
+/// Creates a random comparison (some of them quantified), char or language
+/// requirement, or constant.
+FfCondition *random_leaf(void);
+
+/// Creates a random composition of leaves, at most `depth` levels deep.
+FfCondition *random_condition(int depth);
+
+/// Creates a list of `len` random conditions.
+FfList random_list(size_t len, int depth);
+
+/// Returns a random charset, with code points mostly below 0x3000.
+FcCharSet *random_charset(unsigned nchars);
+
+/// Returns one of the language tags fonts are given (or one which they never
+/// are).
+const char *random_lang(void);
+
+/// Returns one of the family names fonts are given.
+const char *random_family(void);
+
+/// Whether `a` and `b` hold the same patterns in the same order.
+bool font_sets_equal(const FcFontSet *a, const FcFontSet *b);
+
+#endif // fontfilter_tests_random_h
@@ -0,0 +1,233 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <fontfilter.h>
+
+#include "random.h"
+
+// Checks that finding the fonts whose ranges contain a value or range through
+// the index's interval trees, and indexed filtering with containment, give the
+// same fonts as plain filtering
+
+enum {
+	NFONTS = 2000,
+	NQUERIES = 300,
+	SPAN = 1000
+};
+
+// The properties with interval trees, and one without (which fontconfig
+// doesn't know, so that it accepts ranges)
+static const char *const objects[] = {
+	FC_WEIGHT,
+	FC_WIDTH,
+	FC_SIZE,
+	"rangetest"
+};
+enum { NOBJECTS = sizeof(objects) / sizeof(*objects) };
+
+static double random_bound(void);
+static void add_random_value(FcPattern *font, const char *object);
+static FcFontSet *range_font_set(int nfonts);
+static FcFontSet *filter_containing(FcFontSet *set, const char *object,
+		FcValue value);
+static void check_containing(FcFontSet *set, FfIndex *index,
+		const char *object, double value);
+static void check_covering(FcFontSet *set, FfIndex *index, const char *object,
+		double from, double to);
+static void check_indexed(FcFontSet *set, FfIndex *index, const char *object,
+		FcValue value);
+
+int main(void)
+{
+	random_init(36);
+
+	FcFontSet *set = range_font_set(NFONTS);
+	FfIndex *index = ff_index_create(set);
+	assert(index != NULL);
+
+	for (int i = 0; i < NQUERIES; ++i) {
+		const char *object = objects[random_below(NOBJECTS)];
+		double from = random_bound();
+		double to = random_bound();
+
+		check_containing(set, index, object, from);
+
+		switch (random_below(4)) {
+		case 0:
+			// Empty
+			check_covering(set, index, object, fmax(from, to) + 1,
+					fmin(from, to));
+			break;
+		case 1:
+			check_covering(set, index, object, from, from);
+			break;
+		case 2:
+			check_covering(set, index, object, 0, SPAN);
+			break;
+		default:
+			check_covering(set, index, object, fmin(from, to),
+					fmax(from, to));
+			break;
+		}
+	}
+
+	// Outside every font's values
+	for (int i = 0; i < NOBJECTS; ++i) {
+		check_containing(set, index, objects[i], -1);
+		check_containing(set, index, objects[i], SPAN + 1);
+		check_covering(set, index, objects[i], -INFINITY, INFINITY);
+	}
+
+	ff_index_destroy(index);
+	FcFontSetDestroy(set);
+	random_fini();
+
+	printf("range: OK\n");
+
+	return 0;
+}
+
+// Mostly on a coarse grid, so that bounds are often shared
+double random_bound(void)
+{
+	return random_below(2) == 0 ? random_below(SPAN / 50 + 1) * 50.0
+			: random_below(SPAN) + 0.5;
+}
+
+// A real, or an empty, point, full-span or random range
+void add_random_value(FcPattern *font, const char *object)
+{
+	double from = random_bound();
+	double to = random_bound();
+
+	FcRange *range;
+	switch (random_below(8)) {
+	case 0:
+		FcPatternAddInteger(font, object, (int)from);
+		return;
+	case 1:
+		FcPatternAddDouble(font, object, from);
+		return;
+	case 2:
+		range = FcRangeCreateDouble(fmax(from, to) + 1,
+				fmin(from, to));
+		break;
+	case 3:
+		range = FcRangeCreateDouble(from, from);
+		break;
+	case 4:
+		range = FcRangeCreateDouble(0, SPAN);
+		break;
+	default:
+		range = FcRangeCreateDouble(fmin(from, to), fmax(from, to));
+		break;
+	}
+	assert(range != NULL);
+
+	FcPatternAddRange(font, object, range);
+	FcRangeDestroy(range);
+}
+
+// Fonts with up to two values of each property, of which only the first is
+// indexed
+FcFontSet *range_font_set(int nfonts)
+{
+	FcFontSet *set = FcFontSetCreate();
+	assert(set != NULL);
+
+	for (int i = 0; i < nfonts; ++i) {
+		FcPattern *font = FcPatternCreate();
+		assert(font != NULL);
+
+		for (int j = 0; j < NOBJECTS; ++j) {
+			unsigned nvalues = random_below(3);
+			for (unsigned k = 0; k < nvalues; ++k) {
+				add_random_value(font, objects[j]);
+			}
+		}
+
+		assert(FcFontSetAdd(set, font));
+	}
+
+	return set;
+}
+
+FcFontSet *filter_containing(FcFontSet *set, const char *object,
+		FcValue value)
+{
+	int status;
+	FfList list = ff_list_create(&status);
+	assert(status == FF_SUCCESS);
+	assert(ff_list_add_unref(&list, ff_compare_value(object, FF_CONTAINS,
+					value)));
+
+	FcFontSet *filtered = ff_list_filter(list, set);
+	assert(filtered != NULL);
+
+	ff_list_destroy(list);
+	return filtered;
+}
+
+void check_containing(FcFontSet *set, FfIndex *index, const char *object,
+		double value)
+{
+	FcValue query = { .type = FcTypeDouble, .u.d = value };
+	FcFontSet *expected = filter_containing(set, object, query);
+
+	FcFontSet *found = ff_index_find_containing(index, object, value);
+	assert(found != NULL);
+	assert(font_sets_equal(found, expected));
+
+	FcFontSetDestroy(found);
+	FcFontSetDestroy(expected);
+
+	check_indexed(set, index, object, query);
+}
+
+void check_covering(FcFontSet *set, FfIndex *index, const char *object,
+		double from, double to)
+{
+	FcRange *range = FcRangeCreateDouble(from, to);
+	assert(range != NULL);
+
+	FcValue query = { .type = FcTypeRange, .u.r = range };
+	FcFontSet *expected = filter_containing(set, object, query);
+
+	FcFontSet *found = ff_index_find_covering(index, object, from, to);
+	assert(found != NULL);
+	assert(font_sets_equal(found, expected));
+
+	FcFontSetDestroy(found);
+	FcFontSetDestroy(expected);
+
+	check_indexed(set, index, object, query);
+
+	FcRangeDestroy(range);
+}
+
+// Containment (and its negation) alone and among other conditions
+void check_indexed(FcFontSet *set, FfIndex *index, const char *object,
+		FcValue value)
+{
+	for (int i = 0; i < 2; ++i) {
+		FfRelationalOperator oper = i == 0 ? FF_CONTAINS
+				: FF_DOES_NOT_CONTAIN;
+
+		FfList list = random_list(random_below(3), 2);
+		assert(ff_list_add_unref(&list,
+					ff_compare_value(object, oper, value)));
+
+		FcFontSet *expected = ff_list_filter(list, set);
+		FcFontSet *filtered = ff_list_filter_index(list, index);
+		assert(expected != NULL && filtered != NULL);
+		assert(font_sets_equal(filtered, expected));
+
+		FcFontSetDestroy(filtered);
+		FcFontSetDestroy(expected);
+		ff_list_destroy(list);
+	}
+}
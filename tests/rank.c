@@ -0,0 +1,116 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <fontfilter.h>
+
+#include "random.h"
+
+// Checks `ff_list_rank()` against scoring every font and sorting them all,
+// with weights that make many fonts tie
+
+enum {
+	NFONTS = 500,
+	NLISTS = 200,
+	MAX_LEN = 6
+};
+
+typedef struct Scored {
+	FcPattern *font;
+	double score;
+	int pos;
+} Scored;
+
+static int compare_scored(const void *a, const void *b);
+static void check_rank(FfList list, const double *weights, FcFontSet *set,
+		size_t k);
+
+int main(void)
+{
+	random_init(30);
+
+	FcFontSet *set = random_font_set(NFONTS);
+
+	for (int i = 0; i < NLISTS; ++i) {
+		size_t len = random_below(MAX_LEN + 1);
+		FfList list = random_list(len, 2);
+
+		double weights[MAX_LEN];
+		for (size_t j = 0; j < len; ++j) {
+			// Few distinct scores, some of them negative
+			weights[j] = (int)random_below(4) - 1;
+		}
+
+		size_t ks[] = {
+			0,
+			1,
+			1 + random_below(20),
+			random_below(NFONTS),
+			NFONTS,
+			NFONTS + 10
+		};
+		for (size_t j = 0; j < sizeof(ks) / sizeof(*ks); ++j) {
+			check_rank(list, weights, set, ks[j]);
+			check_rank(list, NULL, set, ks[j]);
+		}
+
+		ff_list_destroy(list);
+	}
+
+	FcFontSetDestroy(set);
+	random_fini();
+
+	printf("rank: OK\n");
+
+	return 0;
+}
+
+int compare_scored(const void *a, const void *b)
+{
+	const Scored *a_scored = a;
+	const Scored *b_scored = b;
+
+	if (a_scored->score != b_scored->score) {
+		return a_scored->score > b_scored->score ? -1 : 1;
+	}
+
+	return a_scored->pos - b_scored->pos;
+}
+
+void check_rank(FfList list, const double *weights, FcFontSet *set, size_t k)
+{
+	Scored *scored = malloc(set->nfont * sizeof(*scored));
+	assert(scored != NULL);
+
+	for (int i = 0; i < set->nfont; ++i) {
+		double score = 0;
+		for (size_t j = 0; j < list.len; ++j) {
+			if (ff_condition_test_fc_pattern(list.conditions[j],
+						set->fonts[i])) {
+				score += weights == NULL ? 1 : weights[j];
+			}
+		}
+
+		scored[i] = (Scored){
+			.font = set->fonts[i],
+			.score = score,
+			.pos = i
+		};
+	}
+	qsort(scored, set->nfont, sizeof(*scored), compare_scored);
+
+	FcFontSet *ranked = ff_list_rank(list, weights, set, k);
+	assert(ranked != NULL);
+
+	size_t nexpected = k < (size_t)set->nfont ? k : (size_t)set->nfont;
+	assert((size_t)ranked->nfont == nexpected);
+	for (size_t i = 0; i < nexpected; ++i) {
+		assert(ranked->fonts[i] == scored[i].font);
+	}
+
+	FcFontSetDestroy(ranked);
+	free(scored);
+}
@@ -0,0 +1,197 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <fontfilter.h>
+
+#include "random.h"
+
+// Checks that filtering several font sets in one scan gives the same fonts as
+// filtering their union, without the fonts whose file and index came before
+
+enum {
+	NROUNDS = 200,
+	MAX_SETS = 4,
+	MAX_FONTS = 60
+};
+
+static FcFontSet *random_member_set(void);
+static bool same_file(FcPattern *a, FcPattern *b);
+static bool seen_before(FcFontSet **sets, size_t i, int j);
+static FcFontSet *dedup_union(FcFontSet **sets, size_t nsets);
+static void check_sets(FcFontSet **sets, size_t nsets);
+
+int main(void)
+{
+	random_init(37);
+
+	for (int i = 0; i < NROUNDS; ++i) {
+		FcFontSet *sets[MAX_SETS];
+		size_t nsets = random_below(MAX_SETS + 1);
+		for (size_t j = 0; j < nsets; ++j) {
+			sets[j] = random_member_set();
+		}
+
+		// An empty first set, and every set empty, in some rounds
+		if (nsets > 0 && i % 4 == 0) {
+			if (sets[0] != NULL) {
+				FcFontSetDestroy(sets[0]);
+			}
+			sets[0] = FcFontSetCreate();
+			assert(sets[0] != NULL);
+		}
+		if (i % 10 == 0) {
+			for (size_t j = 0; j < nsets; ++j) {
+				if (sets[j] != NULL) {
+					FcFontSetDestroy(sets[j]);
+				}
+				sets[j] = FcFontSetCreate();
+				assert(sets[j] != NULL);
+			}
+		}
+
+		check_sets(sets, nsets);
+
+		for (size_t j = 0; j < nsets; ++j) {
+			if (sets[j] != NULL) {
+				FcFontSetDestroy(sets[j]);
+			}
+		}
+	}
+
+	random_fini();
+
+	printf("sets: OK\n");
+
+	return 0;
+}
+
+// A random set (or NULL), whose fonts share files with each other and with
+// other sets' fonts, and some of which have no file or index
+FcFontSet *random_member_set(void)
+{
+	if (random_below(8) == 0) {
+		return NULL;
+	}
+
+	FcFontSet *set = FcFontSetCreate();
+	assert(set != NULL);
+
+	unsigned nfonts = random_below(MAX_FONTS + 1);
+	for (unsigned i = 0; i < nfonts; ++i) {
+		FcPattern *font = random_font();
+		if (random_below(10) == 0) {
+			FcPatternDel(font, FC_FILE);
+		}
+		if (random_below(5) == 0) {
+			FcPatternDel(font, FC_INDEX);
+		}
+
+		assert(FcFontSetAdd(set, font));
+	}
+
+	return set;
+}
+
+// Whether both fonts have a file, and they have the same file and index
+bool same_file(FcPattern *a, FcPattern *b)
+{
+	FcChar8 *a_file;
+	FcChar8 *b_file;
+	if (FcPatternGetString(a, FC_FILE, 0, &a_file) != FcResultMatch
+			|| FcPatternGetString(b, FC_FILE, 0, &b_file)
+				!= FcResultMatch) {
+		return false;
+	}
+
+	int a_index = 0;
+	int b_index = 0;
+	FcPatternGetInteger(a, FC_INDEX, 0, &a_index);
+	FcPatternGetInteger(b, FC_INDEX, 0, &b_index);
+
+	return strcmp((const char *)a_file, (const char *)b_file) == 0
+			&& a_index == b_index;
+}
+
+// Whether font `j` of set `i` has the same file and index as a font before it
+bool seen_before(FcFontSet **sets, size_t i, int j)
+{
+	FcPattern *font = sets[i]->fonts[j];
+
+	for (size_t k = 0; k <= i; ++k) {
+		if (sets[k] == NULL) {
+			continue;
+		}
+
+		int end = k < i ? sets[k]->nfont : j;
+		for (int l = 0; l < end; ++l) {
+			if (same_file(sets[k]->fonts[l], font)) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+// The fonts of every set in order, skipping those whose file and index came
+// before
+FcFontSet *dedup_union(FcFontSet **sets, size_t nsets)
+{
+	FcFontSet *merged = FcFontSetCreate();
+	assert(merged != NULL);
+
+	for (size_t i = 0; i < nsets; ++i) {
+		if (sets[i] == NULL) {
+			continue;
+		}
+
+		for (int j = 0; j < sets[i]->nfont; ++j) {
+			if (seen_before(sets, i, j)) {
+				continue;
+			}
+
+			FcPattern *font = sets[i]->fonts[j];
+			FcPatternReference(font);
+			assert(FcFontSetAdd(merged, font));
+		}
+	}
+
+	return merged;
+}
+
+void check_sets(FcFontSet **sets, size_t nsets)
+{
+	FcFontSet *merged = dedup_union(sets, nsets);
+
+	FfCondition *condition = random_condition(3);
+	FcFontSet *expected = ff_condition_filter(condition, merged);
+	FcFontSet *filtered = ff_condition_filter_sets(condition, sets, nsets);
+	assert(expected != NULL && filtered != NULL);
+	assert(font_sets_equal(filtered, expected));
+	FcFontSetDestroy(filtered);
+	FcFontSetDestroy(expected);
+	ff_condition_unref(condition);
+
+	FfList list = random_list(random_below(5), 2);
+
+	expected = ff_list_filter(list, merged);
+	filtered = ff_list_filter_sets(list, sets, nsets);
+	assert(expected != NULL && filtered != NULL);
+	assert(font_sets_equal(filtered, expected));
+	FcFontSetDestroy(filtered);
+	FcFontSetDestroy(expected);
+
+	expected = ff_list_filter_soft(list, merged);
+	filtered = ff_list_filter_soft_sets(list, sets, nsets);
+	assert(expected != NULL && filtered != NULL);
+	assert(font_sets_equal(filtered, expected));
+	FcFontSetDestroy(filtered);
+	FcFontSetDestroy(expected);
+
+	ff_list_destroy(list);
+	FcFontSetDestroy(merged);
+}